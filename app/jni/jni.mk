@@ -26,5 +26,5 @@ include $(GSTREAMER_NDK_BUILD_PATH)/plugins.mk
 GSTREAMER_PLUGINS         := coreelements autodetect videoparsersbad androidmedia rtsp rtp rtpmanager \
                              udp opengl srt hls dashdemux taglib flv rtmp rtspclientsink app
 G_IO_MODULES              := gnutls
-GSTREAMER_EXTRA_DEPS      := gstreamer-video-1.0
+GSTREAMER_EXTRA_DEPS      := gstreamer-video-1.0 gstreamer-app-1.0 gstreamer-rtp-1.0 gstreamer-sdp-1.0 gstreamer-codecparsers-1.0 gstreamer-pbutils-1.0
 include $(GSTREAMER_NDK_BUILD_PATH)/gstreamer-1.0.mk
@@ -17,18 +17,27 @@
  *
  */
 
+#include <stdio.h>
 #include <string.h>
 #include <stdint.h>
+#include <unistd.h>
 #include <jni.h>
 #include <android/log.h>
 #include <android/native_window.h>
 #include <android/native_window_jni.h>
 #include <gst/gst.h>
+#include <gst/app/gstappsink.h>
+#include <gst/app/gstappsrc.h>
 #include <gst/video/video.h>
 #include <gst/video/videooverlay.h>
 #include <gst/rtsp/gstrtsptransport.h>
+#include <gst/rtp/gstrtcpbuffer.h>
 #include <gst/sdp/gstsdpmessage.h>
+#define GST_USE_UNSTABLE_API
+#include <gst/codecparsers/gsth264parser.h>
+#include <gst/pbutils/codec-utils.h>
 #include <pthread.h>
+#include <time.h>
 #include <sys/system_properties.h>
 
 #define TAG "SongRTSPClientJNI"
@@ -59,22 +68,379 @@ GST_DEBUG_CATEGORY_STATIC (SongRTSPClientJNIG_category);
 #define USR_MESSAGE_PUSH_RTSP_SHUTDOWN   "1: push rtsp branch shutdown"
 #define USR_MESSAGE_FETCH_EOS_RESTART    "3: fetch eos, pipline restart"
 #define USR_MESSAGE_RTSP_SRC_ERR_RESTART "4: rtsp src err, pipline restart "
+#define USR_MESSAGE_BRANCH_SHUTDOWN      "5: branch shutdown: "
+#define USR_MESSAGE_PRE_EVENT_SAVED      "6: pre-event saved: "
+#define USR_MESSAGE_STALL_RESTART        "7: source stalled, pipline restart"
+#define USR_MESSAGE_BRANCH_HEALED        "8: branch reconnected: "
 
 #define BRANCH_DISABLE     0
 #define BRANCH_ENABLE      1
 #define BRANCH_DISABLE_ING 2
 #define BRANCH_ENABLE_ING  3
 
-#define RESET_REQUEST_NULL    0x00
-#define RESET_REQUEST_DISPLAY 0x01
-#define RESET_REQUEST_PRTMP   0x02
-#define RESET_REQUEST_PRTSP   0x04
-#define RESET_REQUEST_PIPELINE 0x07
+#define RESET_REQUEST_NULL     0x00
+#define RESET_REQUEST_PIPELINE 0x01
+#define RESET_REQUEST_SOURCE   0x02   /* rtspsrc alone, the branches stay up */
+
+/* Accumulated latency of one kind of operation, in microseconds */
+typedef struct _latency_stat {
+  guint count;
+  gint64 last;
+  gint64 max;
+  gint64 total;
+} latency_stat;
+
+/*
+ * Start/stop cost of a branch. start_cold counts the starts that had to build the
+ * elements, start_pooled the ones that re-linked the elements parked in the pool.
+ */
+typedef struct _branch_bench {
+  latency_stat start_cold;
+  latency_stat start_pooled;
+  latency_stat stop;
+  gint64 pending_begin;         /* the start or stop in flight */
+  gboolean pending_pooled;
+} branch_bench;
+
+/*
+ * Access units since the last key frame seen on a pad. With h264parse config-interval=-1
+ * the key frame carries the latest SPS/PPS, so the cache always starts decodable.
+ * Behind flvmux the stream headers travel in the caps instead, and are left out.
+ * With a window, whole GOPs are kept as long as the newer ones do not cover it yet.
+ */
+typedef struct _gop_cache {
+  GMutex lock;
+  GQueue buffers;
+  GQueue keys;                  /* links of the key frames in buffers, oldest first */
+  gsize bytes;
+  gsize max_bytes;
+  GstClockTime window;          /* 0 keeps the last GOP only */
+  gboolean valid;
+  gboolean stale;               /* from a closed session, flushed by the next push */
+  gboolean caps_headers;        /* HEADER buffers are in the caps streamheader */
+} gop_cache;
+
+#define GOP_CACHE_MAX_BYTES (4 * 1024 * 1024)
+
+/* The seconds before an incident, kept while the source runs, and after it stopped */
+#define PRE_EVENT_WINDOW         (30 * GST_SECOND)
+#define PRE_EVENT_MAX_BYTES      (32 * 1024 * 1024)
+#define PRE_EVENT_POST_SECONDS   10
+/* a capture queues the whole ring at once, and the post-event part up to as much again */
+#define PRE_EVENT_CAPTURE_BYTES  (2 * PRE_EVENT_MAX_BYTES)
+
+/* One save of the pre-event ring, written by its own appsrc -> flvmux -> filesink pipeline */
+typedef struct _pre_event_capture {
+  struct _CustomData *data;
+  GstElement *pipeline;
+  GstElement **elements;
+  gchar *location;
+  GstClockTime base;            /* timestamp of the first key frame, the file starts at 0 */
+  gboolean ended;
+  GSource *timer;               /* the post-event seconds */
+  GSource *bus_source;
+  gint64 begin;
+  guint64 bytes;
+  guint buffers;
+} pre_event_capture;
+
+/*
+ * CPU spent per frame up to the tee, sampled over CPU_METER_FRAMES frames. Only with
+ * the persist.gst.debug.cpumeter property set to 1, it costs two clock reads a frame.
+ */
+typedef struct _cpu_meter {
+  guint frames;
+  GThread *thread;              /* the streaming thread feeding the tee */
+  gint64 thread_begin;          /* ns of CPU time */
+  gint64 process_begin;
+} cpu_meter;
+
+#define CPU_METER_FRAMES 300
+
+#define JITTER_POLICY_MIN_LATENCY  0   /* as low as the late packets allow */
+#define JITTER_POLICY_SMOOTH       1   /* back off on any late packet, come down slowly */
+
+#define JITTER_CTL_INTERVAL_MS   1000
+#define JITTER_LATENCY_MIN_MS    10
+#define JITTER_LATENCY_MAX_MS    400
+#define JITTER_LATENCY_INIT_MS   41
+
+/*
+ * Retunes the latency of the jitterbuffer of the video session from its stats, once
+ * per interval, within [min_ms, max_ms].
+ */
+typedef struct _jitter_ctl {
+  GMutex lock;
+  GstElement *jitterbuffer;     /* while the source runs */
+  GSource *timer;
+  guint policy;
+  guint min_ms;
+  guint max_ms;
+  guint latency_ms;             /* for the next session too */
+  guint clean;                  /* intervals in a row without late packets */
+  guint64 pushed;               /* counters at the last interval */
+  guint64 lost;
+  guint64 late;
+  guint64 jitter_ns;
+  gdouble drop_rate;            /* lost and late over the last interval */
+} jitter_ctl;
+
+#define TRANSPORT_AUTO  0   /* UDP, TCP interleaved while UDP loses too much */
+#define TRANSPORT_UDP   1
+#define TRANSPORT_TCP   2
+
+#define TRANSPORT_LOSS_MAX       0.05
+#define TRANSPORT_LOSS_INTERVALS 3
+#define TRANSPORT_PROBE_S        60
+#define TRANSPORT_PROBE_MAX_S    600
+#define TRANSPORT_PROBE_OK_S     30
+
+/*
+ * Under TRANSPORT_AUTO, TRANSPORT_LOSS_INTERVALS jitter intervals in a row losing over
+ * TRANSPORT_LOSS_MAX move the source to TCP interleaved. After probe_s on TCP it tries
+ * UDP again; a probe that turns lossy doubles probe_s, one that holds TRANSPORT_PROBE_OK_S
+ * resets it. Only rtspsrc is replaced, the depayloader and the branches keep running.
+ */
+typedef struct _transport_policy {
+  GMutex lock;
+  gint policy;
+  gboolean tcp;                 /* of the source running, or the next one */
+  gboolean switching;           /* queued for the worker */
+  gboolean probing;             /* back on UDP to see if the link recovered */
+  guint lossy;                  /* lossy intervals in a row on UDP */
+  guint probe_s;
+  gint64 since_us;              /* on the current transport */
+  guint64 switches;
+} transport_policy;
+
+/*
+ * Capture time of the access units entering the tee, by PTS. A user data unregistered
+ * SEI with CAPTURE_SEI_UUID and a 64 bit big endian count of microseconds since the
+ * Unix epoch stamps an access unit. Without it, the NTP time of the last RTCP SR maps
+ * the PTS onto the sender clock.
+ */
+#define CAPTURE_SEI_UUID      "FishSemiCapture!"
+#define CAPTURE_SEI_SIZE      (16 + 8)
+#define CAPTURE_MAP_SIZE      256
+#define CAPTURE_REORDER_MAX   GST_SECOND    /* a PTS further back than that restarts the map */
+#define NTP_UNIX_OFFSET_S     G_GUINT64_CONSTANT (2208988800)
+
+typedef struct _capture_entry {
+  GstClockTime pts;
+  gint64 capture_us;
+} capture_entry;
+
+typedef struct _capture_clock {
+  GMutex lock;
+  capture_entry map[CAPTURE_MAP_SIZE];   /* ring in PTS order, from first */
+  guint first;
+  guint count;
+  gboolean sei;                 /* the stream stamps SEI, the SR mapping is not used */
+  GstClockTime sr_pts;          /* running time of the last SR */
+  gint64 sr_unix_us;            /* and its NTP time */
+} capture_clock;
+
+/* The last LATENCY_WINDOW capture latencies of an output, percentiles every LATENCY_REPORT */
+#define LATENCY_WINDOW   512
+#define LATENCY_REPORT   300
+
+typedef struct _latency_window {
+  gint64 samples[LATENCY_WINDOW];
+  guint count;
+} latency_window;
+
+/*
+ * Display latency budget. A frame older than deadline_ms since it reached the tee, or since
+ * the display branch started for replayed ones, is dropped ahead of the decoder. That breaks
+ * the reference chain, so the frames up to the next IDR go as well.
+ */
+#define ARRIVAL_MAP_SIZE     256
+#define DISPLAY_DEADLINE_MS  500
+
+typedef struct _arrival_entry {
+  GstClockTime pts;
+  gint64 arrival_us;
+} arrival_entry;
+
+typedef struct _display_deadline {
+  GMutex lock;
+  arrival_entry map[ARRIVAL_MAP_SIZE];
+  guint next;
+  gint deadline_ms;             /* 0 keeps every frame */
+  gint64 since_us;              /* the display branch started */
+  gboolean resync;              /* dropping up to the next IDR */
+  guint64 frames;
+  guint64 late;
+  guint64 skipped;              /* in time, but behind a dropped reference */
+  guint64 resyncs;
+  gint64 latency_us;            /* of the last rendered frame */
+  latency_window window;
+} display_deadline;
+
+/*
+ * Delay before a failed pipeline comes back: a fast first retry, then doubling from
+ * RECONNECT_BASE_MS up to RECONNECT_MAX_MS, each drawn from [delay / 2, delay] so that
+ * streams failing together do not reconnect in step. The sequence starts over once the
+ * stream has run RECONNECT_STABLE_MS.
+ */
+#define RECONNECT_FIRST_MS   100
+#define RECONNECT_BASE_MS    500
+#define RECONNECT_MAX_MS     4000
+#define RECONNECT_STABLE_MS  10000
+
+typedef struct _reconnect_backoff {
+  GMutex lock;
+  guint attempt;                /* retries since the stream was last stable */
+  guint64 count;
+  guint delay_ms;               /* of the last retry */
+  gint64 failed_us;             /* the outage began, 0 while streaming */
+  gint waiting;                 /* atomic, for the first buffer of a source */
+  gint64 up_us;                 /* the source delivered its first buffer */
+  gint64 recover_us;            /* last failure to first buffer */
+  gint64 recover_max_us;
+} reconnect_backoff;
+
+/*
+ * rtspsrc runs with timeout=0, so a path going dark only shows here: no buffer on the tee
+ * for stall_ms, or three times the usual arrival interval on a slow stream, restarts the
+ * pipeline. Checked every WATCHDOG_INTERVAL_MS, so a stall is declared within that much of
+ * the threshold. It is armed by the first buffer of each source.
+ */
+#define WATCHDOG_INTERVAL_MS  100
+#define WATCHDOG_STALL_MS     500
+
+typedef struct _stall_watchdog {
+  GMutex lock;
+  GSource *timer;
+  guint stall_ms;               /* 0 disables */
+  gint64 last_us;               /* last buffer on the tee, 0 while disarmed */
+  gint64 last_idr_us;
+  gint64 interval_us;           /* smoothed arrival interval */
+  gint64 gop_us;                /* between the last two IDRs */
+  guint64 stalls;
+  gint64 detect_us;             /* silence when the last stall was declared */
+  gint64 detect_max_us;
+} stall_watchdog;
+
+/*
+ * Phases of a new session up to its first frame, in ms from the start of the branch that
+ * opened it. Each phase is recorded once, by the first event of its kind while its bit
+ * is pending; the decoder phases only when the display opened the session. The report is
+ * a JSON line, logged and kept for the application, once nothing is pending.
+ */
+#define TTFF_CONNECT   0    /* rtspsrc connected to the server */
+#define TTFF_SDP       1    /* DESCRIBE answered */
+#define TTFF_PLAY      2    /* SETUP and PLAY done, the stream pad is linked */
+#define TTFF_RTP       3    /* first packet into the depayloader */
+#define TTFF_IDR       4    /* first key frame on the tee */
+#define TTFF_DECODED   5    /* first decoded frame */
+#define TTFF_RENDER    6    /* first frame into the video sink */
+#define TTFF_PHASES    7
+
+typedef struct _ttff_trace {
+  GMutex lock;
+  gint pending;                 /* bits of the phases still to come */
+  guint session;
+  gboolean cache_on;            /* the session cache was on when it began */
+  gboolean seeded;              /* transport and jitter latency came from the cache file */
+  gboolean cached;              /* the branches got the caps from the session cache */
+  gint64 begin_us;
+  gint64 phase_us[TTFF_PHASES];
+  gchar *report;
+} ttff_trace;
+
+/*
+ * Video parameters from the SPS of the session: the sprop-parameter-sets of the SDP, or
+ * the codec_data of the first caps on the tee for cameras that send them in band only.
+ * The application hears of a size as soon as it is known, and only once per size.
+ */
+typedef struct _media_info {
+  GMutex lock;
+  gboolean known;               /* for the running session */
+  gint width, height;           /* pixel aspect applied */
+  gint fps_n, fps_d;
+  const gchar *profile;
+  const gchar *level;
+  gint reported_width, reported_height;
+} media_info;
+
+/*
+ * Transit time through the elements of the vectors, from pad probes. One buffer in rate
+ * is timed from its sink pad to the src pad buffer with the same PTS, into a histogram of
+ * log2 microsecond buckets per element. rate 0 leaves only an atomic read per buffer.
+ */
+#define TRACE_BUCKETS 24
+
+typedef struct _tracer {
+  GMutex lock;
+  gint rate;
+  GHashTable *points;           /* element name -> trace_point, kept across rebuilds */
+} tracer;
+
+typedef struct _trace_point {
+  tracer *trace;
+  gint armed;                   /* a buffer is in transit */
+  guint skipped;                /* sink pad thread only */
+  GstClockTime pending_pts;
+  gint64 pending_us;
+  guint64 count;
+  guint64 total_us;
+  guint64 max_us;
+  guint64 buckets[TRACE_BUCKETS];
+} trace_point;
+
+/*
+ * The one flvmux of a stream. Every FLV output (rtmp, file) takes the muxed tags from its
+ * tee, so adding a consumer adds a queue and a sink, never another muxer.
+ */
+typedef struct _flv_core {
+  GstElement **elements;
+  GstPad *tee_srcpad;           /* on the H.264 tee */
+  GstPad *queue_sinkpad;
+  gint users;                   /* FLV branches started on it */
+  gboolean parking;             /* the last user's job parks it */
+  gboolean pool_flush;          /* rebuild the elements once parked */
+  gop_cache cache;              /* tags since the last key frame, for late consumers */
+} flv_core;
+
+typedef struct _branch branch;
+
+/*
+ * What the last session of each URL negotiated: its SDP, the sprop-parameter-sets of the
+ * video and the caps that reached the tee. While a new session announces the same sprop,
+ * the cached caps go to the branches as soon as its stream pad shows up, so the decoders
+ * configure while the first IDR is on its way. With a cache directory the entries, with
+ * the transport and jitter latency the session settled on, outlive the process in
+ * SESSION_CACHE_FILE, one serialized GstStructure per line.
+ */
+#define SESSION_CACHE_FILE "rtsp-sessions.cache"
+#define SESSION_CACHE_FLUSH_MS   5000
+#define SESSION_CACHE_SETTLE_MS  10000   /* a jitter latency held this long is worth keeping */
+
+typedef struct _session_entry {
+  gchar *sdp;
+  gchar *sprop;
+  GstCaps *caps;                /* for sprop */
+  guint hits;
+  gboolean tcp;
+  guint latency_ms;
+  gboolean seed;                /* loaded from the file, not used by a session yet */
+} session_entry;
+
+typedef struct _session_cache {
+  GMutex lock;
+  GHashTable *entries;          /* url -> session_entry, never removed */
+  gchar *path;                  /* of the file, NULL without a cache directory */
+  gboolean dirty;               /* entries changed since the file was written */
+} session_cache;
+
+static session_cache sessions;
 
 /* Structure to contain all our information, so we can pass it to callbacks */
 typedef struct _CustomData {
-  GMainContext *context;
-  pthread_t gst_app_thread;
+  guint id;
+  GMainContext *context;        /* the engine's, shared by all streams */
+  GSource *bus_source;
   jobject app;
 
   GstElement *pipeline;         /* The running pipeline */
@@ -82,80 +448,114 @@ typedef struct _CustomData {
   GstElement *rtspsrc;
   GstElement **rtspsrc_elements;
   GstPad *tee_sinkpad;
-  GstPad *tee_srcpad_display;
-  GstPad *tee_srcpad_push_rtmp;
-  GstPad *tee_srcpad_push_rtsp;
-  GstPad *tee_srcpad_recording;
+  gint source_handover;         /* atomic, a replaced source waits for its first IDR */
+  gop_cache tee_gop_cache;
+  flv_core flv;
+  GMutex pre_event_lock;        /* the ring and the captures fed from it */
+  gop_cache pre_event;
+  GstCaps *pre_event_caps;      /* of the ring, kept past the source */
+  GList *captures;
+  gboolean cpu_meter_enabled;
+  cpu_meter source_cpu;
+  jitter_ctl jitter;
+  transport_policy transport;
+  capture_clock capture;
+  tracer trace;
+  display_deadline deadline;
+  reconnect_backoff reconnect;
+  stall_watchdog watchdog;
+  ttff_trace ttff;
+  media_info media;
+  gboolean session_cache_enabled;
+  session_entry *session;       /* of the running source url */
+  GSource *session_timer;       /* writes the session cache file, every SESSION_CACHE_FLUSH_MS */
+  guint session_latency_ms;     /* jitter latency, held since session_latency_since */
+  gint64 session_latency_since;
   gboolean rtspsrc_linked;
   gchar *rtspsrc_url;
+  guint source_linger_ms;       /* keep the source playing this long after the last branch stops */
+  GSource *source_linger_timer;
+  gboolean source_stopping;
+  gchar *preroll_url;           /* to connect with no branch, once the source is free */
 
-  GstElement **display_elements;
-  GstPad *display_queue_sinkpad;
-  gchar display_enabled;
-  gboolean display_requst;
+  GHashTable *branches;         /* id -> branch, only the worker adds and removes */
+  branch *display;              /* the on-screen branch, driven by play/stop */
   ANativeWindow *native_window;
 
-  GstElement **push_rtmp_elements;
-  GstPad *push_rtmp_queue_sinkpad;
-  gboolean push_rtmp_enabled;
-  gboolean push_rtmp_request;
-  gchar *push_rtmp_url;
-
-  GstElement **push_rtsp_elements;
-  GstPad *push_rtsp_queue_sinkpad;
-  gchar push_rtsp_enabled;
-  gboolean push_rtsp_request;
-  gchar *push_rtsp_url;
-  GCond push_rtsp_cond_eos;
-
-  GstElement **recording_elements;
-  GstPad *recording_queue_sinkpad;
-  GstPad *filesink_sinkpad;
-  gboolean recording_enabled;
-  gchar *recording_dir;
-
   GAsyncQueue *worker_cmd_queue;
   GMutex mutex_branch;
-  pthread_t gst_worker_thread;
+  GCond branch_cond;            /* signalled when an async branch job finishes */
+  gint async_jobs;
+  GMutex worker_lock;
+  GCond worker_cond;            /* signalled when the worker goes back to idle */
+  gboolean worker_scheduled;    /* queued on, or running in, the engine worker pool */
   gboolean worker_run;
-  guchar reset_request;
+  gint reset_request;           /* atomic, requests from any thread */
+  gint reset_handled;           /* the requests the running reset took */
   gboolean pipeline_restarting;
-
-  GMainLoop *main_loop;         /* GLib main loop */
+  GSource *reset_timer;
+  guint reset_generation;       /* which arming of reset_timer a RESET_DONE belongs to */
+  latency_stat cmd_latency;
 
 } CustomData;
 
+/*
+ * Threads shared by every stream of the process: one main loop dispatching all the
+ * buses and timers, and a bounded pool the stream workers take turns on.
+ */
+typedef struct _engine {
+  GMutex lock;
+  guint streams;
+  guint next_id;
+  GMainContext *context;
+  GMainLoop *main_loop;
+  pthread_t thread;
+  GThreadPool *workers;
+  GThreadPool *finalizers;      /* closes recording segments off the streaming threads */
+  gint64 usage_cpu_us;          /* process CPU time at the last usage log */
+  gint64 usage_wall_us;
+} engine;
+
+#define ENGINE_MAX_WORKERS 2
+
+static engine shared_engine;
+
 typedef struct _element_node {
   gchar *factoryname;
   gchar *name;
 } element_node;
 
 /*
+ *                                                                                  .--> queue -> rtmpsink   (rtmp)
+ *                                                                                 |
+ *                                                          .--> queue -> flvmux -> tee
+ *                                                         |                       |
+ *                                                         |                        .--> queue -> appsink    (file, segments written by the recorder)
+ * rtspsrc -> rtph264depay -> h264parse -> capsfilter -> tee
+ *                                                         |
+ *                                                          .--> queue -> h264parse -> amcviddec-omxarmvideov5xxdecoder -> queue -> autovideosink (display)
+ *                                                         |
+ *                                                          .--> queue -> rtspclientsink           (rtsp)
  *
- *                                           .--> queue -> flvmux -> rtmpsink
- *                                          |
- *                                           .--> queue -> flvmux -> filesink
- *                                          |
- * rtspsrc -> rtph264depay -> h264parse -> tee -> queue -> flvmux -> fakesink
- *                                          |
- *                                           .--> queue -> h264parse -> amcviddec-omxarmvideov5xxdecoder -> queue -> autovideosink
- *                                          |
- *                                           .--> queue -> rtspclientsink
+ * Each output is an instance of one of the branch types and has its own tee request pad,
+ * so any number of them, of any type, can hang off the tee. With none linked (a lingering
+ * source) the tee drops the buffers, allow-not-linked keeps that from failing the source.
+ * The FLV outputs hang off the tee of the shared flv core instead, which is linked while
+ * at least one of them runs.
  * */
-#define FK_H264DEPAY 0
-#define FK_H264PARSE 1
-#define FK_TEE       2
-#define FK_QUEUE     3
-#define FK_FLVMUX    4
-#define FK_FAKESINK  5
-
-const static element_node fakesink_vector[] = {
-  {"rtph264depay", "f0-rtph264depay"},
-  {"h264parse", "f1-h264parse"},
-  {"tee", "f2-tee"},
-  {"queue", "f3-queue"},
-  {"flvmux", "f4-flvmux"},
-  {"fakesink", "f5-fakesink"},
+#define SC_H264DEPAY   0
+#define SC_H264PARSE   1
+#define SC_CAPSFILTER  2
+#define SC_TEE         3
+
+/* Branches come and go, so the tee caps are pinned to what every branch type accepts */
+#define SC_TEE_CAPS "video/x-h264, stream-format=(string)avc, alignment=(string)au"
+
+const static element_node source_vector[] = {
+  {"rtph264depay", "s0-rtph264depay"},
+  {"h264parse", "s1-h264parse"},
+  {"capsfilter", "s2-capsfilter"},
+  {"tee", "s3-tee"},
   {NULL, NULL}
 };
 
@@ -165,6 +565,9 @@ const static element_node fakesink_vector[] = {
 #define DP_QUEUE1    3
 #define DP_VIDEOSINK 4
 
+/* The decoder is kept open while the display branch is parked */
+#define DP_PARK_STATE GST_STATE_READY
+
 const static element_node display_vector[] = {
   {"queue", "v0-queue"},
   {"h264parse", "v1-264parse"},
@@ -174,20 +577,48 @@ const static element_node display_vector[] = {
   {NULL, NULL}
 };
 
+#define FC_QUEUE    0
+#define FC_FLVMUX   1
+#define FC_TEE      2
+
+#define FC_PARK_STATE GST_STATE_NULL
+#define FC_PREFIX     "flv"
+
+const static element_node flv_core_vector[] = {
+  {"queue", "fc0-queue"},
+  {"flvmux", "fc1-flvmux"},
+  {"tee", "fc2-tee"},
+  {NULL, NULL},
+};
+
+/* A slow FLV consumer drops tags in its own queue rather than hold up the shared muxer */
+#define FLV_CONSUMER_QUEUE_TIME (3 * GST_SECOND)
+
+/*
+ * A push queue takes in up to PUSH_QUEUE_TIME or PUSH_QUEUE_BYTES, checked at every key
+ * frame. Past either cap its input is dropped from that key frame up to the first one
+ * that finds it back under half of both, so the remote side loses whole GOPs and stays
+ * decodable. The queue limits themselves are only a backstop at twice the caps.
+ */
+#define PUSH_QUEUE_TIME  (3 * GST_SECOND)
+#define PUSH_QUEUE_BYTES (8 * 1024 * 1024)
+
 #define PU_RTMP_QUEUE   0
-#define PU_RTMP_FLVMUX  1
-#define PU_RTMPSINK     2
+#define PU_RTMPSINK     1
+
+#define PU_RTMP_PARK_STATE GST_STATE_NULL
 
 const static element_node push_rtmp_vector[] = {
   {"queue", "prtmp0-queue"},
-  {"flvmux", "prtmp1-flvmux"},
-  {"rtmpsink", "prtmp2-rtmpsink"},
+  {"rtmpsink", "prtmp1-rtmpsink"},
   {NULL, NULL},
 };
 
 #define PU_RTSP_QUEUE   0
 #define PU_RTSPSINK     1
 
+#define PU_RTSP_PARK_STATE GST_STATE_NULL
+
 const static element_node push_rtsp_vector[] = {
   {"queue", "prtsp0-queue"},
   {"rtspclientsink", "prtsp1-rtspclientsink"},
@@ -195,48 +626,196 @@ const static element_node push_rtsp_vector[] = {
 };
 
 #define RC_QUEUE     0
-#define RC_MP4MUX    1
-#define RC_FILESINK  2
+#define RC_APPSINK   1
+
+#define RC_PARK_STATE GST_STATE_NULL
 
 const static element_node recording_vector[] = {
   {"queue", "r0-queue"},
-  {"flvmux", "r2-flvmux"},
-  {"filesink", "r3-filesink"},
+  {"appsink", "r1-appsink"},
   {NULL, NULL},
 };
 
+/* A segment is cut at the first key frame past either limit, 0 for none */
+#define RC_SEGMENT_SECONDS  300
+#define RC_SEGMENT_MBYTES   0
+
+#define FLV_TAG_HEADER_SIZE 11
+
+#define BRANCH_TEARDOWN_UNLINK 0    /* unlink from the tee and park right away */
+#define BRANCH_TEARDOWN_DRAIN  1    /* push EOS through the branch first */
+
+#define BRANCH_DRAIN_TIMEOUT_MS 900
+
+#define BRANCH_UPSTREAM_H264  0     /* the source tee */
+#define BRANCH_UPSTREAM_FLV   1     /* the flv core tee */
+
+/*
+ * A healing branch is rebuilt on its own after an error, BRANCH_HEAL_FIRST_MS later,
+ * doubling up to BRANCH_HEAL_MAX_MS and drawn from [delay / 2, delay]. It counts as back
+ * once its sink took a second frame, the first one having gone out on the new connection.
+ */
+#define BRANCH_HEAL_FIRST_MS  500
+#define BRANCH_HEAL_MAX_MS    30000
+
+typedef struct _branch_heal {
+  GSource *timer;               /* the backoff before the rebuild */
+  guint attempt;
+  gint64 outage_begin;          /* 0 while the branch is fine */
+  gint64 restart_begin;         /* the rebuilt elements were set up */
+  guint frames;                 /* through the sink since */
+  guint outages;
+} branch_heal;
+
+/* Whole-GOP drops at the input of a bounded push queue, see PUSH_QUEUE_TIME */
+typedef struct _gop_dropper {
+  GstElement *queue;
+  gboolean dropping;
+  gint64 begin;                 /* of the current drop */
+  guint buffers;                /* dropped in the current drop */
+  guint64 bytes;
+  guint events;
+  guint64 total_buffers;
+} gop_dropper;
+
+/* A type of output: what to build, how to set it up and how to take it down */
+typedef struct _branch_desc {
+  const gchar *type;
+  const element_node *vector;   /* starts with the queue linked to the tee */
+  guint upstream;
+  int sink;                     /* its PLAYING confirms a start */
+  int ttff_element;             /* the first buffer on this pad is the first frame */
+  const gchar *ttff_pad;       /* and every buffer on it is output, for the capture latency */
+  const gchar *output;
+  GstState park_state;
+  guint teardown;
+  gboolean stop_on_error;       /* an error from the branch stops it, not the pipeline */
+  const gchar *fatal_error;     /* only this error does, if set */
+  gboolean heal;                /* an error from the branch rebuilds it alone, with backoff */
+  gboolean (*ready) (CustomData *data, branch *br);
+  void (*configure) (CustomData *data, branch *br);   /* once the elements are built */
+  void (*prepare) (CustomData *data, branch *br);     /* before every start */
+  void (*release) (CustomData *data, branch *br);     /* before the elements go */
+} branch_desc;
+
+/* One output instance, added at runtime under its id */
+struct _branch {
+  CustomData *data;
+  gchar *id;
+  const branch_desc *desc;
+  GstStructure *spec;           /* named after the type, fields go to the sink */
+  gchar *shutdown_message;
+  GstElement **elements;
+  void *priv;                   /* state of the branch type, with the elements */
+  GstPad *tee_srcpad;
+  GstPad *queue_sinkpad;
+  gchar enabled;
+  gboolean request;
+  gboolean remove;              /* drop the instance once it is down */
+  gboolean pool_flush;          /* rebuild the elements once parked */
+  gulong drain_probe;
+  GSource *drain_timer;
+  gulong ttff_probe;
+  gint64 ttff_begin;
+  gboolean ttff_lingering;
+  latency_stat ttff_cold;       /* first frame on a new RTSP session */
+  latency_stat ttff_warm;       /* first frame on a lingering source */
+  branch_bench bench;
+  gint64 cmd_time;              /* last command, from entering the worker queue */
+  gint stalls;                  /* the queue was full and held up the tee */
+  gop_dropper drop;             /* push branches */
+  branch_heal heal;
+  latency_window g2g;           /* capture to output, from its streaming thread */
+  gchar *g2g_label;             /* "<id> capture-to-<output>" */
+};
+
+#define BRANCH_ID_DISPLAY   "display"
+#define BRANCH_ID_PUSH_RTMP "push-rtmp"
+#define BRANCH_ID_PUSH_RTSP "push-rtsp"
+#define BRANCH_ID_RECORDING "recording"
+
+/* A finished recording segment, closed by the engine finalizers */
+typedef struct _rec_segment {
+  FILE *file;
+  gchar *location;
+  guint64 bytes;
+  guint32 duration_ms;
+  gint64 write_us;              /* spent in fwrite */
+  gint64 closed;
+} rec_segment;
+
+/* A recording branch, driven from its queue thread once started */
+typedef struct _recorder {
+  gchar *dir;
+  guint32 max_ms;
+  guint64 max_bytes;
+  guint index;
+  rec_segment *segment;         /* the open one */
+  guint32 base_ts;              /* FLV timestamp of its first tag */
+  guint32 last_ts;
+} recorder;
+
 typedef struct {
   guint index;
   gchar *comment;
 } _worker_cmd;
 
-#define WORKER_CMD          0
-#define WORKER_CMD_START_DISPLAY   1
-#define WORKER_CMD_STOP_DISPLAY    2
-#define WORKER_CMD_START_PUSH_RTSP 3
-#define WORKER_CMD_STOP_PUSH_RTSP  4
-#define WORKER_CMD_START_PUSH_RTMP 5
-#define WORKER_CMD_STOP_PUSH_RTMP  6
-#define WORKER_CMD_RESET_PIPELINE  7
+typedef struct {
+  const _worker_cmd *cmd;
+  gint64 queued;
+  gchar *id;                    /* branch commands, the URL of a preroll */
+  GstStructure *spec;
+  guint generation;             /* reset done: the reset timer that fired */
+} worker_msg;
+
+#define WORKER_CMD                 0
+#define WORKER_CMD_ADD_BRANCH      1
+#define WORKER_CMD_START_BRANCH    2
+#define WORKER_CMD_STOP_BRANCH     3
+#define WORKER_CMD_REMOVE_BRANCH   4
+#define WORKER_CMD_RESET_PIPELINE  5
+#define WORKER_CMD_STOP_SOURCE     6
+#define WORKER_CMD_RECONCILE       7
+#define WORKER_CMD_RESET_DONE      8
+#define WORKER_CMD_SAVE_PRE_EVENT  9
+#define WORKER_CMD_SWITCH_TRANSPORT 10
+#define WORKER_CMD_HEAL_BRANCH     11
+#define WORKER_CMD_PREROLL         12
 
 const static _worker_cmd worke_cmd[] = {
   {0, ""},
-  {1, "start display"},
-  {2, "stop display"},
-  {3, "start push rtsp"},
-  {4, "stop push rtsp"},
-  {5, "start push rtmp"},
-  {6, "stop push rtmp"},
-  {7, "reset pipeline"},
+  {1, "add branch"},
+  {2, "start branch"},
+  {3, "stop branch"},
+  {4, "remove branch"},
+  {5, "reset pipeline"},
+  {6, "stop source"},
+  {7, "reconcile"},
+  {8, "reset pipeline done"},
+  {9, "save pre-event"},
+  {10, "switch transport"},
+  {11, "heal branch"},
+  {12, "preroll"},
 };
 
+#define BRANCH_JOB_DONE "branch-job-done"
+
+typedef struct _branch_job {
+  CustomData *data;
+  branch *br;                   /* branch to park, if any */
+  gchar *name;
+  gboolean discard;             /* drop the branch from the pool once parked */
+  gboolean stop_source;         /* the pipeline goes to NULL first */
+  gboolean park_flv_core;       /* br was the last FLV consumer */
+  gint64 begin;
+} branch_job;
+
 static GstStateChangeReturn gst_elements_set_state_v (GstElement **el_v, GstState state) {
   GstStateChangeReturn ret;
   int i = 0;
 
   while (el_v[i] != NULL) {
     ret = gst_element_set_state (el_v[i], state);
-    gst_element_get_state (el_v[i], NULL, NULL, 2000);
     i++;
   }
   return ret;
@@ -278,852 +857,3326 @@ static gboolean gst_element_sync_state_with_parent_v (GstElement **el_v) {
   return TRUE;
 }
 
-static void set_usr_message (const gchar *message, CustomData *data);
-static gboolean launch_restart_process(CustomData *data, guchar reset_request);
-static GstPadProbeReturn probe_eos_cb (GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
-  CustomData *data = (CustomData *)user_data;
-  GstEvent *event = gst_pad_probe_info_get_event(info);
+/*
+ * Branches are built once and kept in the pipeline between start/stop, parked in
+ * park_state with their state locked so they do not follow the pipeline.
+ */
+static void gst_elements_park_v (GstElement **el_v, GstState park_state) {
+  gst_elements_set_locked_state_v (el_v, TRUE);
+  gst_elements_set_state_v (el_v, park_state);
+}
 
-  if (GST_EVENT_TYPE(event) != GST_EVENT_EOS)
-    return GST_PAD_PROBE_OK;
+static void latency_stat_update (latency_stat *stat, gint64 begin, const gchar *what) {
+  gint64 elapsed = g_get_monotonic_time () - begin;
 
-  if (data == NULL)
-    return GST_PAD_PROBE_OK;
+  stat->count++;
+  stat->last = elapsed;
+  stat->total += elapsed;
+  if (elapsed > stat->max)
+    stat->max = elapsed;
 
-  if (pad != data->tee_sinkpad)
-    return GST_PAD_PROBE_OK;
+  alogi ("%s: %" G_GINT64_FORMAT "us (avg:%" G_GINT64_FORMAT "us max:%" G_GINT64_FORMAT "us n:%u)",
+          what, elapsed, stat->total / stat->count, stat->max, stat->count);
+}
 
-  alogi("Probe EOS CB: tee_sinkpad receive eos.");
-  set_usr_message (USR_MESSAGE_FETCH_EOS_RESTART, data);
-  launch_restart_process (data, RESET_REQUEST_PIPELINE);
+static gint latency_compare (gconstpointer a, gconstpointer b) {
+  gint64 x = *(const gint64 *)a, y = *(const gint64 *)b;
 
-  return GST_PAD_PROBE_DROP;
+  return x < y ? -1 : x > y;
 }
 
-static void probe_rtspsrc_pad_added_cb (GstElement* element, GstPad* pad, gpointer _data) {
-  CustomData *data;
-  GstCaps *caps;
-  const GstStructure *s;
-  const gchar *encoding_name;
-  gchar *name, *description;
+/* Called from a single streaming thread per window */
+static void latency_window_add (latency_window *window, gint64 sample, const gchar *what) {
+  gint64 sorted[LATENCY_WINDOW];
+  guint n;
 
-  data = (CustomData *)_data;
-  name = gst_pad_get_name(pad);
-  caps = gst_pad_get_current_caps (pad);
-  if (!caps) {
-    aloge ("probe_rtspsrc_pad_added_cb: failed to get pad caps %s", name);
+  window->samples[window->count % LATENCY_WINDOW] = sample;
+  window->count++;
+  if (window->count % LATENCY_REPORT)
     return;
-  }
-
-  description = gst_caps_to_string (caps);
-  alogi ("probe_rtspsrc_pad_added_cb: name(%d):%s caps:%s", data->rtspsrc_linked, name, description);
-  g_free (name);
-  g_free (description);
 
-  if (data->rtspsrc_linked) {
-    alogi ("probe_rtspsrc_pad_added_cb: rtspsrc has been linked");
-    gst_caps_unref (caps);
-    return;
-  }
+  n = MIN (window->count, LATENCY_WINDOW);
+  memcpy (sorted, window->samples, n * sizeof (gint64));
+  qsort (sorted, n, sizeof (gint64), latency_compare);
+  alogi ("%s: p50 %" G_GINT64_FORMAT "us p95 %" G_GINT64_FORMAT "us p99 %" G_GINT64_FORMAT
+          "us (last %u of %u)", what, sorted[n * 50 / 100], sorted[n * 95 / 100],
+          sorted[n * 99 / 100], n, window->count);
+}
 
-  s = gst_caps_get_structure (caps, 0);
-  if (!s) {
-    aloge ("probe_rtspsrc_pad_added_cb: failed to get pad caps structure");
-    gst_caps_unref (caps);
-    return;
-  }
+static void gop_cache_init (gop_cache *cache, gsize max_bytes, GstClockTime window,
+        gboolean caps_headers) {
+  g_mutex_init (&cache->lock);
+  g_queue_init (&cache->buffers);
+  g_queue_init (&cache->keys);
+  cache->bytes = 0;
+  cache->max_bytes = max_bytes;
+  cache->window = window;
+  cache->valid = FALSE;
+  cache->stale = FALSE;
+  cache->caps_headers = caps_headers;
+}
 
-  encoding_name = gst_structure_get_string (s, "encoding-name");
-  if (!g_strcmp0 (encoding_name, "H264")) {
-    if (gst_element_link_pads(element, name, data->rtspsrc_elements[FK_H264DEPAY], NULL))
-      data->rtspsrc_linked = TRUE;
-    else
-      aloge ("probe_rtspsrc_pad_added_cb: failed to link elements");
-  } else {
-    aloge ("probe_rtspsrc_pad_added_cb: unsupported codec type %s", encoding_name);
-  }
+static void gop_cache_flush_unlocked (gop_cache *cache) {
+  GstBuffer *buffer;
 
-  gst_caps_unref (caps);
+  while ((buffer = (GstBuffer *)g_queue_pop_head (&cache->buffers)))
+    gst_buffer_unref (buffer);
+  g_queue_clear (&cache->keys);
+  cache->bytes = 0;
 }
 
-static void probe_rtspsrc_pad_removed_cb (GstElement* element, GstPad* pad, gpointer _data) {
-  CustomData *data;
-  gchar *name, *description;
+/* Drop the oldest GOP, the cache still starts on a key frame */
+static void gop_cache_drop_gop_unlocked (gop_cache *cache) {
+  GstBuffer *buffer;
+  GList *next_key;
+
+  g_queue_pop_head (&cache->keys);
+  next_key = (GList *)g_queue_peek_head (&cache->keys);
+  while (cache->buffers.head && cache->buffers.head != next_key) {
+    buffer = (GstBuffer *)g_queue_pop_head (&cache->buffers);
+    cache->bytes -= gst_buffer_get_size (buffer);
+    gst_buffer_unref (buffer);
+  }
+}
 
-  data = (CustomData *)_data;
-  name = gst_pad_get_name (pad);
-  description = gst_caps_to_string (gst_pad_get_pad_template_caps (pad));
+/* From the nth key frame to the newest buffer */
+static GstClockTime gop_cache_span_unlocked (gop_cache *cache, guint nth) {
+  GList *key = (GList *)g_queue_peek_nth (&cache->keys, nth);
+  GstClockTime first, last;
 
-  alogi ("probe_rtspsrc_pad_removed_cb: %s, pad name:%s", description, name);
-  data->rtspsrc_linked = FALSE;
+  first = GST_BUFFER_DTS_OR_PTS (GST_BUFFER (key->data));
+  last = GST_BUFFER_DTS_OR_PTS (GST_BUFFER (cache->buffers.tail->data));
+  if (!GST_CLOCK_TIME_IS_VALID (first) || !GST_CLOCK_TIME_IS_VALID (last) || last < first)
+    return 0;
 
-  g_free (name);
-  g_free (description);
+  return last - first;
 }
 
-static void cleanup_elements (GstElement *pipeline, GstElement **elements, int count) {
-  for (int i = 0; (i < count) && (elements[i] != NULL); i++) {
-
-    if ((i + 1) < count)
-      gst_element_unlink (elements[i], elements[i + 1]);
+static void gop_cache_flush (gop_cache *cache) {
+  g_mutex_lock (&cache->lock);
+  gop_cache_flush_unlocked (cache);
+  cache->valid = FALSE;
+  g_mutex_unlock (&cache->lock);
+}
 
-    alogi ("cleanup element %s", gst_element_get_name (elements[i]));
-    gst_element_set_locked_state (elements[i], FALSE);
-    gst_bin_remove (GST_BIN (pipeline), elements[i]);
-    gst_object_unref (elements[i]);
-    elements[i] = NULL;
-  }
+static void gop_cache_clear (gop_cache *cache) {
+  gop_cache_flush (cache);
+  g_mutex_clear (&cache->lock);
 }
 
-static gboolean setup_elements (GstElement *pipeline, GstElement **elements, const element_node *vector) {
-  int i;
+static void gop_cache_push (gop_cache *cache, GstBuffer *buffer) {
+  gsize size = gst_buffer_get_size (buffer);
+  gboolean key;
 
-  for (i = 0; vector[i].name != NULL; i++) {
-    elements[i] = gst_element_factory_make (vector[i].factoryname, vector[i].name);
-    if (!elements[i]) {
-      aloge ("Unable to create %s", vector[i].name);
-      break;
-    }
-    gst_object_ref (elements[i]);
+  if (cache->caps_headers && GST_BUFFER_FLAG_IS_SET (buffer, GST_BUFFER_FLAG_HEADER))
+    return;
 
-    alogi ("setup element create %s", vector[i].name);
-    gst_bin_add (GST_BIN (pipeline), elements[i]);
-    gst_element_set_locked_state (elements[i], TRUE);
+  g_mutex_lock (&cache->lock);
+  if (cache->stale) {
+    gop_cache_flush_unlocked (cache);
+    cache->valid = FALSE;
+    cache->stale = FALSE;
+  }
 
-    if (i)
-      gst_element_link (elements[i - 1], elements[i]);
+  key = !GST_BUFFER_FLAG_IS_SET (buffer, GST_BUFFER_FLAG_DELTA_UNIT);
+  if (key) {
+    if (!cache->window)
+      gop_cache_flush_unlocked (cache);
+    cache->valid = TRUE;
   }
 
-  if ( vector[i].name == NULL)
-    return TRUE;
+  if (cache->valid) {
+    g_queue_push_tail (&cache->buffers, gst_buffer_ref (buffer));
+    cache->bytes += size;
+    if (key)
+      g_queue_push_tail (&cache->keys, cache->buffers.tail);
 
-  i--;
-  cleanup_elements (pipeline, elements, i);
+    while (cache->keys.length > 1 && (cache->bytes > cache->max_bytes ||
+           gop_cache_span_unlocked (cache, 1) >= cache->window))
+      gop_cache_drop_gop_unlocked (cache);
 
-  return FALSE;
+    if (cache->bytes > cache->max_bytes) {
+      alogw ("gop cache: GOP exceeds %" G_GSIZE_FORMAT " bytes, not cached", cache->max_bytes);
+      gop_cache_flush_unlocked (cache);
+      cache->valid = FALSE;
+    }
+  }
+  g_mutex_unlock (&cache->lock);
 }
 
-static void cleanup_rtspsrc_elements (CustomData *data) {
-  int count;
+/* The session feeding the cache is gone, keep the buffers until the next one starts */
+static void gop_cache_expire (gop_cache *cache) {
+  g_mutex_lock (&cache->lock);
+  cache->stale = TRUE;
+  g_mutex_unlock (&cache->lock);
+}
 
-  if (!(data && data->pipeline && data->rtspsrc))
-    return;
+/* Refs of every cached buffer, oldest first. Returns whether they are from a closed session */
+static gboolean gop_cache_snapshot (gop_cache *cache, GQueue *out) {
+  gboolean stale;
+  GList *l;
 
-  if (data->rtspsrc_linked)
-    gst_element_unlink (data->rtspsrc, data->rtspsrc_elements[FK_H264DEPAY]);
-
-  gst_element_release_request_pad (data->rtspsrc_elements[FK_TEE],
-          data->tee_srcpad_display);
-  gst_element_release_request_pad (data->rtspsrc_elements[FK_TEE],
-          data->tee_srcpad_push_rtmp);
-  gst_element_release_request_pad (data->rtspsrc_elements[FK_TEE],
-          data->tee_srcpad_push_rtsp);
-  gst_element_release_request_pad (data->rtspsrc_elements[FK_TEE],
-          data->tee_srcpad_recording);
-
-  count = sizeof (fakesink_vector) / sizeof (element_node) - 1;
-  cleanup_elements (data->pipeline, data->rtspsrc_elements, count);
-  g_free (data->rtspsrc_elements);
+  g_mutex_lock (&cache->lock);
+  for (l = cache->buffers.head; cache->valid && l; l = l->next)
+    g_queue_push_tail (out, gst_buffer_ref (GST_BUFFER (l->data)));
+  stale = cache->stale;
+  g_mutex_unlock (&cache->lock);
 
-  gst_bin_remove (GST_BIN(data->pipeline), data->rtspsrc);
+  return stale;
+}
 
-  data->tee_srcpad_display = NULL;
-  data->tee_srcpad_push_rtmp = NULL;
-  data->tee_srcpad_push_rtsp = NULL;
-  data->tee_srcpad_recording = NULL;
-  data->rtspsrc = NULL;
+static GstPadProbeReturn probe_gop_cache_cb (GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+  gop_cache_push ((gop_cache *)user_data, GST_PAD_PROBE_INFO_BUFFER (info));
+  return GST_PAD_PROBE_OK;
 }
 
-static gboolean setup_rtspsrc_elements (CustomData *data) {
-  GstElement *pipeline, *rtspsrc, **elements;
-  GstPad *tee_sinkpad, *tee_srcpad[5];
-  int count, i;
+typedef struct _gop_replay {
+  gop_cache *cache;
+  gint64 attached;
+} gop_replay;
 
-  if (!data) {
-    aloge ("setup_rtspsrc_elements: Parameter error!");
-    return FALSE;
-  }
+#define GOP_REPLAY_PROBE "gop-replay-probe"
 
-  pipeline = data->pipeline;
-  if (!pipeline) {
-    aloge ("setup_rtspsrc_elements: get pipeline failed!");
-    return FALSE;
-  }
+/* The streamheader buffers of the caps on pad, for a consumer joining a running muxer */
+static void gop_replay_caps_headers (GstPad *pad, GQueue *pending) {
+  const GValue *headers, *header;
+  GstCaps *caps;
+  guint i;
 
-  rtspsrc = gst_element_factory_make ("rtspsrc", "rtspsrc");
-  if (!rtspsrc) {
-    aloge ("setup_rtspsrc_elements: create rtspsrc !");
-    return FALSE;
+  caps = gst_pad_get_current_caps (pad);
+  if (!caps)
+    return;
+
+  headers = gst_structure_get_value (gst_caps_get_structure (caps, 0), "streamheader");
+  if (headers && GST_VALUE_HOLDS_ARRAY (headers)) {
+    for (i = 0; i < gst_value_array_get_size (headers); i++) {
+      header = gst_value_array_get_value (headers, i);
+      if (GST_VALUE_HOLDS_BUFFER (header))
+        g_queue_push_tail (pending, gst_buffer_ref (gst_value_get_buffer (header)));
+    }
   }
 
-  count = sizeof (fakesink_vector) / sizeof (element_node);
-  elements = (GstElement **)g_malloc0 (sizeof(GstElement*) * count);
-  if (!elements) {
-    aloge ("setup_rtspsrc_elements: alloc elements failed !");
-    return FALSE;
+  gst_caps_unref (caps);
+}
+
+/*
+ * First buffer on a freshly linked tee src pad: chain the cached access units of the
+ * current GOP to the peer before the live buffer. The live buffer itself is already the
+ * tail of the cache, since the cache probe sits on the tee sink pad. Without a usable
+ * cache the pad waits for the next key frame instead. With caps_headers, the stream
+ * headers go first, unless the muxer is only starting and the live buffer is one of them.
+ */
+static GstPadProbeReturn probe_gop_replay_cb (GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+  gop_replay *replay = (gop_replay *)user_data;
+  gop_cache *cache = replay->cache;
+  GstBuffer *live = GST_PAD_PROBE_INFO_BUFFER (info);
+  GstBuffer *buffer;
+  GQueue pending = G_QUEUE_INIT;
+  GstPad *peer;
+  GList *l;
+  gboolean valid;
+  gboolean key;
+  guint count;
+
+  if (cache->caps_headers && GST_BUFFER_FLAG_IS_SET (live, GST_BUFFER_FLAG_HEADER)) {
+    alogi ("gop replay %s:%s: joined at the stream headers", GST_DEBUG_PAD_NAME (pad));
+    g_object_set_data (G_OBJECT (pad), GOP_REPLAY_PROBE, NULL);
+    return GST_PAD_PROBE_REMOVE;
   }
 
-  if (!setup_elements (pipeline, elements, fakesink_vector)) {
-    aloge ("setup_rtspsrc_elements:setup elements failed!");
-    g_free (elements);
-    return FALSE;
+  key = !GST_BUFFER_FLAG_IS_SET (live, GST_BUFFER_FLAG_DELTA_UNIT);
+  if (key && !cache->caps_headers && !cache->window) {
+    alogi ("gop replay %s:%s: joined on a key frame after %" G_GINT64_FORMAT "us",
+            GST_DEBUG_PAD_NAME (pad), g_get_monotonic_time () - replay->attached);
+    g_object_set_data (G_OBJECT (pad), GOP_REPLAY_PROBE, NULL);
+    return GST_PAD_PROBE_REMOVE;
   }
-  gst_elements_set_locked_state_v (elements, FALSE);
 
-  tee_sinkpad = gst_element_get_static_pad(elements[FK_TEE], "sink");
-  if (!tee_sinkpad) {
-    aloge ("setup_rtspsrc_elements: get tee_sinkpad failed!");
-    cleanup_elements (pipeline, elements, count - 1);
-    g_free (elements);
-    return FALSE;
+  g_mutex_lock (&cache->lock);
+  valid = cache->valid || key;
+  for (l = cache->buffers.head; valid && l && l->data != live; l = l->next)
+    g_queue_push_tail (&pending, gst_buffer_ref (GST_BUFFER (l->data)));
+  g_mutex_unlock (&cache->lock);
+
+  if (!valid)
+    return GST_PAD_PROBE_DROP;
+
+  if (cache->caps_headers) {
+    GQueue headers = G_QUEUE_INIT;
+
+    gop_replay_caps_headers (pad, &headers);
+    while ((buffer = (GstBuffer *)g_queue_pop_tail (&headers)))
+      g_queue_push_head (&pending, buffer);
   }
 
-  for (i = 0; i < 4; i++) {
-    tee_srcpad[i] = gst_element_get_request_pad (elements[FK_TEE], "src_%u");
-    if (!tee_srcpad[i]) {
-      aloge ("setup_rtspsrc_elements: get tee_srcpad[%d] failed!", i);
-      break;
+  count = pending.length;
+  peer = gst_pad_get_peer (pad);
+  while ((buffer = (GstBuffer *)g_queue_pop_head (&pending))) {
+    if (!peer) {
+      gst_buffer_unref (buffer);
+      continue;
     }
-  }
 
-  if (i != 4) {
-    for (--i; i > 0; i--) {
-      gst_element_release_request_pad (elements[FK_TEE], tee_srcpad[i]);
-      gst_object_unref (tee_srcpad[i]);
+    if (pending.length + 1 == count) {
+      buffer = gst_buffer_make_writable (buffer);
+      GST_BUFFER_FLAG_SET (buffer, GST_BUFFER_FLAG_DISCONT);
     }
 
-    cleanup_elements (pipeline, elements, count - 1);
-    g_free (elements);
-    return FALSE;
+    if (gst_pad_chain (peer, buffer) != GST_FLOW_OK) {
+      g_queue_foreach (&pending, (GFunc) gst_buffer_unref, NULL);
+      g_queue_clear (&pending);
+    }
   }
 
-  gst_bin_add (GST_BIN (pipeline), rtspsrc);
-  g_signal_connect(rtspsrc, "pad-added", G_CALLBACK(probe_rtspsrc_pad_added_cb), data);
-  //g_signal_connect(rtspsrc, "pad-removed", G_CALLBACK(probe_rtspsrc_pad_removed_cb), data);
-  g_object_set(G_OBJECT(rtspsrc), "latency", 41, "udp-reconnect",(gboolean) TRUE,
-      "timeout", (guint64) 0, "do-retransmission", (gboolean) FALSE, NULL);
+  if (peer)
+    gst_object_unref (peer);
 
-  // drop eos of autovideosink branch
-  gst_pad_add_probe(tee_sinkpad, GST_PAD_PROBE_TYPE_EVENT_BOTH, probe_eos_cb, data, NULL);
+  alogi ("gop replay %s:%s: %u cached buffers after %" G_GINT64_FORMAT "us",
+          GST_DEBUG_PAD_NAME (pad), count, g_get_monotonic_time () - replay->attached);
+  g_object_set_data (G_OBJECT (pad), GOP_REPLAY_PROBE, NULL);
+  return GST_PAD_PROBE_REMOVE;
+}
 
-  g_object_set (G_OBJECT(elements[FK_H264PARSE]), "config-interval", -1, NULL);
-  g_object_set (G_OBJECT(elements[FK_FLVMUX]), "streamable", TRUE, NULL);
-  //g_object_set (G_OBJECT(tee), "allow-not-linked", (gboolean) TRUE, NULL);
+/* Arm the replay for a tee src pad that is about to be linked to a branch */
+static void gop_cache_attach (gop_cache *cache, GstPad *tee_srcpad) {
+  gop_replay *replay;
+  gulong probe;
+
+  probe = GPOINTER_TO_UINT (g_object_get_data (G_OBJECT (tee_srcpad), GOP_REPLAY_PROBE));
+  if (probe)
+    gst_pad_remove_probe (tee_srcpad, probe);
+
+  replay = g_new0 (gop_replay, 1);
+  replay->cache = cache;
+  replay->attached = g_get_monotonic_time ();
+  probe = gst_pad_add_probe (tee_srcpad, GST_PAD_PROBE_TYPE_BUFFER,
+          probe_gop_replay_cb, replay, g_free);
+  g_object_set_data (G_OBJECT (tee_srcpad), GOP_REPLAY_PROBE, GUINT_TO_POINTER (probe));
+}
 
-  data->rtspsrc = rtspsrc;
-  data->rtspsrc_elements = elements;
-  data->tee_sinkpad = tee_sinkpad;
-  data->tee_srcpad_display = tee_srcpad[0];
-  data->tee_srcpad_push_rtmp = tee_srcpad[1];
-  data->tee_srcpad_push_rtsp = tee_srcpad[2];
-  data->tee_srcpad_recording = tee_srcpad[3];
+static void set_usr_message (const gchar *message, CustomData *data);
+static gboolean launch_restart_process(CustomData *data, gint reset_request);
+static GstPadProbeReturn probe_eos_cb (GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+  CustomData *data = (CustomData *)user_data;
+  GstEvent *event = gst_pad_probe_info_get_event(info);
+
+  if (GST_EVENT_TYPE(event) != GST_EVENT_EOS)
+    return GST_PAD_PROBE_OK;
+
+  if (data == NULL)
+    return GST_PAD_PROBE_OK;
+
+  if (pad != data->tee_sinkpad)
+    return GST_PAD_PROBE_OK;
+
+  alogi("Probe EOS CB: tee_sinkpad receive eos.");
+  set_usr_message (USR_MESSAGE_FETCH_EOS_RESTART, data);
+  launch_restart_process (data, RESET_REQUEST_SOURCE);
+
+  return GST_PAD_PROBE_DROP;
+}
+
+static gint64 cpu_time_ns (clockid_t clock) {
+  struct timespec ts;
+
+  clock_gettime (clock, &ts);
+  return (gint64) ts.tv_sec * G_GINT64_CONSTANT (1000000000) + ts.tv_nsec;
+}
+
+/*
+ * CPU per frame of the source chain: the streaming thread feeding the tee runs depay,
+ * parse and the tee itself, the process figure adds everything else of the session.
+ */
+static GstPadProbeReturn probe_cpu_meter_cb (GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+  CustomData *data = (CustomData *)user_data;
+  cpu_meter *meter = &data->source_cpu;
+  gint64 thread_now = cpu_time_ns (CLOCK_THREAD_CPUTIME_ID);
+  gint64 process_now = cpu_time_ns (CLOCK_PROCESS_CPUTIME_ID);
+
+  if (meter->thread == g_thread_self () && ++meter->frames < CPU_METER_FRAMES)
+    return GST_PAD_PROBE_OK;
+
+  if (meter->thread == g_thread_self ())
+    alogi ("source chain cpu per frame (%d branches): %" G_GINT64_FORMAT "us streaming thread, %"
+            G_GINT64_FORMAT "us process", data->pipeline_ref,
+            (thread_now - meter->thread_begin) / meter->frames / 1000,
+            (process_now - meter->process_begin) / meter->frames / 1000);
+
+  meter->thread = g_thread_self ();
+  meter->frames = 0;
+  meter->thread_begin = thread_now;
+  meter->process_begin = process_now;
+
+  return GST_PAD_PROBE_OK;
+}
+
+static void capture_clock_reset (capture_clock *clock) {
+  g_mutex_lock (&clock->lock);
+  clock->first = 0;
+  clock->count = 0;
+  clock->sei = FALSE;
+  clock->sr_pts = GST_CLOCK_TIME_NONE;
+  g_mutex_unlock (&clock->lock);
+}
+
+/* The SEI RBSP of one NAL without its emulation prevention bytes, up to size */
+static gsize capture_sei_unescape (const guint8 *nal, gsize nal_size, guint8 *rbsp, gsize size) {
+  gsize i, n = 0;
+  guint zeros = 0;
+
+  for (i = 1; i < nal_size && n < size; i++) {
+    if (zeros >= 2 && nal[i] == 0x03) {
+      zeros = 0;
+      continue;
+    }
+    zeros = nal[i] ? 0 : zeros + 1;
+    rbsp[n++] = nal[i];
+  }
+
+  return n;
+}
+
+/* Capture time from the SEI NALs of an avc access unit with 4 byte lengths, or -1 */
+static gint64 capture_sei_parse (const guint8 *data, gsize size) {
+  guint8 rbsp[64];
+  gsize offset = 0, nal_size, n, i;
+  guint type, payload_size;
+
+  while (offset + 4 < size) {
+    nal_size = GST_READ_UINT32_BE (data + offset);
+    offset += 4;
+    if (nal_size > size - offset)
+      break;
+
+    if ((data[offset] & 0x1f) == 6) {
+      n = capture_sei_unescape (data + offset, nal_size, rbsp, sizeof (rbsp));
+      for (i = 0; i < n && rbsp[i] != 0x80; i += payload_size) {
+        for (type = 0; i < n && rbsp[i] == 0xff; i++)
+          type += 0xff;
+        type += i < n ? rbsp[i++] : 0;
+        for (payload_size = 0; i < n && rbsp[i] == 0xff; i++)
+          payload_size += 0xff;
+        payload_size += i < n ? rbsp[i++] : 0;
+
+        if (type == 5 && payload_size >= CAPTURE_SEI_SIZE && i + CAPTURE_SEI_SIZE <= n &&
+            !memcmp (rbsp + i, CAPTURE_SEI_UUID, 16))
+          return (gint64) GST_READ_UINT64_BE (rbsp + i + 16);
+      }
+    }
+    offset += nal_size;
+  }
+
+  return -1;
+}
+
+/* Frames come in decode order, only the reordered ones move back. Called with the lock */
+static void capture_clock_insert (capture_clock *clock, GstClockTime pts, gint64 capture_us) {
+  guint i, prev;
+
+  if (clock->count &&
+      pts + CAPTURE_REORDER_MAX < clock->map[(clock->first + clock->count - 1) % CAPTURE_MAP_SIZE].pts)
+    clock->count = 0;
+
+  if (clock->count == CAPTURE_MAP_SIZE) {
+    clock->first = (clock->first + 1) % CAPTURE_MAP_SIZE;
+    clock->count--;
+  }
+
+  i = (clock->first + clock->count) % CAPTURE_MAP_SIZE;
+  clock->count++;
+  while (i != clock->first) {
+    prev = (i + CAPTURE_MAP_SIZE - 1) % CAPTURE_MAP_SIZE;
+    if (clock->map[prev].pts <= pts)
+      break;
+    clock->map[i] = clock->map[prev];
+    i = prev;
+  }
+
+  clock->map[i].pts = pts;
+  clock->map[i].capture_us = capture_us;
+}
+
+static GstPadProbeReturn probe_capture_clock_cb (GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+  capture_clock *clock = &((CustomData *)user_data)->capture;
+  GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER (info);
+  GstClockTime pts = GST_BUFFER_PTS (buffer);
+  gint64 capture_us = -1;
+  GstMapInfo map;
+
+  if (!GST_CLOCK_TIME_IS_VALID (pts))
+    return GST_PAD_PROBE_OK;
+
+  if (gst_buffer_map (buffer, &map, GST_MAP_READ)) {
+    capture_us = capture_sei_parse (map.data, map.size);
+    gst_buffer_unmap (buffer, &map);
+  }
+
+  g_mutex_lock (&clock->lock);
+  if (capture_us >= 0)
+    clock->sei = TRUE;
+  else if (!clock->sei && GST_CLOCK_TIME_IS_VALID (clock->sr_pts))
+    capture_us = clock->sr_unix_us + GST_CLOCK_DIFF (clock->sr_pts, pts) / GST_USECOND;
+
+  if (capture_us >= 0)
+    capture_clock_insert (clock, pts, capture_us);
+  g_mutex_unlock (&clock->lock);
+
+  return GST_PAD_PROBE_OK;
+}
+
+/* Capture time of the access unit at ts, flvmux rounds timestamps down to the millisecond */
+static gint64 capture_clock_lookup (capture_clock *clock, GstClockTime ts) {
+  capture_entry *entry;
+  gint64 capture_us = -1;
+  guint lo = 0, hi, mid;
+
+  /* the first entry at or after ts */
+  g_mutex_lock (&clock->lock);
+  hi = clock->count;
+  while (lo < hi) {
+    mid = (lo + hi) / 2;
+    if (clock->map[(clock->first + mid) % CAPTURE_MAP_SIZE].pts < ts)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  if (lo < clock->count) {
+    entry = &clock->map[(clock->first + lo) % CAPTURE_MAP_SIZE];
+    if (entry->pts - ts < GST_MSECOND)
+      capture_us = entry->capture_us;
+  }
+  g_mutex_unlock (&clock->lock);
+
+  return capture_us;
+}
+
+/* jitterbuffer, on an RTCP SR: where the sender clock is at the running time of the SR */
+static void capture_handle_sync_cb (GstElement *jitterbuffer, GstStructure *s, gpointer user_data) {
+  capture_clock *clock = &((CustomData *)user_data)->capture;
+  GstRTCPBuffer rtcp = GST_RTCP_BUFFER_INIT;
+  GstRTCPPacket packet;
+  guint64 base_rtptime, base_time, sr_ext_rtptime, ntptime;
+  guint clock_rate;
+  GstBuffer *sr;
+  gboolean ret;
+
+  if (!gst_structure_get (s, "base-rtptime", G_TYPE_UINT64, &base_rtptime,
+          "base-time", G_TYPE_UINT64, &base_time, "clock-rate", G_TYPE_UINT, &clock_rate,
+          "sr-ext-rtptime", G_TYPE_UINT64, &sr_ext_rtptime, "sr-buffer", GST_TYPE_BUFFER, &sr, NULL))
+    return;
+
+  gst_rtcp_buffer_map (sr, GST_MAP_READ, &rtcp);
+  ret = gst_rtcp_buffer_get_first_packet (&rtcp, &packet) &&
+        gst_rtcp_packet_get_type (&packet) == GST_RTCP_TYPE_SR;
+  if (ret)
+    gst_rtcp_packet_sr_get_sender_info (&packet, NULL, &ntptime, NULL, NULL, NULL);
+  gst_rtcp_buffer_unmap (&rtcp);
+  gst_buffer_unref (sr);
+
+  if (!ret || !clock_rate || sr_ext_rtptime < base_rtptime)
+    return;
+
+  g_mutex_lock (&clock->lock);
+  clock->sr_pts = base_time + gst_util_uint64_scale_int (sr_ext_rtptime - base_rtptime, GST_SECOND, clock_rate);
+  clock->sr_unix_us = ((ntptime >> 32) - NTP_UNIX_OFFSET_S) * G_USEC_PER_SEC +
+          gst_util_uint64_scale (ntptime & G_GUINT64_CONSTANT (0xffffffff), G_USEC_PER_SEC,
+          G_GUINT64_CONSTANT (1) << 32);
+  g_mutex_unlock (&clock->lock);
+}
+
+/* rtpbin, for a new SSRC. The controller follows the latest one, the video session */
+static void jitter_new_jitterbuffer_cb (GstElement *rtpbin, GstElement *jitterbuffer,
+        guint session, guint ssrc, gpointer user_data) {
+  jitter_ctl *ctl = &((CustomData *)user_data)->jitter;
+
+  g_mutex_lock (&ctl->lock);
+  gst_object_replace ((GstObject **)&ctl->jitterbuffer, GST_OBJECT (jitterbuffer));
+  ctl->pushed = ctl->lost = ctl->late = 0;
+  ctl->clean = 0;
+  g_object_set (G_OBJECT(jitterbuffer), "latency", ctl->latency_ms, NULL);
+  g_mutex_unlock (&ctl->lock);
+
+  g_signal_connect (jitterbuffer, "handle-sync", G_CALLBACK (capture_handle_sync_cb), user_data);
+
+  alogi ("jitter: session %u ssrc %u at %ums", session, ssrc, ctl->latency_ms);
+}
+
+static void jitter_new_manager_cb (GstElement *rtspsrc, GstElement *manager, gpointer user_data) {
+  g_signal_connect (manager, "new-jitterbuffer", G_CALLBACK (jitter_new_jitterbuffer_cb), user_data);
+}
+
+static void jitter_source_closed (jitter_ctl *ctl) {
+  g_mutex_lock (&ctl->lock);
+  gst_object_replace ((GstObject **)&ctl->jitterbuffer, NULL);
+  g_mutex_unlock (&ctl->lock);
+}
+
+static guint64 jitter_counter_delta (guint64 now, guint64 before) {
+  return now >= before ? now - before : now;
+}
+
+static guint jitter_next_latency (jitter_ctl *ctl, gdouble late_rate) {
+  guint jitter_ms = ctl->jitter_ns / GST_MSECOND;
+  guint latency = ctl->latency_ms;
+  guint floor;
+
+  ctl->clean = late_rate > 0 ? 0 : ctl->clean + 1;
+
+  if (ctl->policy == JITTER_POLICY_SMOOTH) {
+    floor = 4 * jitter_ms + 20;
+    if (late_rate > 0)
+      latency += MAX (latency / 2, 20);
+    else if (ctl->clean >= 10)
+      latency -= MIN (latency, MAX (latency / 16, 1));
+  } else {
+    floor = 2 * jitter_ms + 5;
+    if (late_rate > 0.005)
+      latency += MAX (latency / 4, 10);
+    else if (ctl->clean >= 3)
+      latency -= MIN (latency, MAX (latency / 8, 2));
+  }
+
+  return CLAMP (MAX (latency, floor), ctl->min_ms, ctl->max_ms);
+}
+
+static void notify_worker_update_pipeline (CustomData *data, guint cmd);
+
+/* Called with the transport lock held */
+static void transport_switch_unlocked (CustomData *data, gboolean tcp, const gchar *why) {
+  transport_policy *tp = &data->transport;
+
+  alogi ("transport: %s -> %s (%s)", tp->tcp ? "tcp" : "udp", tcp ? "tcp" : "udp", why);
+  tp->tcp = tcp;
+  tp->lossy = 0;
+  tp->since_us = g_get_monotonic_time ();
+  tp->switches++;
+  if (!tp->switching) {
+    tp->switching = TRUE;
+    notify_worker_update_pipeline (data, WORKER_CMD_SWITCH_TRANSPORT);
+  }
+}
+
+/* Engine loop thread, with the loss of the last jitter interval */
+static void transport_tick (CustomData *data, gdouble drop_rate) {
+  transport_policy *tp = &data->transport;
+  gint64 now = g_get_monotonic_time ();
+
+  g_mutex_lock (&tp->lock);
+  if (tp->policy != TRANSPORT_AUTO || tp->switching) {
+    g_mutex_unlock (&tp->lock);
+    return;
+  }
+
+  if (!tp->tcp) {
+    tp->lossy = drop_rate > TRANSPORT_LOSS_MAX ? tp->lossy + 1 : 0;
+    if (tp->lossy >= TRANSPORT_LOSS_INTERVALS) {
+      if (tp->probing)
+        tp->probe_s = MIN (tp->probe_s * 2, TRANSPORT_PROBE_MAX_S);
+      tp->probing = FALSE;
+      transport_switch_unlocked (data, TRUE, "udp loss");
+    } else if (tp->probing && now - tp->since_us >= TRANSPORT_PROBE_OK_S * G_TIME_SPAN_SECOND) {
+      alogi ("transport: udp holding again");
+      tp->probing = FALSE;
+      tp->probe_s = TRANSPORT_PROBE_S;
+    }
+  } else if (now - tp->since_us >= (gint64) tp->probe_s * G_TIME_SPAN_SECOND) {
+    tp->probing = TRUE;
+    transport_switch_unlocked (data, FALSE, "probe");
+  }
+  g_mutex_unlock (&tp->lock);
+}
+
+/* Engine loop thread, every JITTER_CTL_INTERVAL_MS */
+static gboolean jitter_ctl_timeout_cb (gpointer user_data) {
+  CustomData *data = (CustomData *)user_data;
+  jitter_ctl *ctl = &data->jitter;
+  guint64 pushed, lost, late, total;
+  GstStructure *stats;
+  gdouble drop_rate;
+  guint latency;
+
+  g_mutex_lock (&ctl->lock);
+  if (!ctl->jitterbuffer) {
+    g_mutex_unlock (&ctl->lock);
+    return G_SOURCE_CONTINUE;
+  }
+
+  g_object_get (G_OBJECT(ctl->jitterbuffer), "stats", &stats, NULL);
+  gst_structure_get (stats, "num-pushed", G_TYPE_UINT64, &pushed, "num-lost", G_TYPE_UINT64, &lost,
+          "num-late", G_TYPE_UINT64, &late, "avg-jitter", G_TYPE_UINT64, &ctl->jitter_ns, NULL);
+  gst_structure_free (stats);
+
+  total = jitter_counter_delta (pushed, ctl->pushed) + jitter_counter_delta (lost, ctl->lost) +
+          jitter_counter_delta (late, ctl->late);
+  if (total) {
+    ctl->drop_rate = (gdouble)(jitter_counter_delta (lost, ctl->lost) +
+            jitter_counter_delta (late, ctl->late)) / total;
+
+    latency = jitter_next_latency (ctl, (gdouble) jitter_counter_delta (late, ctl->late) / total);
+    if (latency != ctl->latency_ms) {
+      alogi ("jitter: latency %u -> %ums (jitter:%" G_GUINT64_FORMAT "us drop:%.2f%%)", ctl->latency_ms,
+              latency, ctl->jitter_ns / GST_USECOND, ctl->drop_rate * 100);
+      ctl->latency_ms = latency;
+      g_object_set (G_OBJECT(ctl->jitterbuffer), "latency", latency, NULL);
+    }
+  }
+
+  ctl->pushed = pushed;
+  ctl->lost = lost;
+  ctl->late = late;
+  drop_rate = ctl->drop_rate;
+  g_mutex_unlock (&ctl->lock);
+
+  if (total)
+    transport_tick (data, drop_rate);
+
+  return G_SOURCE_CONTINUE;
+}
+
+static const gchar *ttff_phase_names[TTFF_PHASES] = {
+  "connect", "sdp", "play", "first_rtp", "first_idr", "first_decoded", "first_render"
+};
+
+/* A new session, the decoder phases are timed when the display opens it */
+static void ttff_trace_begin (ttff_trace *tt, gboolean display) {
+  g_mutex_lock (&tt->lock);
+  tt->session++;
+  tt->begin_us = g_get_monotonic_time ();
+  tt->cached = FALSE;
+  memset (tt->phase_us, 0, sizeof (tt->phase_us));
+  g_atomic_int_set (&tt->pending, display ? (1 << TTFF_PHASES) - 1 : (1 << TTFF_DECODED) - 1);
+  g_mutex_unlock (&tt->lock);
+}
+
+static void ttff_trace_mark (ttff_trace *tt, guint phase) {
+  GString *json;
+  guint i;
+
+  if (!(g_atomic_int_get (&tt->pending) & (1 << phase)))
+    return;
+
+  g_mutex_lock (&tt->lock);
+  if (!(tt->pending & (1 << phase))) {
+    g_mutex_unlock (&tt->lock);
+    return;
+  }
+
+  tt->phase_us[phase] = g_get_monotonic_time () - tt->begin_us;
+  g_atomic_int_and (&tt->pending, ~(1 << phase));
+  if (tt->pending) {
+    g_mutex_unlock (&tt->lock);
+    return;
+  }
+
+  json = g_string_new (NULL);
+  g_string_append_printf (json, "{\"session\":%u,\"gstreamer\":\"%u.%u.%u\",\"session_cache\":\"%s\","
+          "\"seeded\":%s,\"cached\":%s", tt->session, GST_VERSION_MAJOR, GST_VERSION_MINOR,
+          GST_VERSION_MICRO, tt->cache_on ? "on" : "off", tt->seeded ? "true" : "false",
+          tt->cached ? "true" : "false");
+  for (i = 0; i < TTFF_PHASES; i++) {
+    if (tt->phase_us[i])
+      g_string_append_printf (json, ",\"%s_ms\":%.1f", ttff_phase_names[i], tt->phase_us[i] / 1000.0);
+    else
+      g_string_append_printf (json, ",\"%s_ms\":null", ttff_phase_names[i]);
+  }
+  g_string_append_c (json, '}');
+
+  g_free (tt->report);
+  tt->report = g_string_free (json, FALSE);
+  alogi ("ttff: %s", tt->report);
+  g_mutex_unlock (&tt->lock);
+}
+
+static GstPadProbeReturn probe_ttff_cb (GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+  ttff_trace *tt = (ttff_trace *)g_object_get_data (G_OBJECT (pad), "ttff-trace");
+  GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER (info);
+  guint phase = GPOINTER_TO_UINT (user_data);
+
+  if (phase != TTFF_IDR || !GST_BUFFER_FLAG_IS_SET (buffer, GST_BUFFER_FLAG_DELTA_UNIT))
+    ttff_trace_mark (tt, phase);
+
+  return GST_PAD_PROBE_OK;
+}
+
+static void ttff_trace_attach (ttff_trace *tt, GstElement *element, const gchar *pad_name, guint phase) {
+  GstPad *pad = gst_element_get_static_pad (element, pad_name);
+
+  g_object_set_data (G_OBJECT (pad), "ttff-trace", tt);
+  gst_pad_add_probe (pad, GST_PAD_PROBE_TYPE_BUFFER, probe_ttff_cb, GUINT_TO_POINTER (phase), NULL);
+  gst_object_unref (pad);
+}
+
+static void media_info_from_sprop (CustomData *data, const gchar *sprop);
+
+static session_entry *session_cache_get (const gchar *url) {
+  session_entry *entry;
+
+  g_mutex_lock (&sessions.lock);
+  if (!sessions.entries)
+    sessions.entries = g_hash_table_new (g_str_hash, g_str_equal);
+  entry = (session_entry *)g_hash_table_lookup (sessions.entries, url);
+  if (!entry) {
+    entry = g_new0 (session_entry, 1);
+    g_hash_table_insert (sessions.entries, g_strdup (url), entry);
+  }
+  g_mutex_unlock (&sessions.lock);
+
+  return entry;
+}
+
+static void ttff_on_sdp_cb (GstElement *rtspsrc, GstSDPMessage *sdp, gpointer user_data) {
+  CustomData *data = (CustomData *)user_data;
+
+  ttff_trace_mark (&data->ttff, TTFF_SDP);
+
+  g_mutex_lock (&sessions.lock);
+  g_free (data->session->sdp);
+  data->session->sdp = gst_sdp_message_as_text (sdp);
+  sessions.dirty = TRUE;
+  g_mutex_unlock (&sessions.lock);
+}
+
+/* The caps the tee takes for the sprop of the session */
+static GstPadProbeReturn probe_session_caps_cb (GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+  CustomData *data = (CustomData *)user_data;
+  GstEvent *event = GST_PAD_PROBE_INFO_EVENT (info);
+  GstCaps *caps;
+
+  if (GST_EVENT_TYPE (event) != GST_EVENT_CAPS)
+    return GST_PAD_PROBE_OK;
+
+  gst_event_parse_caps (event, &caps);
+  g_mutex_lock (&sessions.lock);
+  if (data->session->sprop && !(data->session->caps && gst_caps_is_equal (data->session->caps, caps))) {
+    gst_caps_replace (&data->session->caps, caps);
+    sessions.dirty = TRUE;
+  }
+  g_mutex_unlock (&sessions.lock);
+
+  return GST_PAD_PROBE_OK;
+}
+
+/*
+ * rtspsrc thread, with the stream pad not linked yet, so nothing from the session can
+ * overtake the cached caps on their way to the branches. A different sprop drops them.
+ */
+static void session_cache_preconfigure (CustomData *data, const GstStructure *s) {
+  const gchar *sprop = gst_structure_get_string (s, "sprop-parameter-sets");
+  session_entry *entry = data->session;
+  GstCaps *caps = NULL;
+  GstSegment segment;
+  gchar *stream_id;
+
+  g_mutex_lock (&sessions.lock);
+  if (entry->caps && sprop && !g_strcmp0 (sprop, entry->sprop)) {
+    caps = gst_caps_ref (entry->caps);
+    entry->hits++;
+  } else if (g_strcmp0 (sprop, entry->sprop)) {
+    g_free (entry->sprop);
+    entry->sprop = g_strdup (sprop);
+    gst_caps_replace (&entry->caps, NULL);
+    sessions.dirty = TRUE;
+  }
+  g_mutex_unlock (&sessions.lock);
+
+  if (!caps)
+    return;
+
+  if (!data->session_cache_enabled || gst_pad_has_current_caps (data->tee_sinkpad)) {
+    gst_caps_unref (caps);
+    return;
+  }
+
+  alogi ("session cache: caps ahead of the first access unit (%u hits)", entry->hits);
+  stream_id = gst_pad_create_stream_id (data->tee_sinkpad, data->rtspsrc_elements[SC_CAPSFILTER], NULL);
+  gst_pad_send_event (data->tee_sinkpad, gst_event_new_stream_start (stream_id));
+  g_free (stream_id);
+  gst_pad_send_event (data->tee_sinkpad, gst_event_new_caps (caps));
+  gst_segment_init (&segment, GST_FORMAT_TIME);
+  gst_pad_send_event (data->tee_sinkpad, gst_event_new_segment (&segment));
+  gst_caps_unref (caps);
+
+  g_mutex_lock (&data->ttff.lock);
+  data->ttff.cached = TRUE;
+  g_mutex_unlock (&data->ttff.lock);
+}
+
+/* JNI thread, once per process: entries of the file not known yet */
+static void session_cache_load (const gchar *dir) {
+  gint64 begin_us = g_get_monotonic_time ();
+  GMappedFile *file;
+  GError *error = NULL;
+  GstStructure *st;
+  session_entry *entry;
+  const gchar *url, *caps;
+  gchar *contents, **lines;
+  guint i, loaded = 0;
+
+  g_mutex_lock (&sessions.lock);
+  if (sessions.path) {
+    g_mutex_unlock (&sessions.lock);
+    return;
+  }
+
+  sessions.path = g_build_filename (dir, SESSION_CACHE_FILE, NULL);
+  if (!sessions.entries)
+    sessions.entries = g_hash_table_new (g_str_hash, g_str_equal);
+
+  file = g_mapped_file_new (sessions.path, FALSE, &error);
+  if (!file) {
+    alogi ("session cache: %s", error->message);
+    g_clear_error (&error);
+    g_mutex_unlock (&sessions.lock);
+    return;
+  }
+  contents = g_strndup (g_mapped_file_get_contents (file), g_mapped_file_get_length (file));
+  g_mapped_file_unref (file);
+
+  lines = g_strsplit (contents ? contents : "", "\n", -1);
+  for (i = 0; lines[i]; i++) {
+    st = gst_structure_from_string (lines[i], NULL);
+    if (!st)
+      continue;
+
+    url = gst_structure_get_string (st, "url");
+    if (url && !g_hash_table_contains (sessions.entries, url)) {
+      entry = g_new0 (session_entry, 1);
+      entry->sdp = g_strdup (gst_structure_get_string (st, "sdp"));
+      entry->sprop = g_strdup (gst_structure_get_string (st, "sprop"));
+      caps = gst_structure_get_string (st, "caps");
+      if (caps && entry->sprop)
+        entry->caps = gst_caps_from_string (caps);
+      gst_structure_get_boolean (st, "tcp", &entry->tcp);
+      gst_structure_get_uint (st, "latency", &entry->latency_ms);
+      entry->seed = TRUE;
+      g_hash_table_insert (sessions.entries, g_strdup (url), entry);
+      loaded++;
+    }
+    gst_structure_free (st);
+  }
+  g_strfreev (lines);
+  g_free (contents);
+  g_mutex_unlock (&sessions.lock);
+
+  alogi ("session cache: %u entries from %s in %" G_GINT64_FORMAT "us", loaded, sessions.path,
+          g_get_monotonic_time () - begin_us);
+}
+
+/*
+ * Engine loop thread: takes the transport of the session and a jitter latency that held
+ * for SESSION_CACHE_SETTLE_MS, and rewrites the file when an entry changed. The file is
+ * replaced, never written in place.
+ */
+static void session_cache_flush (CustomData *data) {
+  session_entry *entry = data->session;
+  GHashTableIter iter;
+  gpointer url, value;
+  GstStructure *st;
+  GString *lines;
+  GError *error = NULL;
+  gchar *path, *str;
+  gint64 now = g_get_monotonic_time ();
+  gboolean tcp, settled;
+  guint latency;
+
+  if (!entry || !data->session_cache_enabled)
+    return;
+
+  g_mutex_lock (&data->transport.lock);
+  tcp = data->transport.tcp;
+  g_mutex_unlock (&data->transport.lock);
+  g_mutex_lock (&data->jitter.lock);
+  latency = data->jitter.latency_ms;
+  g_mutex_unlock (&data->jitter.lock);
+
+  if (latency != data->session_latency_ms || !data->session_latency_since) {
+    data->session_latency_ms = latency;
+    data->session_latency_since = now;
+  }
+  settled = now - data->session_latency_since >= SESSION_CACHE_SETTLE_MS * G_TIME_SPAN_MILLISECOND;
+
+  g_mutex_lock (&sessions.lock);
+  if (entry->tcp != tcp) {
+    entry->tcp = tcp;
+    sessions.dirty = TRUE;
+  }
+  if (settled && entry->latency_ms != latency) {
+    entry->latency_ms = latency;
+    sessions.dirty = TRUE;
+  }
+  if (!sessions.path || !sessions.dirty) {
+    g_mutex_unlock (&sessions.lock);
+    return;
+  }
+  sessions.dirty = FALSE;
+
+  lines = g_string_new (NULL);
+  g_hash_table_iter_init (&iter, sessions.entries);
+  while (g_hash_table_iter_next (&iter, &url, &value)) {
+    entry = (session_entry *)value;
+    st = gst_structure_new ("session",
+            "url", G_TYPE_STRING, url,
+            "tcp", G_TYPE_BOOLEAN, entry->tcp,
+            "latency", G_TYPE_UINT, entry->latency_ms, NULL);
+    if (entry->sdp)
+      gst_structure_set (st, "sdp", G_TYPE_STRING, entry->sdp, NULL);
+    if (entry->sprop)
+      gst_structure_set (st, "sprop", G_TYPE_STRING, entry->sprop, NULL);
+    if (entry->caps) {
+      str = gst_caps_to_string (entry->caps);
+      gst_structure_set (st, "caps", G_TYPE_STRING, str, NULL);
+      g_free (str);
+    }
+    str = gst_structure_to_string (st);
+    g_string_append_printf (lines, "%s\n", str);
+    g_free (str);
+    gst_structure_free (st);
+  }
+  path = g_strdup (sessions.path);
+  g_mutex_unlock (&sessions.lock);
+
+  if (!g_file_set_contents (path, lines->str, lines->len, &error)) {
+    alogw ("session cache: %s", error->message);
+    g_clear_error (&error);
+  }
+  g_free (path);
+  g_string_free (lines, TRUE);
+}
+
+/* Engine loop thread, every SESSION_CACHE_FLUSH_MS */
+static gboolean session_cache_timeout_cb (gpointer user_data) {
+  session_cache_flush ((CustomData *)user_data);
+  return G_SOURCE_CONTINUE;
+}
+
+/*
+ * Worker thread, before the source of a new session is built: the first session of a
+ * URL found in the file starts on the transport and jitter latency the last run settled
+ * on, and every session with a known sprop reports the media size before connecting.
+ */
+static gboolean session_cache_seed (CustomData *data) {
+  session_entry *entry = data->session;
+  jitter_ctl *ctl = &data->jitter;
+  gboolean seed, tcp;
+  guint latency;
+  gchar *sprop;
+
+  if (!data->session_cache_enabled)
+    return FALSE;
+
+  g_mutex_lock (&sessions.lock);
+  seed = entry->seed;
+  entry->seed = FALSE;
+  tcp = entry->tcp;
+  latency = entry->latency_ms;
+  sprop = g_strdup (entry->sprop);
+  g_mutex_unlock (&sessions.lock);
+
+  if (seed) {
+    g_mutex_lock (&data->transport.lock);
+    if (data->transport.policy == TRANSPORT_AUTO && tcp && !data->transport.tcp) {
+      data->transport.tcp = TRUE;
+      data->transport.since_us = g_get_monotonic_time ();
+    }
+    g_mutex_unlock (&data->transport.lock);
+
+    g_mutex_lock (&ctl->lock);
+    if (latency && ctl->latency_ms == JITTER_LATENCY_INIT_MS)
+      ctl->latency_ms = CLAMP (latency, ctl->min_ms, ctl->max_ms);
+    g_mutex_unlock (&ctl->lock);
+    alogi ("session cache: seeded %s at %ums", tcp ? "tcp" : "udp", latency);
+  }
+
+  media_info_from_sprop (data, sprop);
+  g_free (sprop);
+
+  return seed;
+}
+
+/* rtspsrc reports the connection done as it starts retrieving the server options */
+static void message_progress_cb (GstBus *bus, GstMessage *msg, CustomData *data) {
+  GstProgressType type;
+  gchar *code, *text;
+
+  gst_message_parse_progress (msg, &type, &code, &text);
+  if (type == GST_PROGRESS_TYPE_CONTINUE && !g_strcmp0 (code, "open") &&
+      g_str_has_prefix (text, "Retrieving server options"))
+    ttff_trace_mark (&data->ttff, TTFF_CONNECT);
+  g_free (code);
+  g_free (text);
+}
+
+static GstPadProbeReturn probe_media_caps_cb (GstPad *pad, GstPadProbeInfo *info, gpointer user_data);
+static void probe_rtspsrc_pad_added_cb (GstElement* element, GstPad* pad, gpointer _data) {
+  CustomData *data;
+  GstCaps *caps;
+  const GstStructure *s;
+  const gchar *encoding_name;
+  gchar *name, *description;
+
+  data = (CustomData *)_data;
+  /* a source replaced while it was still connecting */
+  if (element != data->rtspsrc)
+    return;
+
+  name = gst_pad_get_name(pad);
+  caps = gst_pad_get_current_caps (pad);
+  if (!caps) {
+    aloge ("probe_rtspsrc_pad_added_cb: failed to get pad caps %s", name);
+    return;
+  }
+
+  description = gst_caps_to_string (caps);
+  alogi ("probe_rtspsrc_pad_added_cb: name(%d):%s caps:%s", data->rtspsrc_linked, name, description);
+  g_free (name);
+  g_free (description);
+
+  if (data->rtspsrc_linked) {
+    alogi ("probe_rtspsrc_pad_added_cb: rtspsrc has been linked");
+    gst_caps_unref (caps);
+    return;
+  }
+
+  s = gst_caps_get_structure (caps, 0);
+  if (!s) {
+    aloge ("probe_rtspsrc_pad_added_cb: failed to get pad caps structure");
+    gst_caps_unref (caps);
+    return;
+  }
+
+  encoding_name = gst_structure_get_string (s, "encoding-name");
+  if (!g_strcmp0 (encoding_name, "H264")) {
+    media_info_from_sprop (data, gst_structure_get_string (s, "sprop-parameter-sets"));
+    session_cache_preconfigure (data, s);
+    if (gst_element_link_pads(element, GST_PAD_NAME (pad), data->rtspsrc_elements[SC_H264DEPAY], NULL)) {
+      data->rtspsrc_linked = TRUE;
+      ttff_trace_mark (&data->ttff, TTFF_PLAY);
+    } else
+      aloge ("probe_rtspsrc_pad_added_cb: failed to link elements");
+  } else {
+    aloge ("probe_rtspsrc_pad_added_cb: unsupported codec type %s", encoding_name);
+  }
+
+  gst_caps_unref (caps);
+}
+
+static void probe_rtspsrc_pad_removed_cb (GstElement* element, GstPad* pad, gpointer _data) {
+  CustomData *data;
+  gchar *name, *description;
+
+  data = (CustomData *)_data;
+  name = gst_pad_get_name (pad);
+  description = gst_caps_to_string (gst_pad_get_pad_template_caps (pad));
+
+  alogi ("probe_rtspsrc_pad_removed_cb: %s, pad name:%s", description, name);
   data->rtspsrc_linked = FALSE;
 
-  return TRUE;
+  g_free (name);
+  g_free (description);
+}
+
+static void cleanup_elements (GstElement *pipeline, GstElement **elements, int count) {
+  for (int i = 0; (i < count) && (elements[i] != NULL); i++) {
+
+    if ((i + 1) < count)
+      gst_element_unlink (elements[i], elements[i + 1]);
+
+    alogi ("cleanup element %s", gst_element_get_name (elements[i]));
+    gst_element_set_locked_state (elements[i], FALSE);
+    gst_element_set_state (elements[i], GST_STATE_NULL);
+    gst_bin_remove (GST_BIN (pipeline), elements[i]);
+    gst_object_unref (elements[i]);
+    elements[i] = NULL;
+  }
+}
+
+/* Element names get the prefix, so that several instances of a vector can share the pipeline */
+static gboolean setup_elements (GstElement *pipeline, GstElement **elements, const element_node *vector,
+        const gchar *prefix) {
+  gchar *name;
+  int i;
+
+  for (i = 0; vector[i].name != NULL; i++) {
+    if (prefix)
+      name = g_strdup_printf ("%s-%s", prefix, vector[i].name);
+    else
+      name = g_strdup (vector[i].name);
+
+    elements[i] = gst_element_factory_make (vector[i].factoryname, name);
+    if (!elements[i]) {
+      aloge ("Unable to create %s", name);
+      g_free (name);
+      break;
+    }
+    gst_object_ref (elements[i]);
+
+    alogi ("setup element create %s", name);
+    g_free (name);
+    gst_bin_add (GST_BIN (pipeline), elements[i]);
+    gst_element_set_locked_state (elements[i], TRUE);
+
+    if (i)
+      gst_element_link (elements[i - 1], elements[i]);
+  }
+
+  if ( vector[i].name == NULL)
+    return TRUE;
+
+  i--;
+  cleanup_elements (pipeline, elements, i);
+
+  return FALSE;
+}
+
+static int element_vector_count (const element_node *vector) {
+  int count = 0;
+
+  while (vector[count].name != NULL)
+    count++;
+
+  return count;
+}
+
+static GstPadProbeReturn probe_arrival_cb (GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+  display_deadline *dl = &((CustomData *)user_data)->deadline;
+  GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER (info);
+
+  if (!GST_BUFFER_PTS_IS_VALID (buffer))
+    return GST_PAD_PROBE_OK;
+
+  g_mutex_lock (&dl->lock);
+  dl->map[dl->next].pts = GST_BUFFER_PTS (buffer);
+  dl->map[dl->next].arrival_us = g_get_monotonic_time ();
+  dl->next = (dl->next + 1) % ARRIVAL_MAP_SIZE;
+  g_mutex_unlock (&dl->lock);
+
+  return GST_PAD_PROBE_OK;
+}
+
+static void display_deadline_reset (display_deadline *dl) {
+  g_mutex_lock (&dl->lock);
+  memset (dl->map, 0, sizeof (dl->map));
+  dl->next = 0;
+  g_mutex_unlock (&dl->lock);
+}
+
+/* Age of the frame at pts, 0 once it is out of the map */
+static gint64 display_frame_age_unlocked (display_deadline *dl, GstClockTime pts, gint64 now) {
+  guint i, n;
+
+  for (n = 0; n < ARRIVAL_MAP_SIZE; n++) {
+    i = (dl->next + ARRIVAL_MAP_SIZE - 1 - n) % ARRIVAL_MAP_SIZE;
+    if (dl->map[i].arrival_us && dl->map[i].pts == pts)
+      return now - MAX (dl->map[i].arrival_us, dl->since_us);
+  }
+
+  return 0;
+}
+
+/* On the src pad of the display queue, right ahead of the parser and decoder */
+static GstPadProbeReturn probe_display_deadline_cb (GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+  display_deadline *dl = (display_deadline *)user_data;
+  GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER (info);
+  gboolean key, drop = FALSE;
+  gint64 age;
+
+  if (!GST_BUFFER_PTS_IS_VALID (buffer) || GST_BUFFER_FLAG_IS_SET (buffer, GST_BUFFER_FLAG_HEADER))
+    return GST_PAD_PROBE_OK;
+
+  key = !GST_BUFFER_FLAG_IS_SET (buffer, GST_BUFFER_FLAG_DELTA_UNIT);
+
+  g_mutex_lock (&dl->lock);
+  dl->frames++;
+  age = display_frame_age_unlocked (dl, GST_BUFFER_PTS (buffer), g_get_monotonic_time ());
+  if (dl->deadline_ms && age > (gint64) dl->deadline_ms * 1000) {
+    dl->late++;
+    drop = TRUE;
+    if (!dl->resync) {
+      dl->resync = TRUE;
+      dl->resyncs++;
+      alogw ("display: frame %" G_GINT64_FORMAT "ms late, dropping to the next IDR",
+              age / 1000 - dl->deadline_ms);
+    }
+  } else if (dl->resync && !key) {
+    dl->skipped++;
+    drop = TRUE;
+  } else if (dl->resync) {
+    dl->resync = FALSE;
+    alogi ("display: resumed on an IDR, %" G_GUINT64_FORMAT " late and %" G_GUINT64_FORMAT
+            " skipped frames so far", dl->late, dl->skipped);
+  }
+  g_mutex_unlock (&dl->lock);
+
+  return drop ? GST_PAD_PROBE_DROP : GST_PAD_PROBE_OK;
+}
+
+/* Decoded frames entering the render queue, the display latency the deadline leaves */
+static GstPadProbeReturn probe_display_latency_cb (GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+  display_deadline *dl = (display_deadline *)user_data;
+  GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER (info);
+  gint64 age;
+
+  if (!GST_BUFFER_PTS_IS_VALID (buffer))
+    return GST_PAD_PROBE_OK;
+
+  g_mutex_lock (&dl->lock);
+  age = display_frame_age_unlocked (dl, GST_BUFFER_PTS (buffer), g_get_monotonic_time ());
+  if (age)
+    dl->latency_us = age;
+  g_mutex_unlock (&dl->lock);
+
+  if (age)
+    latency_window_add (&dl->window, age, "display arrival-to-render");
+
+  return GST_PAD_PROBE_OK;
+}
+
+/* The source failed, the outage runs until it delivers again */
+static void reconnect_failed (reconnect_backoff *rc) {
+  gint64 now = g_get_monotonic_time ();
+
+  g_mutex_lock (&rc->lock);
+  if (!rc->failed_us) {
+    if (rc->up_us && now - rc->up_us >= RECONNECT_STABLE_MS * G_TIME_SPAN_MILLISECOND)
+      rc->attempt = 0;
+    rc->failed_us = now;
+  }
+  g_mutex_unlock (&rc->lock);
+}
+
+static gint64 reconnect_next_delay (reconnect_backoff *rc) {
+  guint delay_ms;
+
+  g_mutex_lock (&rc->lock);
+  if (!rc->attempt)
+    delay_ms = RECONNECT_FIRST_MS;
+  else
+    delay_ms = RECONNECT_BASE_MS << MIN (rc->attempt - 1, 16);
+  delay_ms = MIN (delay_ms, RECONNECT_MAX_MS);
+  delay_ms = g_random_int_range (delay_ms / 2, delay_ms + 1);
+
+  rc->attempt++;
+  rc->count++;
+  rc->delay_ms = delay_ms;
+  alogi ("reconnect %u in %ums", rc->attempt, delay_ms);
+  g_mutex_unlock (&rc->lock);
+
+  return (gint64) delay_ms * G_TIME_SPAN_MILLISECOND;
+}
+
+/* First buffer of a source on the tee, ends the outage if there was one */
+static GstPadProbeReturn probe_reconnect_up_cb (GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+  reconnect_backoff *rc = &((CustomData *)user_data)->reconnect;
+  gint64 now;
+
+  if (!g_atomic_int_compare_and_exchange (&rc->waiting, TRUE, FALSE))
+    return GST_PAD_PROBE_OK;
+
+  now = g_get_monotonic_time ();
+  g_mutex_lock (&rc->lock);
+  rc->up_us = now;
+  if (rc->failed_us) {
+    rc->recover_us = now - rc->failed_us;
+    rc->recover_max_us = MAX (rc->recover_max_us, rc->recover_us);
+    rc->failed_us = 0;
+    alogi ("reconnect: recovered in %" G_GINT64_FORMAT "ms after %u retries",
+            rc->recover_us / G_TIME_SPAN_MILLISECOND, rc->attempt);
+  }
+  g_mutex_unlock (&rc->lock);
+
+  return GST_PAD_PROBE_OK;
+}
+
+static GstPadProbeReturn probe_watchdog_cb (GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+  stall_watchdog *wd = &((CustomData *)user_data)->watchdog;
+  GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER (info);
+  gint64 now = g_get_monotonic_time ();
+
+  g_mutex_lock (&wd->lock);
+  if (wd->last_us)
+    wd->interval_us = (7 * wd->interval_us + (now - wd->last_us)) / 8;
+  wd->last_us = now;
+  if (!GST_BUFFER_FLAG_IS_SET (buffer, GST_BUFFER_FLAG_DELTA_UNIT)) {
+    if (wd->last_idr_us)
+      wd->gop_us = now - wd->last_idr_us;
+    wd->last_idr_us = now;
+  }
+  g_mutex_unlock (&wd->lock);
+
+  return GST_PAD_PROBE_OK;
+}
+
+/* The source went away, the next one arms the watchdog again */
+static void watchdog_source_closed (stall_watchdog *wd) {
+  g_mutex_lock (&wd->lock);
+  wd->last_us = wd->last_idr_us = 0;
+  wd->interval_us = wd->gop_us = 0;
+  g_mutex_unlock (&wd->lock);
+}
+
+/* Engine loop thread, every WATCHDOG_INTERVAL_MS */
+static gboolean watchdog_timeout_cb (gpointer user_data) {
+  CustomData *data = (CustomData *)user_data;
+  stall_watchdog *wd = &data->watchdog;
+  gint64 silence = 0, idr_age = 0, threshold;
+  gboolean busy;
+
+  g_mutex_lock (&data->mutex_branch);
+  busy = data->source_stopping || data->pipeline_restarting;
+  g_mutex_unlock (&data->mutex_branch);
+  if (busy)
+    return G_SOURCE_CONTINUE;
+
+  g_mutex_lock (&wd->lock);
+  threshold = MAX ((gint64) wd->stall_ms * G_TIME_SPAN_MILLISECOND, 3 * wd->interval_us);
+  if (wd->stall_ms && wd->last_us && g_get_monotonic_time () - wd->last_us > threshold) {
+    silence = g_get_monotonic_time () - wd->last_us;
+    idr_age = g_get_monotonic_time () - wd->last_idr_us;
+    wd->stalls++;
+    wd->detect_us = silence;
+    wd->detect_max_us = MAX (wd->detect_max_us, silence);
+    wd->last_us = 0;
+  }
+  g_mutex_unlock (&wd->lock);
+
+  if (!silence)
+    return G_SOURCE_CONTINUE;
+
+  alogw ("watchdog: no buffer for %" G_GINT64_FORMAT "ms, last IDR %" G_GINT64_FORMAT "ms ago",
+          silence / G_TIME_SPAN_MILLISECOND, idr_age / G_TIME_SPAN_MILLISECOND);
+  if (launch_restart_process (data, RESET_REQUEST_SOURCE))
+    set_usr_message (USR_MESSAGE_STALL_RESTART, data);
+
+  return G_SOURCE_CONTINUE;
+}
+
+static GstPadProbeReturn probe_trace_in_cb (GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+  trace_point *pt = (trace_point *)user_data;
+  GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER (info);
+  gint rate = g_atomic_int_get (&pt->trace->rate);
+
+  if (!rate || g_atomic_int_get (&pt->armed) || ++pt->skipped < (guint) rate ||
+      !GST_BUFFER_PTS_IS_VALID (buffer))
+    return GST_PAD_PROBE_OK;
+
+  pt->skipped = 0;
+  pt->pending_pts = GST_BUFFER_PTS (buffer);
+  pt->pending_us = g_get_monotonic_time ();
+  g_atomic_int_set (&pt->armed, 1);
+
+  return GST_PAD_PROBE_OK;
+}
+
+/* flvmux rounds timestamps down to the millisecond, an older buffer keeps the point armed */
+static GstPadProbeReturn probe_trace_out_cb (GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+  trace_point *pt = (trace_point *)user_data;
+  GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER (info);
+  GstClockTime pts = GST_BUFFER_PTS (buffer);
+  guint64 transit;
+
+  if (!g_atomic_int_get (&pt->armed) || !GST_CLOCK_TIME_IS_VALID (pts) ||
+      pts + GST_MSECOND <= pt->pending_pts)
+    return GST_PAD_PROBE_OK;
+
+  if (pts <= pt->pending_pts) {
+    transit = g_get_monotonic_time () - pt->pending_us;
+    g_mutex_lock (&pt->trace->lock);
+    pt->count++;
+    pt->total_us += transit;
+    pt->max_us = MAX (pt->max_us, transit);
+    pt->buckets[MIN (g_bit_storage (transit), TRACE_BUCKETS - 1)]++;
+    g_mutex_unlock (&pt->trace->lock);
+  }
+  g_atomic_int_set (&pt->armed, 0);
+
+  return GST_PAD_PROBE_OK;
+}
+
+static gboolean trace_pad_attach (GstElement *element, GstPad *pad, gpointer user_data) {
+  gst_pad_add_probe (pad, GST_PAD_PROBE_TYPE_BUFFER, GST_PAD_IS_SINK (pad) ?
+          probe_trace_in_cb : probe_trace_out_cb, user_data, NULL);
+  return TRUE;
+}
+
+static void trace_pad_added_cb (GstElement *element, GstPad *pad, gpointer user_data) {
+  trace_pad_attach (element, pad, user_data);
+}
+
+/* Probe every pad of the elements, request and sometimes pads included */
+static void trace_attach_v (tracer *trace, GstElement **el_v) {
+  trace_point *pt;
+  gchar *name;
+
+  for (; *el_v; el_v++) {
+    name = gst_element_get_name (*el_v);
+    g_mutex_lock (&trace->lock);
+    pt = (trace_point *)g_hash_table_lookup (trace->points, name);
+    if (!pt) {
+      pt = g_new0 (trace_point, 1);
+      pt->trace = trace;
+      g_hash_table_insert (trace->points, name, pt);
+    } else {
+      g_free (name);
+    }
+    g_mutex_unlock (&trace->lock);
+
+    gst_element_foreach_pad (*el_v, trace_pad_attach, pt);
+    g_signal_connect (*el_v, "pad-added", G_CALLBACK (trace_pad_added_cb), pt);
+  }
+}
+
+/* Sampling rate change, the histograms start over */
+static void trace_set_rate (tracer *trace, gint rate) {
+  GHashTableIter iter;
+  trace_point *pt;
+
+  g_mutex_lock (&trace->lock);
+  g_hash_table_iter_init (&iter, trace->points);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&pt)) {
+    pt->count = pt->total_us = pt->max_us = 0;
+    memset (pt->buckets, 0, sizeof (pt->buckets));
+  }
+  g_atomic_int_set (&trace->rate, MAX (rate, 0));
+  g_mutex_unlock (&trace->lock);
+}
+
+/* Upper bound of the bucket holding the pth percentile */
+static guint64 trace_point_percentile (trace_point *pt, guint p) {
+  guint64 seen = 0;
+  int i;
+
+  for (i = 0; i < TRACE_BUCKETS; i++) {
+    seen += pt->buckets[i];
+    if (seen * 100 >= pt->count * p)
+      return G_GUINT64_CONSTANT (1) << i;
+  }
+
+  return pt->max_us;
+}
+
+/* One line per element: transit counts, mean, max, percentiles and the buckets, in us */
+static gchar *trace_format (tracer *trace) {
+  GString *out = g_string_new (NULL);
+  GList *names, *l;
+  trace_point *pt;
+  int i;
+
+  g_mutex_lock (&trace->lock);
+  g_string_append_printf (out, "# rate 1/%d, buckets [2^(i-1), 2^i) us\n", trace->rate);
+  names = g_list_sort (g_hash_table_get_keys (trace->points), (GCompareFunc) g_strcmp0);
+  for (l = names; l; l = l->next) {
+    pt = (trace_point *)g_hash_table_lookup (trace->points, l->data);
+    if (!pt->count)
+      continue;
+
+    g_string_append_printf (out, "%s n=%" G_GUINT64_FORMAT " avg=%" G_GUINT64_FORMAT " max=%"
+            G_GUINT64_FORMAT " p50<=%" G_GUINT64_FORMAT " p90<=%" G_GUINT64_FORMAT " p99<=%"
+            G_GUINT64_FORMAT " [", (gchar *)l->data, pt->count, pt->total_us / pt->count, pt->max_us,
+            trace_point_percentile (pt, 50), trace_point_percentile (pt, 90),
+            trace_point_percentile (pt, 99));
+    for (i = 0; i < TRACE_BUCKETS; i++)
+      g_string_append_printf (out, i ? " %" G_GUINT64_FORMAT : "%" G_GUINT64_FORMAT, pt->buckets[i]);
+    g_string_append (out, "]\n");
+  }
+  g_list_free (names);
+  g_mutex_unlock (&trace->lock);
+
+  return g_string_free (out, FALSE);
+}
+
+/* Give a request pad back to whichever tee it came from, if that one is still around */
+static void release_tee_pad (GstPad **tee_srcpad) {
+  GstElement *tee;
+
+  if (!*tee_srcpad)
+    return;
+
+  tee = gst_pad_get_parent_element (*tee_srcpad);
+  if (tee) {
+    gst_element_release_request_pad (tee, *tee_srcpad);
+    gst_object_unref (tee);
+  }
+  gst_object_unref (*tee_srcpad);
+  *tee_srcpad = NULL;
+}
+
+const static element_node pre_event_vector[] = {
+  {"appsrc", "pe0-appsrc"},
+  {"flvmux", "pe1-flvmux"},
+  {"filesink", "pe2-filesink"},
+  {NULL, NULL},
+};
+
+#define PE_APPSRC   0
+#define PE_FILESINK 2
+
+/*
+ * Called with pre_event_lock held. The capture shares the buffer data with the source
+ * chain, only the buffer metadata is copied, to rebase the timestamps.
+ */
+static void pre_event_capture_end (pre_event_capture *capture);
+static void pre_event_capture_push (pre_event_capture *capture, GstBuffer *buffer) {
+  GstClockTime ts = GST_BUFFER_DTS_OR_PTS (buffer);
+  GstBuffer *out;
+
+  if (capture->ended)
+    return;
+
+  /* the file falls behind the stream, end it with what it has */
+  if (gst_app_src_get_current_level_bytes (GST_APP_SRC (capture->elements[PE_APPSRC])) >= PRE_EVENT_CAPTURE_BYTES) {
+    alogw ("pre-event %s: writing behind by %uMB, ending early", capture->location,
+            PRE_EVENT_CAPTURE_BYTES / (1024 * 1024));
+    pre_event_capture_end (capture);
+    return;
+  }
+
+  if (!GST_CLOCK_TIME_IS_VALID (capture->base)) {
+    if (GST_BUFFER_FLAG_IS_SET (buffer, GST_BUFFER_FLAG_DELTA_UNIT) || !GST_CLOCK_TIME_IS_VALID (ts))
+      return;
+    capture->base = ts;
+  }
+
+  out = gst_buffer_copy (buffer);
+  if (GST_BUFFER_PTS_IS_VALID (out))
+    GST_BUFFER_PTS (out) = GST_BUFFER_PTS (out) > capture->base ? GST_BUFFER_PTS (out) - capture->base : 0;
+  if (GST_BUFFER_DTS_IS_VALID (out))
+    GST_BUFFER_DTS (out) = GST_BUFFER_DTS (out) > capture->base ? GST_BUFFER_DTS (out) - capture->base : 0;
+
+  capture->bytes += gst_buffer_get_size (out);
+  capture->buffers++;
+  gst_app_src_push_buffer (GST_APP_SRC (capture->elements[PE_APPSRC]), out);
+}
+
+/* Called with pre_event_lock held. flvmux finishes the file on the EOS */
+static void pre_event_capture_end (pre_event_capture *capture) {
+  if (capture->ended)
+    return;
+
+  capture->ended = TRUE;
+  gst_app_src_end_of_stream (GST_APP_SRC (capture->elements[PE_APPSRC]));
+}
+
+static void pre_event_capture_free (pre_event_capture *capture) {
+  CustomData *data = capture->data;
+
+  g_mutex_lock (&data->pre_event_lock);
+  data->captures = g_list_remove (data->captures, capture);
+  g_mutex_unlock (&data->pre_event_lock);
+
+  if (capture->timer) {
+    g_source_destroy (capture->timer);
+    g_source_unref (capture->timer);
+  }
+
+  if (capture->bus_source) {
+    g_source_destroy (capture->bus_source);
+    g_source_unref (capture->bus_source);
+  }
+
+  cleanup_elements (capture->pipeline, capture->elements, element_vector_count (pre_event_vector));
+  gst_element_set_state (capture->pipeline, GST_STATE_NULL);
+  gst_object_unref (capture->pipeline);
+  g_free (capture->elements);
+  g_free (capture->location);
+  g_free (capture);
+}
+
+static gboolean pre_event_timeout_cb (gpointer user_data) {
+  pre_event_capture *capture = (pre_event_capture *)user_data;
+  CustomData *data = capture->data;
+
+  g_mutex_lock (&data->pre_event_lock);
+  pre_event_capture_end (capture);
+  g_mutex_unlock (&data->pre_event_lock);
+
+  return G_SOURCE_REMOVE;
+}
+
+static gboolean pre_event_bus_cb (GstBus *bus, GstMessage *message, gpointer user_data) {
+  pre_event_capture *capture = (pre_event_capture *)user_data;
+  gchar *saved;
+
+  switch (GST_MESSAGE_TYPE (message)) {
+    case GST_MESSAGE_EOS:
+      alogi ("pre-event %s: %u buffers, %" G_GUINT64_FORMAT " bytes, saved in %" G_GINT64_FORMAT "us",
+              capture->location, capture->buffers, capture->bytes, g_get_monotonic_time () - capture->begin);
+      saved = g_strconcat (USR_MESSAGE_PRE_EVENT_SAVED, capture->location, NULL);
+      set_usr_message (saved, capture->data);
+      g_free (saved);
+      break;
+    case GST_MESSAGE_ERROR:
+      aloge ("pre-event %s: write failed", capture->location);
+      break;
+    default:
+      return G_SOURCE_CONTINUE;
+  }
+
+  /* the source goes with the capture, this dispatch still holds it */
+  pre_event_capture_free (capture);
+  return G_SOURCE_REMOVE;
+}
+
+/*
+ * Write the pre-event ring, then the next post-seconds of the stream, to a new file in
+ * "dir". The ring stays as it is, another save can follow right away.
+ */
+static void pre_event_save (CustomData *data, const GstStructure *spec) {
+  pre_event_capture *capture;
+  GstElement *pipeline, **elements;
+  GDateTime *date;
+  gchar *date_str;
+  GstBuffer *buffer;
+  GstCaps *caps;
+  GstBus *bus;
+  GQueue ring = G_QUEUE_INIT;
+  gint post = PRE_EVENT_POST_SECONDS;
+  gboolean stale;
+
+  g_mutex_lock (&data->pre_event_lock);
+  caps = data->pre_event_caps ? gst_caps_ref (data->pre_event_caps) : NULL;
+  g_mutex_unlock (&data->pre_event_lock);
+  if (!caps) {
+    aloge ("pre-event: nothing received yet");
+    return;
+  }
+
+  gst_structure_get_int (spec, "post-seconds", &post);
+  pipeline = gst_pipeline_new (NULL);
+  elements = (GstElement **)g_malloc0 (sizeof(GstElement*) * (element_vector_count (pre_event_vector) + 1));
+  if (!setup_elements (pipeline, elements, pre_event_vector, NULL)) {
+    aloge ("pre-event: setup elements failed!");
+    gst_object_unref (pipeline);
+    g_free (elements);
+    gst_caps_unref (caps);
+    return;
+  }
+  gst_elements_set_locked_state_v (elements, FALSE);
+
+  capture = g_new0 (pre_event_capture, 1);
+  capture->data = data;
+  capture->pipeline = pipeline;
+  capture->elements = elements;
+  capture->base = GST_CLOCK_TIME_NONE;
+  capture->begin = g_get_monotonic_time ();
+
+  date = g_date_time_new_now_utc ();
+  date_str = g_date_time_format (date, "%Y-%m-%d-%H-%M-%S-utc");
+  g_date_time_unref (date);
+  capture->location = g_strdup_printf ("%s/PreEvent-%s.flv", gst_structure_get_string (spec, "dir"), date_str);
+  g_free (date_str);
+
+  /* the queued buffers share their data with the ring, pre_event_capture_push bounds them */
+  g_object_set (G_OBJECT(elements[PE_APPSRC]), "caps", caps, "format", GST_FORMAT_TIME,
+          "max-bytes", (guint64) PRE_EVENT_CAPTURE_BYTES, NULL);
+  g_object_set (G_OBJECT(elements[PE_FILESINK]), "location", capture->location, NULL);
+  gst_caps_unref (caps);
+
+  bus = gst_element_get_bus (pipeline);
+  capture->bus_source = gst_bus_create_watch (bus);
+  g_source_set_callback (capture->bus_source, (GSourceFunc) pre_event_bus_cb, capture, NULL);
+  g_source_attach (capture->bus_source, data->context);
+  gst_object_unref (bus);
+  gst_element_set_state (pipeline, GST_STATE_PLAYING);
+
+  /* the probe feeds the ring and the captures under the same lock, nothing is missed or doubled */
+  g_mutex_lock (&data->pre_event_lock);
+  stale = gop_cache_snapshot (&data->pre_event, &ring);
+  alogi ("pre-event %s: %u buffers from the ring, %d seconds to follow", capture->location,
+          ring.length, stale ? 0 : post);
+  while ((buffer = (GstBuffer *)g_queue_pop_head (&ring))) {
+    pre_event_capture_push (capture, buffer);
+    gst_buffer_unref (buffer);
+  }
+
+  data->captures = g_list_prepend (data->captures, capture);
+  if (stale || !data->rtspsrc || post <= 0) {
+    pre_event_capture_end (capture);
+  } else {
+    capture->timer = g_timeout_source_new_seconds (post);
+    g_source_set_callback (capture->timer, pre_event_timeout_cb, capture, NULL);
+    g_source_attach (capture->timer, data->context);
+  }
+  g_mutex_unlock (&data->pre_event_lock);
+}
+
+static GstPadProbeReturn probe_pre_event_cb (GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+  CustomData *data = (CustomData *)user_data;
+  GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER (info);
+  GstCaps *caps;
+  GList *l;
+
+  g_mutex_lock (&data->pre_event_lock);
+  gop_cache_push (&data->pre_event, buffer);
+
+  if (!GST_BUFFER_FLAG_IS_SET (buffer, GST_BUFFER_FLAG_DELTA_UNIT) &&
+      (caps = gst_pad_get_current_caps (pad))) {
+    gst_caps_replace (&data->pre_event_caps, caps);
+    gst_caps_unref (caps);
+  }
+
+  for (l = data->captures; l; l = l->next)
+    pre_event_capture_push ((pre_event_capture *)l->data, buffer);
+  g_mutex_unlock (&data->pre_event_lock);
+
+  return GST_PAD_PROBE_OK;
+}
+
+/*
+ * Engine loop thread, with the worker idle: end every capture and take its bus watch and
+ * timer off the loop. The stopping thread waits for the files in pre_event_drain.
+ */
+static gboolean pre_event_detach_cb (gpointer user_data) {
+  CustomData *data = (CustomData *)user_data;
+  pre_event_capture *capture;
+  GList *l;
+
+  g_mutex_lock (&data->pre_event_lock);
+  for (l = data->captures; l; l = l->next) {
+    capture = (pre_event_capture *)l->data;
+    pre_event_capture_end (capture);
+    if (capture->timer) {
+      g_source_destroy (capture->timer);
+      g_source_unref (capture->timer);
+      capture->timer = NULL;
+    }
+    if (capture->bus_source) {
+      g_source_destroy (capture->bus_source);
+      g_source_unref (capture->bus_source);
+      capture->bus_source = NULL;
+    }
+  }
+  g_mutex_unlock (&data->pre_event_lock);
+
+  return G_SOURCE_REMOVE;
+}
+
+/* Stopping thread: give the detached captures 2s together to finish their files */
+static void pre_event_drain (CustomData *data) {
+  gint64 end_time = g_get_monotonic_time () + 2 * G_TIME_SPAN_SECOND;
+  pre_event_capture *capture;
+  GstMessage *msg;
+  GstBus *bus;
+  gint64 left;
+
+  while (data->captures) {
+    capture = (pre_event_capture *)data->captures->data;
+
+    left = MAX (end_time - g_get_monotonic_time (), 0);
+    bus = gst_element_get_bus (capture->pipeline);
+    msg = gst_bus_timed_pop_filtered (bus, left * GST_USECOND, GST_MESSAGE_EOS | GST_MESSAGE_ERROR);
+    if (msg)
+      gst_message_unref (msg);
+    else
+      alogw ("pre-event %s: not finished", capture->location);
+    gst_object_unref (bus);
+
+    pre_event_capture_free (capture);
+  }
+}
+
+/* The session is going away, the ring is kept for a save after a lost link */
+static void pre_event_source_closed (CustomData *data) {
+  GList *l;
+
+  gop_cache_expire (&data->pre_event);
+
+  g_mutex_lock (&data->pre_event_lock);
+  for (l = data->captures; l; l = l->next)
+    pre_event_capture_end ((pre_event_capture *)l->data);
+  g_mutex_unlock (&data->pre_event_lock);
+}
+
+static void branch_release_tee_pad (CustomData *data, branch *br) {
+  release_tee_pad (&br->tee_srcpad);
+}
+
+static void cleanup_rtspsrc_elements (CustomData *data) {
+  GHashTableIter iter;
+  branch *br;
+  int count;
+
+  if (!(data && data->pipeline && data->rtspsrc))
+    return;
+
+  if (data->rtspsrc_linked)
+    gst_element_unlink (data->rtspsrc, data->rtspsrc_elements[SC_H264DEPAY]);
+
+  g_hash_table_iter_init (&iter, data->branches);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&br)) {
+    if (br->desc->upstream == BRANCH_UPSTREAM_H264)
+      branch_release_tee_pad (data, br);
+  }
+  release_tee_pad (&data->flv.tee_srcpad);
+
+  count = sizeof (source_vector) / sizeof (element_node) - 1;
+  cleanup_elements (data->pipeline, data->rtspsrc_elements, count);
+  g_free (data->rtspsrc_elements);
+  gop_cache_flush (&data->tee_gop_cache);
+  pre_event_source_closed (data);
+  jitter_source_closed (&data->jitter);
+  capture_clock_reset (&data->capture);
+  display_deadline_reset (&data->deadline);
+  watchdog_source_closed (&data->watchdog);
+
+  gst_bin_remove (GST_BIN(data->pipeline), data->rtspsrc);
+
+  data->rtspsrc_elements = NULL;
+  data->rtspsrc = NULL;
+}
+
+static GstElement *rtspsrc_new (CustomData *data) {
+  GstElement *rtspsrc;
+  gboolean tcp;
+
+  rtspsrc = gst_element_factory_make ("rtspsrc", "rtspsrc");
+  if (!rtspsrc)
+    return NULL;
+
+  g_signal_connect(rtspsrc, "pad-added", G_CALLBACK(probe_rtspsrc_pad_added_cb), data);
+  g_signal_connect(rtspsrc, "new-manager", G_CALLBACK(jitter_new_manager_cb), data);
+  g_signal_connect(rtspsrc, "on-sdp", G_CALLBACK(ttff_on_sdp_cb), data);
+  //g_signal_connect(rtspsrc, "pad-removed", G_CALLBACK(probe_rtspsrc_pad_removed_cb), data);
+  g_object_set(G_OBJECT(rtspsrc), "latency", data->jitter.latency_ms, "udp-reconnect",(gboolean) TRUE,
+      "timeout", (guint64) 0, "do-retransmission", (gboolean) FALSE, NULL);
+
+  g_mutex_lock (&data->transport.lock);
+  tcp = data->transport.tcp;
+  g_mutex_unlock (&data->transport.lock);
+  /* auto keeps the rtspsrc fallback to TCP for a SETUP that fails on UDP */
+  if (tcp)
+    gst_util_set_object_arg (G_OBJECT(rtspsrc), "protocols", "tcp");
+  else if (data->transport.policy == TRANSPORT_UDP)
+    gst_util_set_object_arg (G_OBJECT(rtspsrc), "protocols", "udp-mcast+udp");
+
+  return rtspsrc;
 }
 
-static void cleanup_display_elements (CustomData *data) {
-  int count;
+/*
+ * Gate on the tee sink pad while a new rtspsrc takes over. Its stream-start and segment
+ * go no further, the branches keep the running segment they have, and the first buffer
+ * through is an IDR marked discont, so no decoder or muxer downstream sees the seam.
+ */
+/* The new segment only goes out if it moves the timeline, the branches keep the old one */
+static gboolean source_handover_same_segment (GstPad *pad, GstEvent *event) {
+  const GstSegment *segment, *current_segment;
+  GstEvent *current;
+  gboolean same;
+
+  current = gst_pad_get_sticky_event (pad, GST_EVENT_SEGMENT, 0);
+  if (!current)
+    return FALSE;
 
-  if (!(data && data->display_elements))
-    return;
+  gst_event_parse_segment (event, &segment);
+  gst_event_parse_segment (current, &current_segment);
+  same = gst_segment_is_equal (segment, current_segment);
+  gst_event_unref (current);
+
+  return same;
+}
+
+/* Tee sink, for the whole source: idle until source_replace arms it */
+static GstPadProbeReturn probe_source_handover_cb (GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+  CustomData *data = (CustomData *)user_data;
+  GstBuffer *buffer;
+  GstEvent *event;
+
+  if (!g_atomic_int_get (&data->source_handover))
+    return GST_PAD_PROBE_OK;
+
+  if (GST_PAD_PROBE_INFO_TYPE (info) & GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM) {
+    event = GST_PAD_PROBE_INFO_EVENT (info);
+    if (GST_EVENT_TYPE (event) == GST_EVENT_STREAM_START)
+      return GST_PAD_PROBE_DROP;
+    if (GST_EVENT_TYPE (event) == GST_EVENT_SEGMENT && source_handover_same_segment (pad, event))
+      return GST_PAD_PROBE_DROP;
+    return GST_PAD_PROBE_OK;
+  }
 
-  count = sizeof (display_vector) / sizeof (element_node) - 1;
-  cleanup_elements (data->pipeline, data->display_elements, count);
-  g_free (data->display_elements);
+  buffer = GST_PAD_PROBE_INFO_BUFFER (info);
+  if (GST_BUFFER_FLAG_IS_SET (buffer, GST_BUFFER_FLAG_DELTA_UNIT))
+    return GST_PAD_PROBE_DROP;
 
-  data->display_elements = NULL;
-  data->display_queue_sinkpad = NULL;
+  buffer = gst_buffer_make_writable (buffer);
+  GST_BUFFER_FLAG_SET (buffer, GST_BUFFER_FLAG_DISCONT);
+  GST_PAD_PROBE_INFO_DATA (info) = buffer;
 
+  g_atomic_int_set (&data->source_handover, FALSE);
+  alogi ("source handover: resumed on an IDR");
+  return GST_PAD_PROBE_OK;
 }
 
-static gboolean setup_display_elements (CustomData *data) {
-  GstElement **elements;
-  GstPad *display_queue_sinkpad;
+static void rtspsrc_release_async (GstElement *rtspsrc, gpointer user_data) {
+  gst_element_set_state (rtspsrc, GST_STATE_NULL);
+  gst_object_unref (rtspsrc);
+}
+
+/*
+ * Called with mutex_branch held. Put a new rtspsrc in place of the running one. The old
+ * one is taken out of the bin and sends its TEARDOWN from an async thread, the errors it
+ * posts meanwhile are ignored; the new one links to the same depayloader, so nothing past
+ * it is torn down. Unless start, the new one stays in NULL until source_reset_done.
+ */
+static gboolean source_replace (CustomData *data, gboolean start) {
+  GstElement *rtspsrc, *old;
+
+  rtspsrc = rtspsrc_new (data);
+  if (!rtspsrc) {
+    aloge ("source_replace: create rtspsrc failed!");
+    return FALSE;
+  }
+  g_object_set (G_OBJECT(rtspsrc), "location", data->rtspsrc_url, NULL);
+
+  old = data->rtspsrc;
+  if (data->rtspsrc_linked)
+    gst_element_unlink (old, data->rtspsrc_elements[SC_H264DEPAY]);
+  data->rtspsrc_linked = FALSE;
+  gst_element_set_locked_state (old, TRUE);
+  /* no late on-sdp or new-manager from its teardown lands on the new session */
+  g_signal_handlers_disconnect_by_data (old, data);
+  gst_object_ref (old);
+  gst_bin_remove (GST_BIN(data->pipeline), old);
+  gst_element_call_async (old, rtspsrc_release_async, NULL, NULL);
+
+  jitter_source_closed (&data->jitter);
+  capture_clock_reset (&data->capture);
+  watchdog_source_closed (&data->watchdog);
+  gop_cache_flush (&data->tee_gop_cache);
+  g_atomic_int_set (&data->source_handover, TRUE);
+  g_atomic_int_set (&data->reconnect.waiting, TRUE);
+
+  if (!start)
+    gst_element_set_locked_state (rtspsrc, TRUE);
+  gst_bin_add (GST_BIN(data->pipeline), rtspsrc);
+  data->rtspsrc = rtspsrc;
+  if (start)
+    gst_element_sync_state_with_parent (rtspsrc);
+
+  return TRUE;
+}
+
+/* Worker thread. Move the source to the transport the policy picked */
+static void source_switch_transport (CustomData *data) {
+  g_mutex_lock (&data->transport.lock);
+  data->transport.switching = FALSE;
+  g_mutex_unlock (&data->transport.lock);
+
+  g_mutex_lock (&data->mutex_branch);
+  if (data->rtspsrc && !data->source_stopping && !data->pipeline_restarting &&
+      !g_atomic_int_get (&data->reset_request))
+    source_replace (data, TRUE);
+  g_mutex_unlock (&data->mutex_branch);
+}
+
+static gboolean setup_rtspsrc_elements (CustomData *data) {
+  GstElement *pipeline, *rtspsrc, **elements;
+  GstPad *tee_sinkpad;
+  GstCaps *caps;
   int count;
 
-  if (!data || !data->pipeline) {
-    aloge ("setup_display_elements: Parameter error!");
+  if (!data) {
+    aloge ("setup_rtspsrc_elements: Parameter error!");
+    return FALSE;
+  }
+
+  pipeline = data->pipeline;
+  if (!pipeline) {
+    aloge ("setup_rtspsrc_elements: get pipeline failed!");
+    return FALSE;
+  }
+
+  rtspsrc = rtspsrc_new (data);
+  if (!rtspsrc) {
+    aloge ("setup_rtspsrc_elements: create rtspsrc !");
     return FALSE;
   }
 
-  count = sizeof (display_vector) / sizeof (element_node);
+  count = sizeof (source_vector) / sizeof (element_node);
   elements = (GstElement **)g_malloc0 (sizeof(GstElement*) * count);
   if (!elements) {
-    aloge ("setup_display_elements: alloc elements failed!");
+    aloge ("setup_rtspsrc_elements: alloc elements failed !");
     return FALSE;
   }
 
-  if (!setup_elements (data->pipeline, elements, display_vector)) {
-    aloge ("setup_display_elements: setup elements failed!");
+  if (!setup_elements (pipeline, elements, source_vector, NULL)) {
+    aloge ("setup_rtspsrc_elements:setup elements failed!");
     g_free (elements);
     return FALSE;
   }
+  gst_elements_set_locked_state_v (elements, FALSE);
+  trace_attach_v (&data->trace, elements);
 
-  display_queue_sinkpad = gst_element_get_static_pad(elements[DP_QUEUE0], "sink");
-  if (!display_queue_sinkpad) {
-    aloge ("setup_display_elements: get display queue sinkpad failed !");
-    cleanup_elements (data->pipeline, elements, count - 1);
+  tee_sinkpad = gst_element_get_static_pad(elements[SC_TEE], "sink");
+  if (!tee_sinkpad) {
+    aloge ("setup_rtspsrc_elements: get tee_sinkpad failed!");
+    cleanup_elements (pipeline, elements, count - 1);
     g_free (elements);
     return FALSE;
   }
 
-  g_object_set (G_OBJECT(elements[DP_VIDEOSINK]), "sync", (gboolean) FALSE,
-          "message-forward", (gboolean) TRUE, "async-handling", (gboolean) TRUE, NULL);
+  gst_bin_add (GST_BIN (pipeline), rtspsrc);
+
+  // drop eos of autovideosink branch
+  gst_pad_add_probe(tee_sinkpad, GST_PAD_PROBE_TYPE_EVENT_BOTH, probe_eos_cb, data, NULL);
+  gst_pad_add_probe(tee_sinkpad, GST_PAD_PROBE_TYPE_BUFFER, probe_capture_clock_cb, data, NULL);
+  gst_pad_add_probe(tee_sinkpad, GST_PAD_PROBE_TYPE_BUFFER, probe_arrival_cb, data, NULL);
+  g_atomic_int_set (&data->reconnect.waiting, TRUE);
+  gst_pad_add_probe(tee_sinkpad, GST_PAD_PROBE_TYPE_BUFFER, probe_reconnect_up_cb, data, NULL);
+  gst_pad_add_probe(tee_sinkpad, GST_PAD_PROBE_TYPE_BUFFER, probe_watchdog_cb, data, NULL);
+  ttff_trace_attach (&data->ttff, elements[SC_H264DEPAY], "sink", TTFF_RTP);
+  ttff_trace_attach (&data->ttff, elements[SC_TEE], "sink", TTFF_IDR);
+  gst_pad_add_probe(tee_sinkpad, GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM, probe_session_caps_cb, data, NULL);
+  gst_pad_add_probe(tee_sinkpad, GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM, probe_media_caps_cb, data, NULL);
+  gst_pad_add_probe(tee_sinkpad, GST_PAD_PROBE_TYPE_BUFFER, probe_gop_cache_cb,
+      &data->tee_gop_cache, NULL);
+
+  gst_pad_add_probe(tee_sinkpad, GST_PAD_PROBE_TYPE_BUFFER, probe_pre_event_cb, data, NULL);
+
+  if (data->cpu_meter_enabled)
+    gst_pad_add_probe(tee_sinkpad, GST_PAD_PROBE_TYPE_BUFFER, probe_cpu_meter_cb, data, NULL);
+
+  /* last, what it drops has been seen by the probes above */
+  g_atomic_int_set (&data->source_handover, FALSE);
+  gst_pad_add_probe(tee_sinkpad, GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM,
+          probe_source_handover_cb, data, NULL);
+
+  caps = gst_caps_from_string (SC_TEE_CAPS);
+  g_object_set (G_OBJECT(elements[SC_CAPSFILTER]), "caps", caps, NULL);
+  gst_caps_unref (caps);
 
-  data->display_elements = elements;
-  data->display_queue_sinkpad = display_queue_sinkpad;
+  g_object_set (G_OBJECT(elements[SC_H264PARSE]), "config-interval", -1, NULL);
+  g_object_set (G_OBJECT(elements[SC_TEE]), "allow-not-linked", (gboolean) TRUE, NULL);
+
+  data->rtspsrc = rtspsrc;
+  data->rtspsrc_elements = elements;
+  data->tee_sinkpad = tee_sinkpad;
+  data->rtspsrc_linked = FALSE;
+  memset (&data->source_cpu, 0, sizeof (cpu_meter));
 
   return TRUE;
 }
 
-static void cleanup_push_rtmp_elements (CustomData *data) {
-  int count;
+static GstPadProbeReturn probe_branch_latency_cb (GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+  branch *br = (branch *)user_data;
+  GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER (info);
+  GstClockTime ts;
+  gint64 capture_us;
+
+  ts = GST_BUFFER_PTS_IS_VALID (buffer) ? GST_BUFFER_PTS (buffer) : GST_BUFFER_DTS (buffer);
+  if (!GST_CLOCK_TIME_IS_VALID (ts))
+    return GST_PAD_PROBE_OK;
+
+  capture_us = capture_clock_lookup (&br->data->capture, ts);
+  if (capture_us < 0)
+    return GST_PAD_PROBE_OK;
+
+  latency_window_add (&br->g2g, g_get_real_time () - capture_us, br->g2g_label);
+
+  return GST_PAD_PROBE_OK;
+}
+
+static GstPadProbeReturn probe_branch_heal_cb (GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+  branch *br = (branch *)user_data;
+  CustomData *data = br->data;
+  gint64 now = g_get_monotonic_time ();
+  gchar *message;
+
+  if (GST_BUFFER_FLAG_IS_SET (GST_PAD_PROBE_INFO_BUFFER (info), GST_BUFFER_FLAG_HEADER))
+    return GST_PAD_PROBE_OK;
+
+  g_mutex_lock (&data->mutex_branch);
+  if (!br->heal.outage_begin) {
+    g_mutex_unlock (&data->mutex_branch);
+    return GST_PAD_PROBE_REMOVE;
+  }
+
+  if (++br->heal.frames < 2) {
+    g_mutex_unlock (&data->mutex_branch);
+    return GST_PAD_PROBE_OK;
+  }
 
-  if (!(data && data->push_rtmp_elements))
+  br->heal.outages++;
+  alogi ("branch %s: reconnected in %" G_GINT64_FORMAT "ms, outage %" G_GINT64_FORMAT
+          "ms over %u attempts (%u outages)", br->id, (now - br->heal.restart_begin) / 1000,
+          (now - br->heal.outage_begin) / 1000, br->heal.attempt, br->heal.outages);
+  br->heal.outage_begin = 0;
+  br->heal.attempt = 0;
+  message = g_strconcat (USR_MESSAGE_BRANCH_HEALED, br->id, NULL);
+  g_mutex_unlock (&data->mutex_branch);
+
+  set_usr_message (message, data);
+  g_free (message);
+
+  return GST_PAD_PROBE_REMOVE;
+}
+
+/* The branch queue is full, so the tee waits on this output until it drains */
+static void branch_queue_overrun_cb (GstElement *queue, gpointer user_data) {
+  branch *br = (branch *)user_data;
+
+  alogw ("branch %s: queue full, tee stalled (%d)", br->id, g_atomic_int_add (&br->stalls, 1) + 1);
+}
+
+static void cleanup_branch_elements (CustomData *data, branch *br) {
+  if (!br->elements)
     return;
 
-  count = sizeof (push_rtmp_vector) / sizeof (element_node) - 1;
-  cleanup_elements (data->pipeline, data->push_rtmp_elements, count);
-  g_free (data->push_rtmp_elements);
+  if (br->queue_sinkpad) {
+    gst_object_unref (br->queue_sinkpad);
+    br->queue_sinkpad = NULL;
+  }
+
+  if (br->desc->release)
+    br->desc->release (data, br);
 
-  data->push_rtmp_queue_sinkpad = NULL;
-  data->push_rtmp_elements = NULL;
+  cleanup_elements (data->pipeline, br->elements, element_vector_count (br->desc->vector));
+  g_free (br->elements);
+  br->elements = NULL;
 }
 
-static gboolean setup_push_rtmp_elements (CustomData *data) {
+static gboolean setup_branch_elements (CustomData *data, branch *br) {
   GstElement **elements;
-  GstPad *push_rtmp_queue_sinkpad;
+  GstPad *queue_sinkpad, *output_pad;
   int count;
 
-  if (!data || !data->pipeline) {
-    aloge ("setup_push_rtmp_elements: Parameter error!");
+  if (!data->pipeline) {
+    aloge ("setup_branch_elements: Parameter error!");
     return FALSE;
   }
 
-  count = sizeof (push_rtmp_vector) / sizeof (element_node);
-  elements = (GstElement **)g_malloc0 (sizeof(GstElement*) * count);
-  if (!elements) {
-    aloge ("setup_push_rtmp_elements: alloc elements failed!");
+  count = element_vector_count (br->desc->vector);
+  elements = (GstElement **)g_malloc0 (sizeof(GstElement*) * (count + 1));
+  if (!setup_elements (data->pipeline, elements, br->desc->vector, br->id)) {
+    aloge ("setup_branch_elements: setup %s elements failed!", br->id);
+    g_free (elements);
+    return FALSE;
+  }
+
+  queue_sinkpad = gst_element_get_static_pad (elements[0], "sink");
+  if (!queue_sinkpad) {
+    aloge ("setup_branch_elements: get %s queue sinkpad failed !", br->id);
+    cleanup_elements (data->pipeline, elements, count);
+    g_free (elements);
     return FALSE;
   }
 
-  if (!setup_elements (data->pipeline, elements, push_rtmp_vector)) {
-    aloge ("setup_push_rtmp_elements: setup elements failed!");
+  g_signal_connect (elements[0], "overrun", G_CALLBACK (branch_queue_overrun_cb), br);
+  trace_attach_v (&data->trace, elements);
+
+  if (!br->g2g_label)
+    br->g2g_label = g_strdup_printf ("%s capture-to-%s", br->id, br->desc->output);
+  output_pad = gst_element_get_static_pad (elements[br->desc->ttff_element], br->desc->ttff_pad);
+  gst_pad_add_probe (output_pad, GST_PAD_PROBE_TYPE_BUFFER, probe_branch_latency_cb, br, NULL);
+  if (br->heal.outage_begin) {
+    br->heal.restart_begin = g_get_monotonic_time ();
+    br->heal.frames = 0;
+    gst_pad_add_probe (output_pad, GST_PAD_PROBE_TYPE_BUFFER, probe_branch_heal_cb, br, NULL);
+  }
+  gst_object_unref (output_pad);
+
+  br->elements = elements;
+  br->queue_sinkpad = queue_sinkpad;
+
+  if (br->desc->configure)
+    br->desc->configure (data, br);
+
+  return TRUE;
+}
+
+static gboolean setup_flv_core (CustomData *data) {
+  flv_core *core = &data->flv;
+  GstElement **elements;
+  GstPad *tee_sinkpad;
+  int count;
+
+  count = element_vector_count (flv_core_vector);
+  elements = (GstElement **)g_malloc0 (sizeof(GstElement*) * (count + 1));
+  if (!setup_elements (data->pipeline, elements, flv_core_vector, FC_PREFIX)) {
+    aloge ("setup_flv_core: setup elements failed!");
     g_free (elements);
     return FALSE;
   }
 
-  push_rtmp_queue_sinkpad = gst_element_get_static_pad(elements[PU_RTMP_QUEUE], "sink");
-  if (!push_rtmp_queue_sinkpad) {
-    aloge ("setup_push_rtmp_elements: get pushing queue sinkpad failed !");
-    cleanup_elements (data->pipeline, elements, count - 1);
-    g_free (elements);
-    return FALSE;
-  }
+  trace_attach_v (&data->trace, elements);
+  core->queue_sinkpad = gst_element_get_static_pad (elements[FC_QUEUE], "sink");
+  tee_sinkpad = gst_element_get_static_pad (elements[FC_TEE], "sink");
+  gst_pad_add_probe (tee_sinkpad, GST_PAD_PROBE_TYPE_BUFFER, probe_gop_cache_cb, &core->cache, NULL);
+  gst_object_unref (tee_sinkpad);
+
+  g_object_set (G_OBJECT(elements[FC_FLVMUX]), "streamable", (gboolean) TRUE, NULL);
+  g_object_set (G_OBJECT(elements[FC_TEE]), "allow-not-linked", (gboolean) TRUE, NULL);
+
+  core->elements = elements;
+  return TRUE;
+}
+
+/* Called with mutex_branch held, with no FLV consumer running */
+static void cleanup_flv_core (CustomData *data) {
+  flv_core *core = &data->flv;
+  GHashTableIter iter;
+  branch *br;
+
+  if (!core->elements)
+    return;
+
+  if (data->branches) {
+    g_hash_table_iter_init (&iter, data->branches);
+    while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&br)) {
+      if (br->desc->upstream == BRANCH_UPSTREAM_FLV)
+        branch_release_tee_pad (data, br);
+    }
+  }
+  release_tee_pad (&core->tee_srcpad);
+
+  gst_object_unref (core->queue_sinkpad);
+  core->queue_sinkpad = NULL;
+  cleanup_elements (data->pipeline, core->elements, element_vector_count (flv_core_vector));
+  g_free (core->elements);
+  core->elements = NULL;
+  core->pool_flush = FALSE;
+  gop_cache_flush (&core->cache);
+}
+
+static gchar *make_filesink_dir(const gchar *dir, guint index) {
+  GDateTime *date;
+  gchar *date_str;
+  gchar *filesink_dir;
+
+  date = g_date_time_new_now_utc ();
+  date_str = g_date_time_format (date, "%Y-%m-%d-%H-%M-%S-utc");
+  g_date_time_unref (date);
+
+  filesink_dir = g_strdup_printf ("%s/VideoRecording-%s-%03u.flv", dir, date_str, index);
+  g_free(date_str);
+
+  return filesink_dir;
+}
+
+static gboolean display_ready (CustomData *data, branch *br) {
+  return data->native_window != NULL;
+}
+
+static void display_configure (CustomData *data, branch *br) {
+  GstPad *pad;
+
+  g_object_set (G_OBJECT(br->elements[DP_VIDEOSINK]), "sync", (gboolean) FALSE,
+          "message-forward", (gboolean) TRUE, "async-handling", (gboolean) TRUE, NULL);
+
+  pad = gst_element_get_static_pad (br->elements[DP_QUEUE0], "src");
+  gst_pad_add_probe (pad, GST_PAD_PROBE_TYPE_BUFFER, probe_display_deadline_cb, &data->deadline, NULL);
+  gst_object_unref (pad);
+
+  pad = gst_element_get_static_pad (br->elements[DP_QUEUE1], "sink");
+  gst_pad_add_probe (pad, GST_PAD_PROBE_TYPE_BUFFER, probe_display_latency_cb, &data->deadline, NULL);
+  gst_object_unref (pad);
+
+  ttff_trace_attach (&data->ttff, br->elements[DP_QUEUE1], "sink", TTFF_DECODED);
+  ttff_trace_attach (&data->ttff, br->elements[DP_VIDEOSINK], "sink", TTFF_RENDER);
+}
+
+static void display_prepare (CustomData *data, branch *br) {
+  GstElement *overlay_sink;
+
+  /* the replayed GOP is as old as the branch, not as its arrival at the tee */
+  g_mutex_lock (&data->deadline.lock);
+  data->deadline.since_us = g_get_monotonic_time ();
+  data->deadline.resync = FALSE;
+  g_mutex_unlock (&data->deadline.lock);
+
+  /* a pooled sink already has its video sink, a new one asks in bus_sync_handler */
+  overlay_sink = gst_bin_get_by_interface (GST_BIN(data->pipeline), GST_TYPE_VIDEO_OVERLAY);
+  if (overlay_sink) {
+    gst_video_overlay_set_window_handle (GST_VIDEO_OVERLAY (overlay_sink),
+            (guintptr) data->native_window);
+    gst_object_unref (overlay_sink);
+  }
+}
+
+static void flv_consumer_queue_configure (GstElement *queue) {
+  g_object_set (G_OBJECT(queue), "max-size-buffers", 0, NULL);
+  g_object_set (G_OBJECT(queue), "max-size-bytes", 0, NULL);
+  g_object_set (G_OBJECT(queue), "max-size-time", (guint64) FLV_CONSUMER_QUEUE_TIME, NULL);
+  g_object_set (G_OBJECT(queue), "leaky", 2, NULL);
+}
+
+static GstPadProbeReturn probe_push_queue_cb (GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+  branch *br = (branch *)user_data;
+  gop_dropper *drop = &br->drop;
+  GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER (info);
+  guint64 level_time;
+  guint level_bytes;
+
+  if (GST_BUFFER_FLAG_IS_SET (buffer, GST_BUFFER_FLAG_HEADER))
+    return GST_PAD_PROBE_OK;
+
+  /* the levels only matter where a GOP starts */
+  if (!GST_BUFFER_FLAG_IS_SET (buffer, GST_BUFFER_FLAG_DELTA_UNIT)) {
+    g_object_get (G_OBJECT(drop->queue), "current-level-time", &level_time,
+            "current-level-bytes", &level_bytes, NULL);
+
+    if (!drop->dropping && (level_time >= PUSH_QUEUE_TIME || level_bytes >= PUSH_QUEUE_BYTES)) {
+      drop->dropping = TRUE;
+      drop->begin = g_get_monotonic_time ();
+      drop->buffers = 0;
+      drop->bytes = 0;
+      drop->events++;
+      alogw ("branch %s: uplink behind by %" G_GUINT64_FORMAT "ms/%uKB, dropping GOPs (%u)",
+              br->id, level_time / GST_MSECOND, level_bytes / 1024, drop->events);
+    } else if (drop->dropping && level_time < PUSH_QUEUE_TIME / 2 && level_bytes < PUSH_QUEUE_BYTES / 2) {
+      drop->dropping = FALSE;
+      alogi ("branch %s: resumed on a key frame after dropping %u buffers/%" G_GUINT64_FORMAT
+              "KB in %" G_GINT64_FORMAT "ms", br->id, drop->buffers, drop->bytes / 1024,
+              (g_get_monotonic_time () - drop->begin) / 1000);
+    }
+  }
+
+  if (!drop->dropping)
+    return GST_PAD_PROBE_OK;
+
+  drop->buffers++;
+  drop->bytes += gst_buffer_get_size (buffer);
+  drop->total_buffers++;
+  return GST_PAD_PROBE_DROP;
+}
+
+static void push_queue_configure (branch *br, GstElement *queue) {
+  GstPad *pad;
+
+  g_object_set (G_OBJECT(queue), "max-size-buffers", 0, "max-size-bytes", 2 * PUSH_QUEUE_BYTES,
+          "max-size-time", (guint64) 2 * PUSH_QUEUE_TIME, "leaky", 2, "flush-on-eos", TRUE, NULL);
+
+  memset (&br->drop, 0, sizeof (br->drop));
+  br->drop.queue = queue;
+  pad = gst_element_get_static_pad (queue, "sink");
+  gst_pad_add_probe (pad, GST_PAD_PROBE_TYPE_BUFFER, probe_push_queue_cb, br, NULL);
+  gst_object_unref (pad);
+}
+
+static void push_rtmp_configure (CustomData *data, branch *br) {
+  GstElement **elements = br->elements;
+
+  push_queue_configure (br, elements[PU_RTMP_QUEUE]);
+
+  g_object_set (G_OBJECT(elements[PU_RTMPSINK]), "sync", ( (gboolean) FALSE), NULL);
+}
+
+static void push_rtsp_configure (CustomData *data, branch *br) {
+  GstElement **elements = br->elements;
+
+  push_queue_configure (br, elements[PU_RTSP_QUEUE]);
+  g_object_set (G_OBJECT(elements[PU_RTSPSINK]), "protocols", GST_RTSP_LOWER_TRANS_TCP, "latency", 10000, NULL);
+  //g_object_set (G_OBJECT(elements[PU_RTSPSINK]), "debug", TRUE, NULL);
+}
+
+/* Engine finalizer thread: the segment is off the recording path, sync it to storage */
+static void recorder_finalize (gpointer task, gpointer user_data) {
+  rec_segment *seg = (rec_segment *)task;
+  gint64 begin = g_get_monotonic_time ();
+
+  fflush (seg->file);
+  fsync (fileno (seg->file));
+  fclose (seg->file);
+
+  alogi ("recording %s: %" G_GUINT64_FORMAT " bytes, %ums, write %.2fMB/s, finalized in %"
+          G_GINT64_FORMAT "us (queued %" G_GINT64_FORMAT "us)", seg->location, seg->bytes,
+          seg->duration_ms, seg->write_us ? (gdouble) seg->bytes / seg->write_us : 0.0,
+          g_get_monotonic_time () - begin, begin - seg->closed);
+
+  g_free (seg->location);
+  g_free (seg);
+}
+
+static gboolean recorder_write (recorder *rec, const guint8 *bytes, gsize size) {
+  rec_segment *seg = rec->segment;
+  gint64 begin = g_get_monotonic_time ();
+  gboolean ret;
+
+  ret = fwrite (bytes, 1, size, seg->file) == size;
+  seg->write_us += g_get_monotonic_time () - begin;
+  seg->bytes += size;
+
+  return ret;
+}
+
+static void recorder_close_segment (recorder *rec) {
+  rec_segment *seg = rec->segment;
+
+  if (!seg)
+    return;
+
+  seg->duration_ms = rec->last_ts - rec->base_ts;
+  seg->closed = g_get_monotonic_time ();
+  rec->segment = NULL;
+  g_thread_pool_push (shared_engine.finalizers, seg, NULL);
+}
+
+/* Every segment is a complete file, it starts with the stream headers from the caps */
+static gboolean recorder_open_segment (recorder *rec, GstCaps *caps, guint32 ts) {
+  const GValue *headers, *header;
+  rec_segment *seg;
+  GstMapInfo map;
+  gboolean ret = TRUE;
+  guint i;
+
+  seg = g_new0 (rec_segment, 1);
+  seg->location = make_filesink_dir (rec->dir, rec->index);
+  seg->file = fopen (seg->location, "wb");
+  if (!seg->file) {
+    aloge ("recording %s: open failed", seg->location);
+    g_free (seg->location);
+    g_free (seg);
+    return FALSE;
+  }
+
+  rec->segment = seg;
+  rec->index++;
+  rec->base_ts = rec->last_ts = ts;
+
+  headers = caps ? gst_structure_get_value (gst_caps_get_structure (caps, 0), "streamheader") : NULL;
+  for (i = 0; headers && GST_VALUE_HOLDS_ARRAY (headers) && i < gst_value_array_get_size (headers); i++) {
+    header = gst_value_array_get_value (headers, i);
+    if (!GST_VALUE_HOLDS_BUFFER (header) ||
+        !gst_buffer_map (gst_value_get_buffer (header), &map, GST_MAP_READ))
+      continue;
+    ret = recorder_write (rec, map.data, map.size) && ret;
+    gst_buffer_unmap (gst_value_get_buffer (header), &map);
+  }
+
+  alogi ("recording %s: segment opened", seg->location);
+  return ret;
+}
+
+/* Recording queue thread: one FLV tag per buffer, segments rotate on key frames only */
+static GstFlowReturn recorder_new_sample_cb (GstAppSink *appsink, gpointer user_data) {
+  recorder *rec = (recorder *)user_data;
+  guint8 tag[FLV_TAG_HEADER_SIZE];
+  GstSample *sample;
+  GstBuffer *buffer;
+  GstMapInfo map;
+  gboolean ret = TRUE;
+  guint32 ts;
+
+  sample = gst_app_sink_pull_sample (appsink);
+  if (!sample)
+    return GST_FLOW_EOS;
+
+  /* the stream headers come from the caps, for every segment */
+  buffer = gst_sample_get_buffer (sample);
+  if (GST_BUFFER_FLAG_IS_SET (buffer, GST_BUFFER_FLAG_HEADER) ||
+      !gst_buffer_map (buffer, &map, GST_MAP_READ)) {
+    gst_sample_unref (sample);
+    return GST_FLOW_OK;
+  }
+
+  if (map.size > FLV_TAG_HEADER_SIZE) {
+    ts = ((guint32) map.data[7] << 24) | ((guint32) map.data[4] << 16) |
+         ((guint32) map.data[5] << 8) | map.data[6];
+
+    if (!GST_BUFFER_FLAG_IS_SET (buffer, GST_BUFFER_FLAG_DELTA_UNIT) && (!rec->segment ||
+        (rec->max_ms && ts - rec->base_ts >= rec->max_ms) ||
+        (rec->max_bytes && rec->segment->bytes >= rec->max_bytes))) {
+      recorder_close_segment (rec);
+      ret = recorder_open_segment (rec, gst_sample_get_caps (sample), ts);
+    }
+
+    /* timestamps restart at 0 in every segment */
+    if (rec->segment) {
+      rec->last_ts = ts;
+      ts -= rec->base_ts;
+      memcpy (tag, map.data, FLV_TAG_HEADER_SIZE);
+      tag[4] = (ts >> 16) & 0xff;
+      tag[5] = (ts >> 8) & 0xff;
+      tag[6] = ts & 0xff;
+      tag[7] = (ts >> 24) & 0xff;
+      ret = recorder_write (rec, tag, FLV_TAG_HEADER_SIZE) &&
+            recorder_write (rec, map.data + FLV_TAG_HEADER_SIZE, map.size - FLV_TAG_HEADER_SIZE) && ret;
+    }
+  }
+
+  gst_buffer_unmap (buffer, &map);
+  gst_sample_unref (sample);
+
+  if (!ret) {
+    GST_ELEMENT_ERROR (appsink, RESOURCE, WRITE, ("Could not write recording segment."), (NULL));
+    return GST_FLOW_ERROR;
+  }
+
+  return GST_FLOW_OK;
+}
+
+/* The drained EOS of a stop, the last segment is complete */
+static void recorder_eos_cb (GstAppSink *appsink, gpointer user_data) {
+  recorder_close_segment ((recorder *)user_data);
+}
+
+static void recording_configure (CustomData *data, branch *br) {
+  GstAppSinkCallbacks callbacks = { recorder_eos_cb, NULL, recorder_new_sample_cb };
+  recorder *rec = g_new0 (recorder, 1);
+
+  flv_consumer_queue_configure (br->elements[RC_QUEUE]);
+  g_object_set (G_OBJECT(br->elements[RC_APPSINK]), "sync", (gboolean) FALSE, NULL);
+  gst_app_sink_set_callbacks (GST_APP_SINK (br->elements[RC_APPSINK]), &callbacks, rec, NULL);
+  br->priv = rec;
+}
+
+static gboolean recording_ready (CustomData *data, branch *br) {
+  return gst_structure_get_string (br->spec, "dir") != NULL;
+}
+
+/*
+ * Every start records a new series of segments in the "dir" of the spec, cut after
+ * "segment-seconds" or "segment-mbytes".
+ */
+static void recording_prepare (CustomData *data, branch *br) {
+  recorder *rec = (recorder *)br->priv;
+  gint seconds = RC_SEGMENT_SECONDS;
+  gint mbytes = RC_SEGMENT_MBYTES;
+
+  gst_structure_get_int (br->spec, "segment-seconds", &seconds);
+  gst_structure_get_int (br->spec, "segment-mbytes", &mbytes);
+
+  recorder_close_segment (rec);
+  g_free (rec->dir);
+  rec->dir = g_strdup (gst_structure_get_string (br->spec, "dir"));
+  rec->max_ms = MAX (seconds, 0) * 1000;
+  rec->max_bytes = (guint64) MAX (mbytes, 0) * 1024 * 1024;
+  rec->index = 0;
+}
+
+/* A segment still open was not drained, keep what made it to the file */
+static void recording_release (CustomData *data, branch *br) {
+  recorder *rec = (recorder *)br->priv;
+
+  if (!rec)
+    return;
+
+  recorder_close_segment (rec);
+  g_free (rec->dir);
+  g_free (rec);
+  br->priv = NULL;
+}
+
+const static branch_desc display_desc = {
+  .type = "display",
+  .vector = display_vector,
+  .upstream = BRANCH_UPSTREAM_H264,
+  .sink = DP_VIDEOSINK,
+  .ttff_element = DP_QUEUE1,    /* decoded frames enter the render queue */
+  .ttff_pad = "sink",
+  .output = "render",
+  .park_state = DP_PARK_STATE,
+  .teardown = BRANCH_TEARDOWN_UNLINK,
+  .ready = display_ready,
+  .configure = display_configure,
+  .prepare = display_prepare,
+};
+
+const static branch_desc push_rtmp_desc = {
+  .type = "rtmp",
+  .vector = push_rtmp_vector,
+  .upstream = BRANCH_UPSTREAM_FLV,
+  .sink = PU_RTMPSINK,
+  .ttff_element = PU_RTMPSINK,
+  .ttff_pad = "sink",
+  .output = "send",
+  .park_state = PU_RTMP_PARK_STATE,
+  .teardown = BRANCH_TEARDOWN_UNLINK,
+  .heal = TRUE,
+  .configure = push_rtmp_configure,
+};
+
+const static branch_desc push_rtsp_desc = {
+  .type = "rtsp",
+  .vector = push_rtsp_vector,
+  .upstream = BRANCH_UPSTREAM_H264,
+  .sink = PU_RTSPSINK,
+  .ttff_element = PU_RTSP_QUEUE,  /* rtspclientsink only has request pads */
+  .ttff_pad = "src",
+  .output = "send",
+  .park_state = PU_RTSP_PARK_STATE,
+  .teardown = BRANCH_TEARDOWN_DRAIN,
+  .stop_on_error = TRUE,
+  .configure = push_rtsp_configure,
+};
+
+const static branch_desc recording_desc = {
+  .type = "file",
+  .vector = recording_vector,
+  .upstream = BRANCH_UPSTREAM_FLV,
+  .sink = RC_APPSINK,
+  .ttff_element = RC_APPSINK,
+  .ttff_pad = "sink",
+  .output = "write",
+  .park_state = RC_PARK_STATE,
+  .teardown = BRANCH_TEARDOWN_DRAIN,  /* the last segment is closed on EOS */
+  .stop_on_error = TRUE,
+  .ready = recording_ready,
+  .configure = recording_configure,
+  .prepare = recording_prepare,
+  .release = recording_release,
+};
 
-  g_object_set (G_OBJECT(elements[PU_RTMP_QUEUE]), "max-size-buffers", 0, NULL);
-  g_object_set (G_OBJECT(elements[PU_RTMP_QUEUE]), "max-size-bytes", 0, NULL);
-  //g_object_set (G_OBJECT(elements[PU_RTMP_QUEUE]), "max-size-time", 0, NULL);
-  g_object_set (G_OBJECT(elements[PU_RTMP_QUEUE]), "flush-on-eos", TRUE, NULL);
+const static branch_desc *branch_descs[] = {
+  &display_desc,
+  &push_rtmp_desc,
+  &push_rtsp_desc,
+  &recording_desc,
+  NULL
+};
 
-  g_object_set (G_OBJECT(elements[PU_RTMP_FLVMUX]), "streamable", ( (gboolean) TRUE), NULL);
-  g_object_set (G_OBJECT(elements[PU_RTMPSINK]), "sync", ( (gboolean) FALSE), NULL);
+static const branch_desc *branch_desc_lookup (const gchar *type) {
+  int i;
 
-  data->push_rtmp_queue_sinkpad = push_rtmp_queue_sinkpad;
-  data->push_rtmp_elements = elements;
+  for (i = 0; branch_descs[i] != NULL; i++) {
+    if (!g_strcmp0 (branch_descs[i]->type, type))
+      return branch_descs[i];
+  }
 
-  return TRUE;
+  return NULL;
 }
 
-static void cleanup_push_rtsp_elements (CustomData *data) {
-  int count;
+static branch *branch_new (CustomData *data, const gchar *id, const branch_desc *desc,
+        GstStructure *spec) {
+  branch *br = g_new0 (branch, 1);
+
+  br->data = data;
+  br->id = g_strdup (id);
+  br->desc = desc;
+  br->spec = spec;
+  br->enabled = BRANCH_DISABLE;
+
+  /* the application knows the shutdown of the legacy push branches by these */
+  if (!g_strcmp0 (id, BRANCH_ID_PUSH_RTMP))
+    br->shutdown_message = g_strdup (USR_MESSAGE_PUSH_RTMP_SHUTDOWN);
+  else if (!g_strcmp0 (id, BRANCH_ID_PUSH_RTSP))
+    br->shutdown_message = g_strdup (USR_MESSAGE_PUSH_RTSP_SHUTDOWN);
+  else
+    br->shutdown_message = g_strconcat (USR_MESSAGE_BRANCH_SHUTDOWN, id, NULL);
 
-  if (!(data && data->push_rtsp_elements))
-    return;
+  return br;
+}
 
-  gst_object_unref (data->push_rtsp_queue_sinkpad);
-  data->push_rtsp_queue_sinkpad = NULL;
+/* Value destroy of data->branches, the branch is down */
+static void branch_free (gpointer user_data) {
+  branch *br = (branch *)user_data;
+  CustomData *data = br->data;
+
+  if (br->drain_timer) {
+    g_source_destroy (br->drain_timer);
+    g_source_unref (br->drain_timer);
+  }
 
-  count = sizeof (push_rtsp_vector) / sizeof (element_node);
-  cleanup_elements (data->pipeline, data->push_rtsp_elements, count);
+  if (br->heal.timer) {
+    g_source_destroy (br->heal.timer);
+    g_source_unref (br->heal.timer);
+  }
 
-  g_cond_clear (&data->push_rtsp_cond_eos);
-  g_free (data->push_rtsp_elements);
-  data->push_rtsp_elements = NULL;
+  branch_release_tee_pad (data, br);
+  cleanup_branch_elements (data, br);
 
+  if (br->spec)
+    gst_structure_free (br->spec);
+  g_free (br->shutdown_message);
+  g_free (br->g2g_label);
+  g_free (br->id);
+  g_free (br);
 }
 
-static gboolean setup_push_rtsp_elements (CustomData *data) {
-  GstElement **elements;
-  GstPad *push_rtsp_queue_sinkpad;
-  int count;
+/* Called with mutex_branch held. The branch owning obj, or one of its parents */
+static branch *branch_lookup_object (CustomData *data, GstObject *obj) {
+  GHashTableIter iter;
+  GstObject *parent;
+  branch *br;
+  int i;
 
-  if (!data || !data->pipeline) {
-    aloge ("setup_push_rtsp_elements: Parameter error!");
-    return FALSE;
-  }
+  gst_object_ref (obj);
+  while (obj) {
+    g_hash_table_iter_init (&iter, data->branches);
+    while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&br)) {
+      for (i = 0; br->elements && br->elements[i]; i++) {
+        if (GST_OBJECT (br->elements[i]) == obj) {
+          gst_object_unref (obj);
+          return br;
+        }
+      }
+    }
 
-  count = sizeof (push_rtsp_vector) / sizeof (element_node);
-  elements = (GstElement **)g_malloc0 (sizeof(GstElement*) * count);
-  if (!elements) {
-    aloge ("setup_push_rtsp_elements: alloc elements failed!");
-    return FALSE;
+    parent = gst_object_get_parent (obj);
+    gst_object_unref (obj);
+    obj = parent;
   }
 
-  if (!setup_elements (data->pipeline, elements, push_rtsp_vector)) {
-    aloge ("setup_push_rtsp_elements: setup elements failed!");
-    g_free (elements);
-    return FALSE;
+  return NULL;
+}
+
+/*
+ * Called with mutex_branch held. obj is in the source chain up to the tee, or in an
+ * rtspsrc, the current one or one replaced while its messages were on the way.
+ */
+static gboolean source_lookup_object (CustomData *data, GstObject *obj) {
+  GstObject *parent;
+  gboolean found = FALSE;
+  int i;
+
+  for (i = 0; data->rtspsrc_elements && data->rtspsrc_elements[i]; i++) {
+    if (GST_OBJECT (data->rtspsrc_elements[i]) == obj)
+      return TRUE;
   }
 
-  push_rtsp_queue_sinkpad = gst_element_get_static_pad(elements[PU_RTSP_QUEUE], "sink");
-  if (!push_rtsp_queue_sinkpad) {
-    aloge ("setup_push_rtsp_elements: get pushing queue sinkpad failed !");
-    cleanup_elements (data->pipeline, elements, count - 1);
-    g_free (elements);
-    return FALSE;
+  gst_object_ref (obj);
+  while (obj && !found) {
+    found = !g_strcmp0 (GST_OBJECT_NAME (obj), "rtspsrc");
+    parent = gst_object_get_parent (obj);
+    gst_object_unref (obj);
+    obj = parent;
   }
+  if (obj)
+    gst_object_unref (obj);
 
-  g_object_set (G_OBJECT(elements[PU_RTSP_QUEUE]), "max-size-buffers", 0, NULL);
-  g_object_set (G_OBJECT(elements[PU_RTSP_QUEUE]), "max-size-bytes", 0, NULL);
-  g_object_set (G_OBJECT(elements[PU_RTSP_QUEUE]), "max-size-time", 0, NULL);
-  g_object_set (G_OBJECT(elements[PU_RTSP_QUEUE]), "flush-on-eos", TRUE, NULL);
-  //g_object_set (G_OBJECT(elements[PU_RTSP_QUEUE]), "leaky", 2, NULL);
-  g_object_set (G_OBJECT(elements[PU_RTSPSINK]), "protocols", GST_RTSP_LOWER_TRANS_TCP, "latency", 10000, NULL);
-  //g_object_set (G_OBJECT(elements[PU_RTSPSINK]), "debug", TRUE, NULL);
+  return found;
+}
 
-  g_cond_init (&data->push_rtsp_cond_eos);
-  data->push_rtsp_queue_sinkpad = push_rtsp_queue_sinkpad;
-  data->push_rtsp_elements = elements;
+/* Called with mutex_branch held. obj is, or is inside, an rtspsrc source_replace took out */
+static gboolean source_replaced_object (CustomData *data, GstObject *obj) {
+  GstObject *parent;
+  gboolean replaced = FALSE;
 
-  return TRUE;
+  gst_object_ref (obj);
+  while (obj) {
+    if (!g_strcmp0 (GST_OBJECT_NAME (obj), "rtspsrc")) {
+      replaced = obj != GST_OBJECT (data->rtspsrc);
+      break;
+    }
+    parent = gst_object_get_parent (obj);
+    gst_object_unref (obj);
+    obj = parent;
+  }
+  if (obj)
+    gst_object_unref (obj);
+
+  return replaced;
 }
 
-static void cleanup_recording_elements (CustomData *data) {
-  int count;
+static gboolean branch_apply_spec_field (GQuark field_id, const GValue *value, gpointer user_data) {
+  GObject *sink = G_OBJECT (user_data);
+  const gchar *field = g_quark_to_string (field_id);
+  gchar *str;
 
-  if (!(data && data->recording_elements))
-    return;
+  if (!g_object_class_find_property (G_OBJECT_GET_CLASS (sink), field))
+    return TRUE;
 
-  count = sizeof (recording_vector) / sizeof (element_node) - 1;
-  cleanup_elements (data->pipeline, data->recording_elements, count);
-  g_free (data->recording_elements);
+  if (G_VALUE_HOLDS_STRING (value))
+    str = g_value_dup_string (value);
+  else
+    str = gst_value_serialize (value);
 
-  if (data->recording_dir) {
-    g_free (data->recording_dir);
-    data->recording_dir = NULL;
-  }
+  gst_util_set_object_arg (sink, field, str);
+  g_free (str);
 
-  data->filesink_sinkpad = NULL;
-  data->recording_queue_sinkpad = NULL;
-  data->recording_elements = NULL;
-  data->recording_enabled = FALSE;
+  return TRUE;
 }
 
-static gboolean setup_recording_elements (CustomData *data) {
-  GstElement **elements;
-  GstPad *recording_queue_sinkpad;
-  GstPad *filesink_sinkpad;
-  int count;
-
-  if (!data || !data->pipeline) {
-    aloge ("setup_recording_elements: Parameter error!");
-    return FALSE;
+/* Commands of a stream run in order, on whichever engine worker picks the stream up */
+static void worker_schedule (CustomData *data) {
+  g_mutex_lock (&data->worker_lock);
+  if (!data->worker_scheduled) {
+    data->worker_scheduled = TRUE;
+    g_thread_pool_push (shared_engine.workers, data, NULL);
   }
+  g_mutex_unlock (&data->worker_lock);
+}
 
-  count = sizeof (recording_vector) / sizeof (element_node);
-  elements = (GstElement **)g_malloc0 (sizeof(GstElement*) * count);
-  if (!elements) {
-    aloge ("setup_recording_elements: alloc elements failed!");
-    return FALSE;
-  }
+static void notify_worker_update_pipeline (CustomData *data, guint cmd) {
+  worker_msg *msg = g_new0 (worker_msg, 1);
 
-  if (!setup_elements (data->pipeline, elements, recording_vector)) {
-    aloge ("setup_recording_elements: setup elements failed!");
-    g_free (elements);
-    return FALSE;
-  }
-  data->recording_elements = elements;
+  msg->cmd = &worke_cmd[cmd];
+  msg->queued = g_get_monotonic_time ();
+  g_async_queue_push (data->worker_cmd_queue, msg);
+  worker_schedule (data);
+}
 
-  recording_queue_sinkpad = gst_element_get_static_pad(elements[RC_QUEUE], "sink");
-  if (!recording_queue_sinkpad) {
-    aloge ("setup_recording_elements: get recording queue sink pad failed !");
-    cleanup_elements (data->pipeline, elements, count - 1);
-    g_free (elements);
-  }
+/* Takes the spec */
+static void notify_worker_branch (CustomData *data, guint cmd, const gchar *id, GstStructure *spec) {
+  worker_msg *msg = g_new0 (worker_msg, 1);
 
-  filesink_sinkpad = gst_element_get_static_pad(elements[RC_FILESINK], "sink");
-  if (!filesink_sinkpad) {
-    aloge ("setup_recording_elements: get recording file sink pad failed !");
-    cleanup_elements (data->pipeline, elements, count - 1);
-    g_free (elements);
-  }
+  msg->cmd = &worke_cmd[cmd];
+  msg->queued = g_get_monotonic_time ();
+  msg->id = g_strdup (id);
+  msg->spec = spec;
+  g_async_queue_push (data->worker_cmd_queue, msg);
+  worker_schedule (data);
+}
 
-  data->filesink_sinkpad = filesink_sinkpad;
-  data->recording_queue_sinkpad = recording_queue_sinkpad;
-  data->recording_enabled = FALSE;
-  data->recording_dir = NULL;
+static void worker_msg_free (worker_msg *msg) {
+  if (msg->spec)
+    gst_structure_free (msg->spec);
+  g_free (msg->id);
+  g_free (msg);
+}
 
-  return TRUE;
+#define SOURCE_PREROLL_MS 15000    /* a preroll nothing started a branch on */
+
+static gboolean source_linger_timeout_cb (gpointer user_data) {
+  CustomData *data = (CustomData *)user_data;
+
+  alogi ("source linger expired");
+  notify_worker_update_pipeline (data, WORKER_CMD_STOP_SOURCE);
+  return G_SOURCE_REMOVE;
 }
 
-static gchar *make_filesink_dir(gchar *dir) {
-  GDateTime *date;
-  gchar *date_str;
-  gchar *filesink_dir;
+static void source_linger_cancel (CustomData *data) {
+  if (!data->source_linger_timer)
+    return;
 
-  date = g_date_time_new_now_utc ();
-  date_str = g_date_time_format (date, "%Y-%m-%d-%H-%M-%S-utc");
-  g_date_time_unref (date);
+  g_source_destroy (data->source_linger_timer);
+  g_source_unref (data->source_linger_timer);
+  data->source_linger_timer = NULL;
+}
 
-  filesink_dir = g_strdup_printf ("%s/VideoRecording-%s.flv", dir, date_str);
-  g_free(date_str);
+/* The source chain is kept connected with no branch on it for linger_ms */
+static void source_linger_start (CustomData *data, guint linger_ms) {
+  source_linger_cancel (data);
 
-  return filesink_dir;
+  alogi ("source lingering for %ums", linger_ms);
+  data->source_linger_timer = g_timeout_source_new (linger_ms);
+  g_source_set_callback (data->source_linger_timer, source_linger_timeout_cb, data, NULL);
+  g_source_attach (data->source_linger_timer, data->context);
 }
 
-static void notify_worker_update_pipeline (CustomData *data, guint cmd) {
-  g_async_queue_push (data->worker_cmd_queue, (gpointer)&worke_cmd[cmd]);
+/* Called with mutex_branch held: the source chain of a new RTSP session, not playing yet */
+static gboolean source_session_begin (CustomData *data, const gchar *location, gboolean display) {
+  gboolean seeded;
+
+  g_mutex_lock (&data->media.lock);
+  data->media.known = FALSE;
+  data->media.reported_width = data->media.reported_height = 0;
+  g_mutex_unlock (&data->media.lock);
+  data->session = session_cache_get (location);
+  seeded = session_cache_seed (data);
+  if (!setup_rtspsrc_elements (data))
+    return FALSE;
+
+  g_object_set (G_OBJECT(data->rtspsrc), "location", location, NULL);
+  ttff_trace_begin (&data->ttff, display);
+  g_mutex_lock (&data->ttff.lock);
+  data->ttff.cache_on = data->session_cache_enabled;
+  data->ttff.seeded = seeded;
+  g_mutex_unlock (&data->ttff.lock);
+  return TRUE;
 }
 
-static gboolean display_start (CustomData *data) {
-  GstElement *overlay_sink;
-  gboolean ret = FALSE;
+/*
+ * State changes that may block (a branch going down, rtspsrc sending TEARDOWN) run on a
+ * GstElement async thread. Completion is reported on the bus as a BRANCH_JOB_DONE
+ * application message, so the worker never waits for one branch while others pend.
+ */
+static branch_job *branch_job_new (CustomData *data, branch *br, gint64 begin) {
+  branch_job *job = g_new0 (branch_job, 1);
+
+  job->data = data;
+  job->br = br;
+  job->name = br ? g_strdup_printf ("%s stop", br->id) : g_strdup ("source stop");
+  job->begin = begin;
+  return job;
+}
 
-  alogi ("display start (ref:%d)!", data->pipeline_ref);
-  do {
-    g_mutex_lock (&data->mutex_branch);
+static void branch_job_free (branch_job *job) {
+  g_free (job->name);
+  g_free (job);
+}
 
-    if (!data->native_window)
-      break;
+static void branch_job_run (GstElement *pipeline, gpointer user_data) {
+  branch_job *job = (branch_job *)user_data;
+  CustomData *data = job->data;
 
-    if (data->display_enabled != BRANCH_DISABLE)
-      break;
+  if (job->stop_source)
+    gst_element_set_state (pipeline, GST_STATE_NULL);
 
-    if (data->pipeline_restarting)
-      break;
+  if (job->br && job->br->elements)
+    gst_elements_park_v (job->br->elements, job->br->desc->park_state);
 
-    if (data->pipeline_ref == 0) {
-      if (!setup_rtspsrc_elements (data))
-        break;
-      g_object_set (G_OBJECT(data->rtspsrc), "location", data->rtspsrc_url, NULL);
-    }
+  if (job->park_flv_core) {
+    gst_elements_park_v (data->flv.elements, FC_PARK_STATE);
+    gop_cache_flush (&data->flv.cache);
+  }
 
-    if (!setup_display_elements (data)) {
-      cleanup_rtspsrc_elements (data);
-      break;
-    }
+  g_mutex_lock (&data->mutex_branch);
+  data->async_jobs--;
+  g_cond_broadcast (&data->branch_cond);
+  g_mutex_unlock (&data->mutex_branch);
 
-    gst_pad_link (data->tee_srcpad_display, data->display_queue_sinkpad);
-    gst_elements_set_locked_state_v (data->display_elements, FALSE);
+  gst_element_post_message (pipeline, gst_message_new_application (GST_OBJECT (pipeline),
+          gst_structure_new (BRANCH_JOB_DONE, "job", G_TYPE_POINTER, job, NULL)));
+}
 
-    if (data->pipeline_ref == 0) {
-      gst_element_set_state (data->pipeline, GST_STATE_READY);
-      gst_element_get_state (data->pipeline, NULL, NULL, GST_CLOCK_TIME_NONE);
+/* Called with mutex_branch held, once the branch is unlinked from the tee */
+static void branch_job_launch (CustomData *data, branch_job *job) {
+  if (!data->pipeline_ref && data->rtspsrc && !data->source_stopping) {
+    if (data->source_linger_ms) {
+      source_linger_start (data, data->source_linger_ms);
     } else {
-      gst_elements_set_state_v (data->display_elements, GST_STATE_READY);
-      gst_element_get_state (data->display_elements[DP_VIDEOSINK], NULL, NULL, GST_CLOCK_TIME_NONE);
+      source_linger_cancel (data);
+      job->stop_source = TRUE;
+      data->source_stopping = TRUE;
     }
+  }
 
-    gst_element_get_state (data->pipeline, NULL, NULL, GST_CLOCK_TIME_NONE);
-    overlay_sink = gst_bin_get_by_interface (GST_BIN(data->pipeline),
-            GST_TYPE_VIDEO_OVERLAY);
-    gst_video_overlay_set_window_handle (GST_VIDEO_OVERLAY (overlay_sink),
-            (guintptr) data->native_window);
-    gst_object_unref (overlay_sink);
+  alogi ("%s: async (stop source:%d)", job->name, job->stop_source);
+  data->async_jobs++;
+  gst_element_call_async (data->pipeline, branch_job_run, job, NULL);
+}
 
-    if (data->pipeline_ref == 0)
-      gst_element_set_state (data->pipeline, GST_STATE_PLAYING);
-    else
-      gst_element_sync_state_with_parent_v (data->display_elements);
+static void source_stop (CustomData *data) {
+  branch_job *job;
 
-    data->display_enabled = BRANCH_ENABLE;
-    data->pipeline_ref++;
-    ret = TRUE;
-  } while(0);
+  g_mutex_lock (&data->mutex_branch);
+  source_linger_cancel (data);
+
+  if (!data->pipeline_ref && data->rtspsrc && !data->source_stopping) {
+    job = branch_job_new (data, NULL, 0);
+    branch_job_launch (data, job);
+  }
 
-  alogi ("display start (ref:%d)! end", data->pipeline_ref);
   g_mutex_unlock (&data->mutex_branch);
-  return ret;
 }
 
-static gboolean display_stop (CustomData *data) {
-  gboolean ret = FALSE;
-  alogi ("display stop (ref:%d)!", data->pipeline_ref);
-
-  do {
-    g_mutex_lock (&data->mutex_branch);
+static void branch_job_done (CustomData *data, branch_job *job) {
+  branch *br = job->br;
 
-    if (data->display_enabled != BRANCH_ENABLE)
-      break;
+  g_mutex_lock (&data->mutex_branch);
 
-    data->display_enabled = BRANCH_DISABLE_ING;
-    if (data->pipeline_ref == 1) {
-      gst_element_set_state (data->pipeline, GST_STATE_NULL);
-      gst_element_get_state (data->pipeline, NULL, NULL, GST_CLOCK_TIME_NONE);
-    } else {
-      gst_elements_set_locked_state_v (data->display_elements, TRUE);
-      gst_elements_set_state_v (data->display_elements, GST_STATE_NULL);
-      gst_element_get_state (data->display_elements[DP_VIDEOSINK], NULL, NULL, GST_CLOCK_TIME_NONE);
-    }
+  if (job->stop_source) {
+    cleanup_rtspsrc_elements (data);
+    data->source_stopping = FALSE;
+  }
 
-    gst_pad_unlink (data->tee_srcpad_display, data->display_queue_sinkpad);
-    cleanup_display_elements (data);
+  if (job->park_flv_core) {
+    data->flv.parking = FALSE;
+    if (data->flv.pool_flush)
+      cleanup_flv_core (data);
+  }
 
-    if (data->pipeline_ref == 1)
-      cleanup_rtspsrc_elements (data);
+  if (br) {
+    if (job->discard || br->pool_flush) {
+      br->pool_flush = FALSE;
+      cleanup_branch_elements (data, br);
+    }
 
-    data->display_enabled = BRANCH_DISABLE;
-    data->pipeline_ref--;
-    ret = TRUE;
-  } while(0);
+    br->enabled = BRANCH_DISABLE;
+    latency_stat_update (&br->bench.stop, job->begin, job->name);
+  }
 
+  g_cond_broadcast (&data->branch_cond);
   g_mutex_unlock (&data->mutex_branch);
-  return ret;
+
+  branch_job_free (job);
+  notify_worker_update_pipeline (data, WORKER_CMD_RECONCILE);
 }
 
-static gboolean push_rtmp_start (CustomData *data) {
-  gboolean ret = FALSE;
-  alogi ("push rtmp start (ref:%d)!", data->pipeline_ref);
+/* A started branch counts as up once its sink reaches PLAYING */
+static gboolean branch_confirm_started (branch *br, GstObject *src) {
+  gchar *what;
 
-  do {
-    g_mutex_lock (&data->mutex_branch);
+  if (br->enabled != BRANCH_ENABLE_ING || !br->elements ||
+      src != GST_OBJECT (br->elements[br->desc->sink]))
+    return FALSE;
 
-    if (data->push_rtmp_enabled != BRANCH_DISABLE)
-      break;
+  br->enabled = BRANCH_ENABLE;
+  what = g_strdup_printf ("%s start (%s)", br->id, br->bench.pending_pooled ? "pooled" : "cold");
+  latency_stat_update (br->bench.pending_pooled ? &br->bench.start_pooled : &br->bench.start_cold,
+          br->bench.pending_begin, what);
+  g_free (what);
 
-    if (data->pipeline_restarting)
-      break;
+  return TRUE;
+}
 
-    if (data->pipeline_ref == 0) {
-      if (!setup_rtspsrc_elements (data))
-        break;
-      g_object_set (G_OBJECT(data->rtspsrc), "location", data->rtspsrc_url, NULL);
-    }
+static GstPadProbeReturn probe_branch_first_frame_cb (GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+  branch *br = (branch *)user_data;
+  gchar *what;
 
-    if (!setup_push_rtmp_elements (data)) {
-      cleanup_rtspsrc_elements (data);
-      break;
-    }
+  what = g_strdup_printf ("%s first frame (%s)", br->id,
+          br->ttff_lingering ? "lingering source" : "new session");
+  latency_stat_update (br->ttff_lingering ? &br->ttff_warm : &br->ttff_cold, br->ttff_begin, what);
+  g_free (what);
 
-    aloge ("%s", data->push_rtmp_url);
-    g_object_set (G_OBJECT(data->push_rtmp_elements[PU_RTMPSINK]),
-                "location", data->push_rtmp_url, NULL);
-    gst_pad_link (data->tee_srcpad_push_rtmp, data->push_rtmp_queue_sinkpad);
-    gst_elements_set_locked_state_v (data->push_rtmp_elements, FALSE);
+  br->ttff_probe = 0;
+  return GST_PAD_PROBE_REMOVE;
+}
 
-    if (data->pipeline_ref == 0)
-      gst_element_set_state (data->pipeline, GST_STATE_PLAYING);
-    else
-      gst_element_sync_state_with_parent_v (data->push_rtmp_elements);
+static void branch_ttff_cancel (branch *br) {
+  GstPad *pad;
 
-    data->push_rtmp_enabled = BRANCH_ENABLE;
-    data->pipeline_ref++;
-    ret = TRUE;
-  } while (0);
+  if (!br->ttff_probe)
+    return;
 
-  g_mutex_unlock (&data->mutex_branch);
-  return ret;
+  pad = gst_element_get_static_pad (br->elements[br->desc->ttff_element], br->desc->ttff_pad);
+  gst_pad_remove_probe (pad, br->ttff_probe);
+  gst_object_unref (pad);
+  br->ttff_probe = 0;
 }
 
-static gboolean push_rtmp_stop (CustomData *data) {
-  gboolean ret = FALSE;
+static GstPadProbeReturn probe_block_cb (GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+  return GST_PAD_PROBE_OK;
+}
 
-  alogi ("push rtmp stop (ref:%d)!", data->pipeline_ref);
-  do {
-    g_mutex_lock (&data->mutex_branch);
+/* Called with mutex_branch held. The first FLV consumer links the muxer to the source tee */
+static gboolean flv_core_use (CustomData *data, gboolean new_session) {
+  flv_core *core = &data->flv;
+  gulong block;
 
-    if (data->push_rtmp_enabled != BRANCH_ENABLE)
-      break;
+  if (core->users > 0) {
+    core->users++;
+    return TRUE;
+  }
 
-    data->push_rtmp_enabled = BRANCH_DISABLE_ING;
-    if (data->pipeline_ref == 1) {
-      gst_element_set_state (data->pipeline, GST_STATE_NULL);
-      gst_element_get_state (data->pipeline, NULL, NULL, GST_CLOCK_TIME_NONE);
-    } else {
-      gst_elements_set_locked_state_v (data->push_rtmp_elements, TRUE);
-      gst_elements_set_state_v (data->push_rtmp_elements, GST_STATE_NULL);
-    }
+  if (!core->tee_srcpad)
+    core->tee_srcpad = gst_element_get_request_pad (data->rtspsrc_elements[SC_TEE], "src_%u");
+  if (!core->tee_srcpad) {
+    aloge ("flv core: get tee_srcpad failed!");
+    return FALSE;
+  }
 
-    gst_pad_unlink (data->tee_srcpad_push_rtmp, data->push_rtmp_queue_sinkpad);
-    cleanup_push_rtmp_elements (data);
+  block = gst_pad_add_probe (core->tee_srcpad, GST_PAD_PROBE_TYPE_BLOCK_DOWNSTREAM,
+          probe_block_cb, NULL, NULL);
+  gop_cache_attach (&data->tee_gop_cache, core->tee_srcpad);
+  gst_pad_link (core->tee_srcpad, core->queue_sinkpad);
+  gst_elements_set_locked_state_v (core->elements, FALSE);
+  if (!new_session)
+    gst_element_sync_state_with_parent_v (core->elements);
+  gst_pad_remove_probe (core->tee_srcpad, block);
+
+  core->users = 1;
+  alogi ("flv core: muxing");
+  return TRUE;
+}
 
-    if (data->pipeline_ref == 1)
-      cleanup_rtspsrc_elements (data);
+/* Called with mutex_branch held, once the consumer is off the flv tee. The last one parks the muxer */
+static void flv_core_unuse (CustomData *data, branch_job *job) {
+  flv_core *core = &data->flv;
 
-    data->push_rtmp_enabled = BRANCH_DISABLE;
-    data->pipeline_ref--;
-    ret = TRUE;
-  } while (0);
+  if (--core->users > 0) {
+    alogi ("flv core: %d consumers left", core->users);
+    return;
+  }
 
-  g_mutex_unlock (&data->mutex_branch);
-  return ret;
+  gst_pad_unlink (core->tee_srcpad, core->queue_sinkpad);
+  core->parking = TRUE;
+  job->park_flv_core = TRUE;
 }
 
-static gboolean push_rtsp_start (CustomData *data) {
+static gboolean branch_start (CustomData *data, branch *br) {
+  GstElement *tee;
+  gop_cache *cache;
+  GstPad *pad;
+  gulong block;
   gboolean ret = FALSE;
+  gboolean pooled;
+  gboolean new_session;
+  gint64 begin;
 
-  alogi ("push rtsp start (ref:%d)!", data->pipeline_ref);
+  alogi ("%s start (ref:%d)!", br->id, data->pipeline_ref);
+  begin = g_get_monotonic_time ();
   do {
     g_mutex_lock (&data->mutex_branch);
 
-    if (data->push_rtsp_enabled != BRANCH_DISABLE)
+    if (br->enabled != BRANCH_DISABLE)
+      break;
+
+    if (data->pipeline_restarting || data->source_stopping)
+      break;
+
+    if (br->desc->ready && !br->desc->ready (data, br))
+      break;
+
+    /* back once the muxer is parked, through WORKER_CMD_RECONCILE */
+    if (br->desc->upstream == BRANCH_UPSTREAM_FLV && data->flv.parking)
+      break;
+
+    new_session = data->rtspsrc == NULL;
+    source_linger_cancel (data);
+    if (new_session && !source_session_begin (data, data->rtspsrc_url, br == data->display))
       break;
 
-    if (data->pipeline_restarting)
+    pooled = br->elements != NULL;
+    if (!pooled && !setup_branch_elements (data, br)) {
+      if (new_session)
+        cleanup_rtspsrc_elements (data);
       break;
+    }
 
-    if (data->pipeline_ref == 0) {
-      if(!setup_rtspsrc_elements (data))
+    if (br->desc->upstream == BRANCH_UPSTREAM_FLV) {
+      if (!data->flv.elements && !setup_flv_core (data)) {
+        if (new_session)
+          cleanup_rtspsrc_elements (data);
         break;
-      g_object_set (G_OBJECT(data->rtspsrc), "location", data->rtspsrc_url, NULL);
+      }
+      tee = data->flv.elements[FC_TEE];
+      cache = &data->flv.cache;
+    } else {
+      tee = data->rtspsrc_elements[SC_TEE];
+      cache = &data->tee_gop_cache;
     }
 
-    if (!setup_push_rtsp_elements (data)) {
-      cleanup_rtspsrc_elements (data);
+    if (!br->tee_srcpad)
+      br->tee_srcpad = gst_element_get_request_pad (tee, "src_%u");
+    if (!br->tee_srcpad || (br->desc->upstream == BRANCH_UPSTREAM_FLV &&
+            !flv_core_use (data, new_session))) {
+      aloge ("%s start: get tee_srcpad failed!", br->id);
+      if (new_session)
+        cleanup_rtspsrc_elements (data);
       break;
     }
 
-    g_object_set (G_OBJECT(data->push_rtsp_elements[PU_RTSPSINK]),
-            "location", data->push_rtsp_url, NULL);
-    gst_pad_link (data->tee_srcpad_push_rtsp, data->push_rtsp_queue_sinkpad);
-    gst_elements_set_locked_state_v (data->push_rtsp_elements, FALSE);
-
-    if (data->pipeline_ref == 0)
+    gst_structure_foreach (br->spec, branch_apply_spec_field, br->elements[br->desc->sink]);
+    if (br->desc->prepare)
+      br->desc->prepare (data, br);
+
+    /* the tee waits on this pad until the branch left the locked state, never pushing into a flushing queue */
+    block = gst_pad_add_probe (br->tee_srcpad, GST_PAD_PROBE_TYPE_BLOCK_DOWNSTREAM,
+            probe_block_cb, NULL, NULL);
+    gop_cache_attach (cache, br->tee_srcpad);
+    gst_pad_link (br->tee_srcpad, br->queue_sinkpad);
+    gst_elements_set_locked_state_v (br->elements, FALSE);
+
+    pad = gst_element_get_static_pad (br->elements[br->desc->ttff_element], br->desc->ttff_pad);
+    br->ttff_begin = begin;
+    br->ttff_lingering = !new_session;
+    br->ttff_probe = gst_pad_add_probe (pad, GST_PAD_PROBE_TYPE_BUFFER,
+            probe_branch_first_frame_cb, br, NULL);
+    gst_object_unref (pad);
+
+    if (new_session)
       gst_element_set_state (data->pipeline, GST_STATE_PLAYING);
     else
-      gst_element_sync_state_with_parent_v (data->push_rtsp_elements);
+      gst_element_sync_state_with_parent_v (br->elements);
+    gst_pad_remove_probe (br->tee_srcpad, block);
 
-    data->push_rtsp_enabled = BRANCH_ENABLE;
+    br->enabled = BRANCH_ENABLE_ING;
+    br->bench.pending_begin = begin;
+    br->bench.pending_pooled = pooled;
     data->pipeline_ref++;
     ret = TRUE;
-  } while (0);
+  } while(0);
 
+  alogi ("%s start (ref:%d)! end", br->id, data->pipeline_ref);
   g_mutex_unlock (&data->mutex_branch);
   return ret;
 }
 
-static GstPadProbeReturn probe_push_rtsp_stop (GstPad *pad, GstPadProbeInfo *info, gpointer _data) {
-  CustomData *data = (CustomData *)_data;
+static GstPadProbeReturn probe_branch_drain_cb (GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+  branch *br = (branch *)user_data;
 
-  alogi ("probe_push_rtsp_stop");
-  gst_pad_unlink (data->tee_srcpad_push_rtsp, data->push_rtsp_queue_sinkpad);
-  gst_elements_set_locked_state_v (data->push_rtsp_elements, TRUE);
-  gst_pad_send_event(data->push_rtsp_queue_sinkpad, gst_event_new_eos());
+  alogi ("probe_branch_drain_cb: %s", br->id);
+  gst_pad_unlink (br->tee_srcpad, br->queue_sinkpad);
+  gst_elements_set_locked_state_v (br->elements, TRUE);
+  gst_pad_send_event (br->queue_sinkpad, gst_event_new_eos ());
+  br->drain_probe = 0;
 
   return GST_PAD_PROBE_REMOVE;
 }
 
-static gboolean push_rtsp_stop (CustomData *data) {
-  gboolean ret = FALSE;
-  gboolean signal;
-  gint64 end_time;
+/*
+ * Second half of a draining stop, once the sink forwarded the EOS (drained) or the
+ * drain timer gave up on it. A sink that never drained is not put back in the pool.
+ */
+static void branch_stop_drained (CustomData *data, branch *br, gboolean drained) {
+  branch_job *job;
 
-  alogi ("push_rtsp_stop (ref:%d)!", data->pipeline_ref);
-  do {
-    g_mutex_lock (&data->mutex_branch);
+  g_mutex_lock (&data->mutex_branch);
+  if (!br->drain_timer) {
+    g_mutex_unlock (&data->mutex_branch);
+    return;
+  }
 
-    if (data->push_rtsp_enabled != BRANCH_ENABLE)
-      break;
+  g_source_destroy (br->drain_timer);
+  g_source_unref (br->drain_timer);
+  br->drain_timer = NULL;
 
-    data->push_rtsp_enabled = BRANCH_DISABLE_ING;
-    gst_pad_add_probe (data->tee_srcpad_push_rtsp, GST_PAD_PROBE_TYPE_IDLE,
-            probe_push_rtsp_stop, data, NULL);
-
-    end_time = g_get_monotonic_time () + 900 * G_TIME_SPAN_MILLISECOND;
-    signal = g_cond_wait_until (&data->push_rtsp_cond_eos, &data->mutex_branch, end_time);
-    if(!signal)
-      gst_pad_unlink (data->tee_srcpad_push_rtsp, data->push_rtsp_queue_sinkpad);
-
-    if (data->pipeline_ref == 1) {
-      if (signal)
-        gst_elements_set_locked_state_v (data->push_rtsp_elements, TRUE);
-      gst_element_set_state (data->pipeline, GST_STATE_NULL);
-      gst_element_get_state (data->pipeline, NULL, NULL, GST_CLOCK_TIME_NONE);
-      cleanup_push_rtsp_elements (data);
-      cleanup_rtspsrc_elements (data);
-    } else {
-      gst_elements_set_locked_state_v (data->push_rtsp_elements, TRUE);
-      if (signal) {
-        gst_elements_set_state_v (data->push_rtsp_elements, GST_STATE_NULL);
-        gst_element_get_state (data->push_rtsp_elements[PU_RTSPSINK], NULL, NULL, GST_CLOCK_TIME_NONE);
-      }
-      cleanup_push_rtsp_elements (data);
+  if (!drained) {
+    if (br->drain_probe) {
+      gst_pad_remove_probe (br->tee_srcpad, br->drain_probe);
+      br->drain_probe = 0;
     }
+    gst_pad_unlink (br->tee_srcpad, br->queue_sinkpad);
+  }
 
-    data->push_rtsp_enabled = BRANCH_DISABLE;
-    data->pipeline_ref--;
-    ret = TRUE;
-  } while(0);
+  job = branch_job_new (data, br, br->bench.pending_begin);
+  job->discard = !drained;
+  if (br->desc->upstream == BRANCH_UPSTREAM_FLV)
+    flv_core_unuse (data, job);
+  branch_job_launch (data, job);
 
-  alogi ("push_rtsp_stop (ref:%d)! end", data->pipeline_ref);
   g_mutex_unlock (&data->mutex_branch);
-  return ret;
 }
 
-static gboolean recording_start (CustomData *data, const gchar *recording_dir) {
-  gboolean str_equ;
-  gchar *filesink_dir;
-
-  alogi ("recording start (ref:%d)!", data->pipeline_ref);
-  if (!recording_dir)
-    return FALSE;
+static gboolean branch_drain_timeout_cb (gpointer user_data) {
+  branch *br = (branch *)user_data;
 
-  str_equ = g_strcmp0 (data->recording_dir, recording_dir) == 0;
-  if (str_equ && data->recording_enabled) {
-    return FALSE;
-  }
+  alogw ("%s stop: sink did not drain", br->id);
+  branch_stop_drained (br->data, br, FALSE);
+  return G_SOURCE_REMOVE;
+}
 
-  alogi ("recording start!!");
-  if (data->recording_dir) {
-    g_free (data->recording_dir);
-    data->recording_dir = NULL;
-  }
-  data->recording_dir = g_strdup (recording_dir);
+static gboolean branch_stop (CustomData *data, branch *br) {
+  branch_job *job;
+  gboolean ret = FALSE;
 
-  if (data->recording_enabled) {
-    gst_elements_set_locked_state_v (data->recording_elements, TRUE);
-    gst_elements_set_state_v (data->recording_elements, GST_STATE_NULL);
-  } else {
-    data->pipeline_ref++;
-    data->recording_enabled = TRUE;
-    gst_pad_link (data->tee_srcpad_recording, data->recording_queue_sinkpad);
-  }
+  alogi ("%s stop (ref:%d)!", br->id, data->pipeline_ref);
+  do {
+    g_mutex_lock (&data->mutex_branch);
 
-  filesink_dir = make_filesink_dir (data->recording_dir);
-  g_object_set (G_OBJECT(data->recording_elements[RC_FILESINK]),
-      "location", filesink_dir, NULL);
-  g_free (filesink_dir);
-  gst_elements_set_locked_state_v (data->recording_elements, FALSE);
+    if (br->enabled != BRANCH_ENABLE && br->enabled != BRANCH_ENABLE_ING)
+      break;
 
-  if (data->pipeline_ref == 1)
-    ;//pipeline_enable (data, TRUE);
-  else
-    gst_element_sync_state_with_parent_v (data->recording_elements);
+    br->enabled = BRANCH_DISABLE_ING;
+    data->pipeline_ref--;
+    branch_ttff_cancel (br);
 
-  return TRUE;
-}
+    if (br->desc->teardown == BRANCH_TEARDOWN_DRAIN) {
+      br->bench.pending_begin = g_get_monotonic_time ();
+      br->drain_probe = gst_pad_add_probe (br->tee_srcpad, GST_PAD_PROBE_TYPE_IDLE,
+              probe_branch_drain_cb, br, NULL);
 
-static void recording_stop (CustomData *data) {
-  alogi ("recording stop (ref:%d)!", data->pipeline_ref);
+      br->drain_timer = g_timeout_source_new (BRANCH_DRAIN_TIMEOUT_MS);
+      g_source_set_callback (br->drain_timer, branch_drain_timeout_cb, br, NULL);
+      g_source_attach (br->drain_timer, data->context);
+    } else {
+      gst_pad_unlink (br->tee_srcpad, br->queue_sinkpad);
+      job = branch_job_new (data, br, g_get_monotonic_time ());
+      if (br->desc->upstream == BRANCH_UPSTREAM_FLV)
+        flv_core_unuse (data, job);
+      branch_job_launch (data, job);
+    }
+    ret = TRUE;
+  } while(0);
 
-  if (data->recording_enabled) {
-    data->recording_enabled = FALSE;
-    data->pipeline_ref--;
-    gst_elements_set_locked_state_v (data->recording_elements, TRUE);
+  g_mutex_unlock (&data->mutex_branch);
+  return ret;
+}
 
-    if (data->pipeline_ref < 1)
-      ;//pipeline_enable (data, FALSE);
-    else
-      gst_elements_set_state_v (data->recording_elements, GST_STATE_NULL);
+/* Surface callbacks must not return while the sink may still render to the old window */
+static void display_wait_parked (CustomData *data) {
+  branch *br = data->display;
+  gint64 end_time = g_get_monotonic_time () + 2 * G_TIME_SPAN_SECOND;
 
-    gst_pad_unlink (data->tee_srcpad_recording, data->recording_queue_sinkpad);
+  g_mutex_lock (&data->mutex_branch);
+  while (br->enabled == BRANCH_DISABLE_ING) {
+    if (!g_cond_wait_until (&data->branch_cond, &data->mutex_branch, end_time)) {
+      aloge ("display wait parked: timeout");
+      break;
+    }
   }
+
+  /* the pooled video sink lets go of the window in NULL only */
+  if (br->enabled == BRANCH_DISABLE && br->elements)
+    gst_elements_set_state_v (br->elements, GST_STATE_NULL);
+  g_mutex_unlock (&data->mutex_branch);
 }
 
 static void display_update_native_surface (CustomData *data, ANativeWindow *native_window) {
-  if (!data->display_requst) {
+  branch *br = data->display;
+
+  if (!br->request) {
     if (data->native_window)
       ANativeWindow_release (data->native_window);
     data->native_window = native_window;
@@ -1131,15 +4184,16 @@ static void display_update_native_surface (CustomData *data, ANativeWindow *nati
   }
 
   if (!native_window) {
+    branch_stop (data, br);
+    display_wait_parked (data);
     if (data->native_window)
       ANativeWindow_release (data->native_window);
-    display_stop (data);
     data->native_window = native_window;
     return;
   }
 
   g_mutex_lock (&data->mutex_branch);
-  if (data->display_enabled == BRANCH_ENABLE) {
+  if (br->enabled == BRANCH_ENABLE || br->enabled == BRANCH_ENABLE_ING) {
     if (data->native_window == native_window) {
       ANativeWindow_release (data->native_window);
       gst_video_overlay_expose (GST_VIDEO_OVERLAY (data->pipeline));
@@ -1149,7 +4203,8 @@ static void display_update_native_surface (CustomData *data, ANativeWindow *nati
     }
 
     g_mutex_unlock (&data->mutex_branch);
-    display_stop (data);
+    branch_stop (data, br);
+    display_wait_parked (data);
 
     g_mutex_lock (&data->mutex_branch);
     ANativeWindow_release (data->native_window);
@@ -1159,20 +4214,35 @@ static void display_update_native_surface (CustomData *data, ANativeWindow *nati
   g_mutex_unlock (&data->mutex_branch);
 
   if (data->native_window)
-    display_start (data);
+    branch_start (data, br);
 }
 
-static gboolean launch_restart_process (CustomData *data, guchar reset_request) {
+/* Streaming, loop and worker threads: only the one that sets the request launches the reset */
+static gboolean launch_restart_process (CustomData *data, gint reset_request) {
+  gint old;
 
-  if ((data->reset_request & reset_request) == reset_request)
-    return FALSE;
+  /* a pipeline reset takes the source along */
+  do {
+    old = g_atomic_int_get (&data->reset_request);
+    if ((old & reset_request) == reset_request || (old & RESET_REQUEST_PIPELINE))
+      return FALSE;
+  } while (!g_atomic_int_compare_and_exchange (&data->reset_request, old, old | reset_request));
 
-  data->reset_request |= reset_request;
+  reconnect_failed (&data->reconnect);
   notify_worker_update_pipeline (data, WORKER_CMD_RESET_PIPELINE);
 
   return TRUE;
 }
 
+/* A request that came in while the reset ran stays, its command is still queued */
+static void reset_request_clear (CustomData *data, gint handled) {
+  gint old;
+
+  do {
+    old = g_atomic_int_get (&data->reset_request);
+  } while (!g_atomic_int_compare_and_exchange (&data->reset_request, old, old & ~handled));
+}
+
 static void check_media_size (CustomData *data);
 static void message_state_changed_cb (GstBus *bus, GstMessage *msg, CustomData *data) {
   GstState old_state, new_state, pending_state;
@@ -1187,6 +4257,49 @@ static void message_state_changed_cb (GstBus *bus, GstMessage *msg, CustomData *
     if (old_state == GST_STATE_PAUSED && new_state == GST_STATE_PLAYING)
       check_media_size (data);
   }
+
+  if (new_state == GST_STATE_PLAYING) {
+    GHashTableIter iter;
+    gboolean started = FALSE;
+    branch *br;
+
+    g_mutex_lock (&data->mutex_branch);
+    g_hash_table_iter_init (&iter, data->branches);
+    while (!started && g_hash_table_iter_next (&iter, NULL, (gpointer *)&br))
+      started = branch_confirm_started (br, GST_MESSAGE_SRC (msg));
+    g_mutex_unlock (&data->mutex_branch);
+
+    if (started)
+      notify_worker_update_pipeline (data, WORKER_CMD_RECONCILE);
+  }
+}
+
+static void message_application_cb (GstBus *bus, GstMessage *msg, CustomData *data) {
+  const GstStructure *s;
+  branch_job *job = NULL;
+
+  s = gst_message_get_structure (msg);
+  if (gst_structure_has_name (s, BRANCH_JOB_DONE)) {
+    gst_structure_get (s, "job", G_TYPE_POINTER, &job, NULL);
+    if (job)
+      branch_job_done (data, job);
+  }
+}
+
+/* The window handle for a video sink created while the branch starts */
+static GstBusSyncReply bus_sync_handler (GstBus *bus, GstMessage *msg, gpointer user_data) {
+  CustomData *data = (CustomData *)user_data;
+
+  if (!gst_is_video_overlay_prepare_window_handle_message (msg))
+    return GST_BUS_PASS;
+
+  alogi ("bus_sync_handler: window handle for %s", GST_OBJECT_NAME (GST_MESSAGE_SRC (msg)));
+  if (data->native_window)
+    gst_video_overlay_set_window_handle (GST_VIDEO_OVERLAY (GST_MESSAGE_SRC (msg)),
+            (guintptr) data->native_window);
+
+  gst_message_unref (msg);
+  return GST_BUS_DROP;
 }
 
 static void message_cb (GstBus *bus, GstMessage *msg, CustomData *data) {
@@ -1228,26 +4341,49 @@ static void message_cb (GstBus *bus, GstMessage *msg, CustomData *data) {
 static void message_error_cb (GstBus *bus, GstMessage *msg, CustomData *data) {
   GError *err;
   gchar *debug_info;
+  gchar *shutdown_id = NULL;
+  gchar *shutdown_message = NULL;
+  gchar *heal_id = NULL;
+  gboolean source_error, replaced;
+  branch *br;
 
   gst_message_parse_error (msg, &err, &debug_info);
   aloge ("message_error_cb: %s: %s %s", GST_OBJECT_NAME (msg->src), err->message, debug_info);
 
+  /* the old source can still post, unlinked, until it is out of the bin */
+  g_mutex_lock (&data->mutex_branch);
+  replaced = source_replaced_object (data, msg->src);
+  g_mutex_unlock (&data->mutex_branch);
+  if (replaced) {
+    alogi ("message_error_cb: from a replaced source, ignored");
+    g_clear_error (&err);
+    g_free (debug_info);
+    return;
+  }
+
+  g_mutex_lock (&data->mutex_branch);
+  br = branch_lookup_object (data, msg->src);
+  source_error = !br && source_lookup_object (data, msg->src);
+  if (br && br->desc->heal)
+    heal_id = g_strdup (br->id);
+  else if (br && br->desc->stop_on_error &&
+      (!br->desc->fatal_error || !g_strcmp0 (err->message, br->desc->fatal_error))) {
+    shutdown_id = g_strdup (br->id);
+    shutdown_message = g_strdup (br->shutdown_message);
+  }
+  g_mutex_unlock (&data->mutex_branch);
+
   do {
-    if (!g_strcmp0 (GST_OBJECT_NAME (msg->src), "prtmp2-rtmpsink")) {
-      if (g_strcmp0 (err->message, "Could not open resource for writing.") == 0) {
-        aloge("message_error_cb: shutdown push rtmp");
-        set_usr_message (USR_MESSAGE_PUSH_RTMP_SHUTDOWN, data);
-        notify_worker_update_pipeline (data, WORKER_CMD_STOP_PUSH_RTMP);
-        break;
-      }
-    } else if (!g_strcmp0 (GST_OBJECT_NAME (msg->src), "prtsp1-rtspclientsink")) {
-      aloge("message_error_cb: shutdown push rtsp");
-      set_usr_message (USR_MESSAGE_PUSH_RTSP_SHUTDOWN, data);
-      data->push_rtsp_request = FALSE;
-      notify_worker_update_pipeline (data, WORKER_CMD_STOP_PUSH_RTSP);
+    if (heal_id) {
+      notify_worker_branch (data, WORKER_CMD_HEAL_BRANCH, heal_id, NULL);
+      break;
+    } else if (shutdown_id) {
+      aloge("message_error_cb: shutdown %s", shutdown_id);
+      set_usr_message (shutdown_message, data);
+      notify_worker_branch (data, WORKER_CMD_STOP_BRANCH, shutdown_id, NULL);
       break;
     } else if (!g_strcmp0 (GST_OBJECT_NAME (msg->src), "rtspsrc")) {
-      if ((data->pipeline_ref == 1) && (data->display_enabled == BRANCH_DISABLE_ING)) {
+      if (data->source_stopping) {
         if (!g_strcmp0 (err->message, "Unhandled error") ||
             !g_strcmp0 (err->message, "Could not write to resource.")) {
           alogi ("message_error_cb: pipeline in stoping state, ignore this!(cause by PAUSE/TEARDOWN)");
@@ -1256,13 +4392,16 @@ static void message_error_cb (GstBus *bus, GstMessage *msg, CustomData *data) {
       }
     }
 
-    if (launch_restart_process (data, RESET_REQUEST_PIPELINE))
+    if (launch_restart_process (data, source_error ? RESET_REQUEST_SOURCE : RESET_REQUEST_PIPELINE))
       set_usr_message (USR_MESSAGE_RTSP_SRC_ERR_RESTART, data);
     else
       aloge("message_error_cb: alreadly in restart pipeline process");
   } while (0);
 
 
+  g_free (heal_id);
+  g_free (shutdown_id);
+  g_free (shutdown_message);
   g_clear_error (&err);
   g_free (debug_info);
 }
@@ -1270,34 +4409,58 @@ static void message_error_cb (GstBus *bus, GstMessage *msg, CustomData *data) {
 static void message_element_cb (GstBus *bus, GstMessage *msg, CustomData *data) {
   GstMessage *orig;
   const GstStructure *s;
-  gchar *ss;
+  branch *br;
 
   s = gst_message_get_structure (msg);
   if (gst_structure_has_name (s, "GstBinForwarded")) {
 
     gst_structure_get (s, "message", GST_TYPE_MESSAGE, &orig, NULL);
-    if (g_strcmp0 (GST_OBJECT_NAME (orig->src), push_rtsp_vector[PU_RTSPSINK].name) == 0) {
-
-      //handle RTSPSINK message
-      if (GST_MESSAGE_TYPE (orig) == GST_MESSAGE_EOS) {
-        //EOS message
-        s = gst_message_get_structure (orig);
-        ss = gst_structure_to_string (gst_message_get_structure (orig));
-        g_free (ss);
-        alogi ("message_element_cb push_rtsp_cond_eos ");
-        g_cond_signal (&data->push_rtsp_cond_eos);
-      } //end of EOS message
-    } //end of handle  RTSPSINK message
+    if (GST_MESSAGE_TYPE (orig) == GST_MESSAGE_EOS) {
+      g_mutex_lock (&data->mutex_branch);
+      br = branch_lookup_object (data, orig->src);
+      g_mutex_unlock (&data->mutex_branch);
+
+      /* a draining branch is DISABLE_ING and stays registered until the stop is done */
+      if (br && br->desc->teardown == BRANCH_TEARDOWN_DRAIN) {
+        alogi ("message_element_cb %s drained", br->id);
+        branch_stop_drained (data, br, TRUE);
+      }
+    } //end of EOS message
+    gst_message_unref (orig);
 
   } //end of GstBinForwarded
 }
 
 static void cleanup_main_loop (CustomData *data) {
   g_mutex_clear (&data->mutex_branch);
+  g_cond_clear (&data->branch_cond);
+  g_mutex_clear (&data->worker_lock);
+  g_cond_clear (&data->worker_cond);
+  gop_cache_clear (&data->tee_gop_cache);
+  gop_cache_clear (&data->flv.cache);
+  gop_cache_clear (&data->pre_event);
+  g_mutex_clear (&data->pre_event_lock);
+  jitter_source_closed (&data->jitter);
+  g_mutex_clear (&data->jitter.lock);
+  g_mutex_clear (&data->capture.lock);
+  g_mutex_clear (&data->deadline.lock);
+  g_mutex_clear (&data->reconnect.lock);
+  g_mutex_clear (&data->ttff.lock);
+  g_mutex_clear (&data->media.lock);
+  g_free (data->ttff.report);
+  data->ttff.report = NULL;
+  g_mutex_clear (&data->transport.lock);
+  g_mutex_clear (&data->watchdog.lock);
+  g_hash_table_destroy (data->trace.points);
+  g_mutex_clear (&data->trace.lock);
+  if (data->pre_event_caps) {
+    gst_caps_unref (data->pre_event_caps);
+    data->pre_event_caps = NULL;
+  }
 
-  if (data->main_loop) {
-    g_main_loop_unref (data->main_loop);
-    data->main_loop = NULL;
+  if (data->pipeline) {
+    gst_object_unref (data->pipeline);
+    data->pipeline = NULL;
   }
 }
 
@@ -1315,26 +4478,30 @@ static gboolean setup_main_loop (CustomData *data) {
   GstElement *pipeline = NULL;
   GstBus *bus = NULL;
   GSource *bus_source = NULL;
+  gchar *name;
 
   if (!data) {
     aloge ("setup_main_loop: Parameter error!");
     return FALSE;
   }
 
-  pipeline = gst_pipeline_new ("rtspclient-pipline");
+  name = g_strdup_printf ("rtspclient-pipline%u", data->id);
+  pipeline = gst_pipeline_new (name);
+  g_free (name);
   if (!pipeline) {
     aloge ("setup_main_loop: create pipeline failed!");
     return FALSE;
   }
-  g_object_set (pipeline, "message-forward", TRUE, NULL);
+  /* branch jobs report on the bus after taking the pipeline to NULL */
+  g_object_set (pipeline, "message-forward", TRUE, "auto-flush-bus", FALSE, NULL);
 
   bus = gst_element_get_bus (pipeline);
+  gst_bus_set_sync_handler (bus, bus_sync_handler, data, NULL);
   bus_source = gst_bus_create_watch (bus);
 
   //g_source_set_priority (bus_source, G_PRIORITY_HIGH);
   g_source_set_callback (bus_source, (GSourceFunc) gst_bus_async_signal_func, NULL, NULL);
   g_source_attach (bus_source, data->context);
-  g_source_unref (bus_source);
 
   //gst_bus_add_watch (G_OBJECT (bus), my_bus_callback, NULL);
 
@@ -1342,17 +4509,59 @@ static gboolean setup_main_loop (CustomData *data) {
   g_signal_connect (G_OBJECT (bus), "message::error", (GCallback)message_error_cb, data);
   g_signal_connect (G_OBJECT (bus), "message::state-changed", (GCallback)message_state_changed_cb, data);
   g_signal_connect (G_OBJECT (bus), "message::element", (GCallback)message_element_cb, data);
+  g_signal_connect (G_OBJECT (bus), "message::application", (GCallback)message_application_cb, data);
+  g_signal_connect (G_OBJECT (bus), "message::progress", (GCallback)message_progress_cb, data);
   gst_object_unref (bus);
 
   g_mutex_init (&data->mutex_branch);
-
-  data->main_loop = g_main_loop_new (data->context, FALSE);
-  if (!data->main_loop) {
-    aloge ("setup_main_loop: new a main loop failed!");
-    gst_object_unref (pipeline);
-    return FALSE;
-  }
-
+  g_cond_init (&data->branch_cond);
+  g_mutex_init (&data->worker_lock);
+  g_cond_init (&data->worker_cond);
+  gop_cache_init (&data->tee_gop_cache, GOP_CACHE_MAX_BYTES, 0, FALSE);
+  gop_cache_init (&data->flv.cache, GOP_CACHE_MAX_BYTES, 0, TRUE);
+  gop_cache_init (&data->pre_event, PRE_EVENT_MAX_BYTES, PRE_EVENT_WINDOW, FALSE);
+  g_mutex_init (&data->pre_event_lock);
+
+  g_mutex_init (&data->capture.lock);
+  capture_clock_reset (&data->capture);
+
+  g_mutex_init (&data->reconnect.lock);
+  data->session_cache_enabled = TRUE;
+  g_mutex_init (&data->ttff.lock);
+  g_mutex_init (&data->media.lock);
+
+  g_mutex_init (&data->transport.lock);
+  data->transport.policy = TRANSPORT_AUTO;
+  data->transport.probe_s = TRANSPORT_PROBE_S;
+
+  g_mutex_init (&data->watchdog.lock);
+  data->watchdog.stall_ms = WATCHDOG_STALL_MS;
+  data->watchdog.timer = g_timeout_source_new (WATCHDOG_INTERVAL_MS);
+  g_source_set_callback (data->watchdog.timer, watchdog_timeout_cb, data, NULL);
+  g_source_attach (data->watchdog.timer, data->context);
+
+  data->session_timer = g_timeout_source_new (SESSION_CACHE_FLUSH_MS);
+  g_source_set_callback (data->session_timer, session_cache_timeout_cb, data, NULL);
+  g_source_attach (data->session_timer, data->context);
+
+  g_mutex_init (&data->deadline.lock);
+  data->deadline.deadline_ms = DISPLAY_DEADLINE_MS;
+  display_deadline_reset (&data->deadline);
+
+  g_mutex_init (&data->trace.lock);
+  data->trace.rate = 0;
+  data->trace.points = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+
+  g_mutex_init (&data->jitter.lock);
+  data->jitter.policy = JITTER_POLICY_MIN_LATENCY;
+  data->jitter.min_ms = JITTER_LATENCY_MIN_MS;
+  data->jitter.max_ms = JITTER_LATENCY_MAX_MS;
+  data->jitter.latency_ms = JITTER_LATENCY_INIT_MS;
+  data->jitter.timer = g_timeout_source_new (JITTER_CTL_INTERVAL_MS);
+  g_source_set_callback (data->jitter.timer, jitter_ctl_timeout_cb, data, NULL);
+  g_source_attach (data->jitter.timer, data->context);
+
+  data->bus_source = bus_source;
   data->pipeline = pipeline;
   data->pipeline_restarting = FALSE;
   data->pipeline_ref = 0;
@@ -1433,214 +4642,840 @@ static void set_usr_message (const gchar *message, CustomData *data) {
   (*env)->DeleteLocalRef (env, jmessage);
 }
 
+/* Tell the application about the media size, unless it already knows it */
+static void media_info_notify (CustomData *data, gint width, gint height) {
+  JNIEnv *env;
+
+  g_mutex_lock (&data->media.lock);
+  if (width == data->media.reported_width && height == data->media.reported_height) {
+    g_mutex_unlock (&data->media.lock);
+    return;
+  }
+  data->media.reported_width = width;
+  data->media.reported_height = height;
+  g_mutex_unlock (&data->media.lock);
+
+  alogi ("Media size is %dx%d, notifying application", width, height);
+  env = get_jni_env ();
+  (*env)->CallVoidMethod (env, data->app, on_media_size_changed_method_id, (jint)width, (jint)height);
+  if ((*env)->ExceptionCheck (env)) {
+    aloge ("Failed to call Java method");
+    (*env)->ExceptionClear (env);
+  }
+}
+
+/* One SPS NAL unit, without start code */
+static gboolean media_info_from_sps (CustomData *data, const guint8 *nal, gsize size) {
+  GstH264NalParser *parser;
+  GstH264NalUnit nalu;
+  GstH264SPS sps;
+  guint8 *bytes;
+  gint width, height, fps_n = 0, fps_d = 1;
+  gboolean parsed;
+
+  if (size < 4 || (nal[0] & 0x1f) != GST_H264_NAL_SPS)
+    return FALSE;
+
+  bytes = g_malloc (size + 3);
+  bytes[0] = bytes[1] = 0;
+  bytes[2] = 1;
+  memcpy (bytes + 3, nal, size);
+  parser = gst_h264_nal_parser_new ();
+  parsed = gst_h264_parser_identify_nalu_unchecked (parser, bytes, 0, size + 3, &nalu) == GST_H264_PARSER_OK &&
+      gst_h264_parser_parse_sps (parser, &nalu, &sps, TRUE) == GST_H264_PARSER_OK;
+  gst_h264_nal_parser_free (parser);
+  g_free (bytes);
+  if (!parsed)
+    return FALSE;
+
+  width = sps.frame_cropping_flag ? sps.crop_rect_width : sps.width;
+  height = sps.frame_cropping_flag ? sps.crop_rect_height : sps.height;
+  if (sps.vui_parameters_present_flag && sps.vui_parameters.par_n && sps.vui_parameters.par_d)
+    width = width * sps.vui_parameters.par_n / sps.vui_parameters.par_d;
+  gst_h264_video_calculate_framerate (&sps, 0, 0, &fps_n, &fps_d);
+
+  g_mutex_lock (&data->media.lock);
+  data->media.known = TRUE;
+  data->media.width = width;
+  data->media.height = height;
+  data->media.fps_n = fps_n;
+  data->media.fps_d = fps_d;
+  data->media.profile = gst_codec_utils_h264_get_profile (nal + 1, size - 1);
+  data->media.level = gst_codec_utils_h264_get_level (nal + 1, size - 1);
+  g_mutex_unlock (&data->media.lock);
+
+  alogi ("media: %dx%d %d/%d fps, profile %s level %s", width, height, fps_n, fps_d,
+          GST_STR_NULL (data->media.profile), GST_STR_NULL (data->media.level));
+  media_info_notify (data, width, height);
+
+  return TRUE;
+}
+
+/* rtspsrc thread: base64 NAL units separated by commas */
+static void media_info_from_sprop (CustomData *data, const gchar *sprop) {
+  gchar **sets;
+  guint8 *nal;
+  gsize size;
+  gint i;
+
+  if (!sprop)
+    return;
+
+  sets = g_strsplit (sprop, ",", -1);
+  for (i = 0; sets[i]; i++) {
+    nal = g_base64_decode (sets[i], &size);
+    if (media_info_from_sps (data, nal, size)) {
+      g_free (nal);
+      break;
+    }
+    g_free (nal);
+  }
+  g_strfreev (sets);
+}
+
+/* No sprop in the SDP: the first SPS of the avcC codec_data the parser built */
+static GstPadProbeReturn probe_media_caps_cb (GstPad *pad, GstPadProbeInfo *info, gpointer user_data) {
+  CustomData *data = (CustomData *)user_data;
+  GstEvent *event = GST_PAD_PROBE_INFO_EVENT (info);
+  const GValue *value;
+  GstMapInfo map;
+  GstCaps *caps;
+  gboolean known;
+  guint size;
+
+  if (GST_EVENT_TYPE (event) != GST_EVENT_CAPS)
+    return GST_PAD_PROBE_OK;
+
+  g_mutex_lock (&data->media.lock);
+  known = data->media.known;
+  g_mutex_unlock (&data->media.lock);
+  if (known)
+    return GST_PAD_PROBE_OK;
+
+  gst_event_parse_caps (event, &caps);
+  value = gst_structure_get_value (gst_caps_get_structure (caps, 0), "codec_data");
+  if (!value || !GST_VALUE_HOLDS_BUFFER (value))
+    return GST_PAD_PROBE_OK;
+
+  if (!gst_buffer_map (gst_value_get_buffer (value), &map, GST_MAP_READ))
+    return GST_PAD_PROBE_OK;
+
+  if (map.size > 8 && (map.data[5] & 0x1f)) {
+    size = GST_READ_UINT16_BE (map.data + 6);
+    if (8 + size <= map.size)
+      media_info_from_sps (data, map.data + 8, size);
+  }
+  gst_buffer_unmap (gst_value_get_buffer (value), &map);
+
+  return GST_PAD_PROBE_OK;
+}
+
 /* Retrieve the video sink's Caps and tell the application about the media size */
 static void check_media_size (CustomData *data) {
-  JNIEnv *env = get_jni_env ();
   GstElement *video_overlay_sink;
   GstPad *video_sink_pad;
   GstCaps *caps;
   GstVideoInfo info;
 
-  /* Retrieve the Caps at the entrance of the video sink */
+  /* Retrieve the Caps at the entrance of the video sink, a preroll or push only session has none */
   video_overlay_sink = gst_bin_get_by_interface (GST_BIN(data->pipeline), GST_TYPE_VIDEO_OVERLAY);
+  if (!video_overlay_sink)
+    return;
+
   video_sink_pad = gst_element_get_static_pad (video_overlay_sink, "sink");
   gst_object_unref (video_overlay_sink);
-  caps = gst_pad_get_current_caps (video_sink_pad);
+  if (!video_sink_pad)
+    return;
 
-  if (gst_video_info_from_caps (&info, caps)) {
+  caps = gst_pad_get_current_caps (video_sink_pad);
+  if (caps && gst_video_info_from_caps (&info, caps)) {
     info.width = info.width * info.par_n / info.par_d;
-    alogi ("Media size is %dx%d, notifying application", info.width, info.height);
+    media_info_notify (data, info.width, info.height);
+  }
+
+  if (caps)
+    gst_caps_unref (caps);
+  gst_object_unref (video_sink_pad);
+}
+
+typedef struct _reset_timeout {
+  CustomData *data;
+  guint generation;
+} reset_timeout;
+
+static gboolean reset_timeout_cb (gpointer user_data) {
+  reset_timeout *rt = (reset_timeout *)user_data;
+  worker_msg *msg = g_new0 (worker_msg, 1);
+
+  msg->cmd = &worke_cmd[WORKER_CMD_RESET_DONE];
+  msg->queued = g_get_monotonic_time ();
+  msg->generation = rt->generation;
+  g_async_queue_push (rt->data->worker_cmd_queue, msg);
+  worker_schedule (rt->data);
+  return G_SOURCE_REMOVE;
+}
+
+/* The source is only marked destroyed once the callback returns, so the worker goes by generation */
+static void reset_timer_start (CustomData *data) {
+  reset_timeout *rt = g_new0 (reset_timeout, 1);
+
+  rt->data = data;
+  rt->generation = ++data->reset_generation;
+  data->reset_timer = g_timeout_source_new (reconnect_next_delay (&data->reconnect) / G_TIME_SPAN_MILLISECOND);
+  g_source_set_callback (data->reset_timer, reset_timeout_cb, rt, g_free);
+  g_source_attach (data->reset_timer, data->context);
+}
+
+static void reset_timer_cancel (CustomData *data) {
+  if (!data->reset_timer)
+    return;
+
+  g_source_destroy (data->reset_timer);
+  g_source_unref (data->reset_timer);
+  data->reset_timer = NULL;
+}
+
+/* A new rtspsrc goes in now, and starts once the reconnect backoff is over */
+static void source_reset_begin (CustomData *data) {
+  gboolean replaced;
+
+  g_mutex_lock (&data->mutex_branch);
+  replaced = data->rtspsrc && !data->source_stopping && source_replace (data, FALSE);
+  g_mutex_unlock (&data->mutex_branch);
+
+  /* no source to replace, the next branch opens a new one */
+  if (!replaced) {
+    reset_request_clear (data, RESET_REQUEST_SOURCE);
+    return;
+  }
+
+  alogi ("source reset: branches kept");
+  reset_timer_start (data);
+}
+
+static void source_reset_done (CustomData *data) {
+  g_mutex_lock (&data->mutex_branch);
+  if (data->rtspsrc && !data->source_stopping) {
+    gst_element_set_locked_state (data->rtspsrc, FALSE);
+    gst_element_sync_state_with_parent (data->rtspsrc);
+  }
+  g_mutex_unlock (&data->mutex_branch);
+}
+
+/* Stop every branch for the reset; they are rebuilt, not taken from the pool */
+static void pipeline_reset_begin (CustomData *data) {
+  GHashTableIter iter;
+  branch *br;
+  gint request = g_atomic_int_get (&data->reset_request);
+
+  if (!request)
+    return;
+
+  if (request == RESET_REQUEST_SOURCE) {
+    if (!data->reset_timer) {
+      data->reset_handled = request;
+      source_reset_begin (data);
+    }
+    return;
+  }
+
+  data->reset_handled = request;
+  g_mutex_lock (&data->mutex_branch);
+  data->pipeline_restarting = TRUE;
+  g_mutex_unlock (&data->mutex_branch);
+  reset_timer_cancel (data);
+
+  g_hash_table_iter_init (&iter, data->branches);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&br))
+    branch_stop (data, br);
+
+  g_mutex_lock (&data->mutex_branch);
+  g_hash_table_iter_init (&iter, data->branches);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&br)) {
+    if (br->enabled == BRANCH_DISABLE)
+      cleanup_branch_elements (data, br);
+    else
+      br->pool_flush = TRUE;
+  }
+
+  if (data->flv.users || data->flv.parking)
+    data->flv.pool_flush = TRUE;
+  else
+    cleanup_flv_core (data);
+  g_mutex_unlock (&data->mutex_branch);
+}
+
+/* Once every branch is down, wait the restart delay and let them come back */
+static void pipeline_reset_progress (CustomData *data) {
+  GHashTableIter iter;
+  branch *br;
+
+  if (data->source_stopping || data->reset_timer)
+    return;
+
+  g_hash_table_iter_init (&iter, data->branches);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&br)) {
+    if (br->enabled == BRANCH_DISABLE_ING)
+      return;
+  }
+
+  /* a lingering source has to go as well, it is what failed */
+  if ((data->reset_handled & RESET_REQUEST_PIPELINE) && data->rtspsrc) {
+    source_stop (data);
+    if (data->source_stopping)
+      return;
+  }
+
+  reset_timer_start (data);
+}
+
+static void branch_cmd_check (CustomData *data, branch *br) {
+  gchar *what;
+
+  if (!br->cmd_time)
+    return;
+
+  if ((br->request && br->enabled == BRANCH_ENABLE) ||
+      (!br->request && br->enabled == BRANCH_DISABLE)) {
+    what = g_strdup_printf ("command latency (%s)", br->id);
+    latency_stat_update (&data->cmd_latency, br->cmd_time, what);
+    g_free (what);
+    br->cmd_time = 0;
+  }
+}
 
-    (*env)->CallVoidMethod (env, data->app, on_media_size_changed_method_id, (jint)info.width, (jint)info.height);
-    if ((*env)->ExceptionCheck (env)) {
-      aloge ("Failed to call Java method");
-      (*env)->ExceptionClear (env);
+/* Register a branch, or give an existing one the spec for its next start. Takes the spec */
+static void worker_branch_add (CustomData *data, const gchar *id, GstStructure *spec) {
+  const branch_desc *desc;
+  branch *br;
+
+  desc = branch_desc_lookup (gst_structure_get_name (spec));
+  if (!desc) {
+    aloge ("add branch %s: unknown type %s", id, gst_structure_get_name (spec));
+    gst_structure_free (spec);
+    return;
+  }
+
+  br = (branch *)g_hash_table_lookup (data->branches, id);
+  if (br && br->desc != desc) {
+    aloge ("add branch %s: already a %s branch", id, br->desc->type);
+    gst_structure_free (spec);
+    return;
+  }
+
+  g_mutex_lock (&data->mutex_branch);
+  if (br) {
+    gst_structure_free (br->spec);
+    br->spec = spec;
+    br->remove = FALSE;
+  } else {
+    br = branch_new (data, id, desc, spec);
+    g_hash_table_insert (data->branches, br->id, br);
+    alogi ("add branch %s (%s, %u branches)", id, desc->type, g_hash_table_size (data->branches));
+  }
+  g_mutex_unlock (&data->mutex_branch);
+}
+
+static void worker_branch_request (CustomData *data, worker_msg *msg) {
+  branch *br = (branch *)g_hash_table_lookup (data->branches, msg->id);
+
+  if (!br) {
+    aloge ("%s: no branch %s", msg->cmd->comment, msg->id);
+    return;
+  }
+
+  if (msg->cmd->index == WORKER_CMD_REMOVE_BRANCH) {
+    if (br == data->display) {
+      aloge ("remove branch: %s is built in", msg->id);
+      return;
     }
+    br->remove = TRUE;
   }
 
-  gst_caps_unref (caps);
-  gst_object_unref (video_sink_pad);
+  br->request = msg->cmd->index == WORKER_CMD_START_BRANCH;
+  br->cmd_time = msg->queued;
+
+  if (!br->request) {
+    g_mutex_lock (&data->mutex_branch);
+    br->heal.outage_begin = 0;
+    br->heal.attempt = 0;
+    g_mutex_unlock (&data->mutex_branch);
+  }
+}
+
+static gboolean branch_heal_timeout_cb (gpointer user_data) {
+  notify_worker_update_pipeline ((CustomData *)user_data, WORKER_CMD_RECONCILE);
+  return G_SOURCE_REMOVE;
+}
+
+/* The backoff of a healing branch is still running */
+static gboolean branch_heal_pending (branch *br) {
+  if (!br->heal.timer)
+    return FALSE;
+
+  if (!g_source_is_destroyed (br->heal.timer))
+    return TRUE;
+
+  g_source_unref (br->heal.timer);
+  br->heal.timer = NULL;
+  return FALSE;
 }
 
-static gint64 reset_latency_calculation(void) {
-  static gint64 old = 0;
-  static guint64 count = 0;
-  gint64 new;
+/* Take a failed branch down for a rebuild, the reconcile after the backoff starts it again */
+static void branch_heal_begin (CustomData *data, const gchar *id) {
+  branch *br = (branch *)g_hash_table_lookup (data->branches, id);
+  guint delay_ms;
+
+  if (!br || !br->request || branch_heal_pending (br))
+    return;
+
+  delay_ms = MIN (BRANCH_HEAL_FIRST_MS << MIN (br->heal.attempt, 16), BRANCH_HEAL_MAX_MS);
+  delay_ms = g_random_int_range (delay_ms / 2, delay_ms + 1);
 
-  new = g_get_monotonic_time ();
-  if ((new - old) < G_TIME_SPAN_SECOND)
-    count ++;
+  g_mutex_lock (&data->mutex_branch);
+  if (!br->heal.outage_begin)
+    br->heal.outage_begin = g_get_monotonic_time ();
+  br->heal.attempt++;
+  if (br->enabled == BRANCH_DISABLE)
+    cleanup_branch_elements (data, br);
   else
-    count = 0;
+    br->pool_flush = TRUE;
+  g_mutex_unlock (&data->mutex_branch);
+
+  alogw ("branch %s: failed, rebuilding in %ums (attempt %u)", br->id, delay_ms, br->heal.attempt);
+  branch_stop (data, br);
+
+  br->heal.timer = g_timeout_source_new (delay_ms);
+  g_source_set_callback (br->heal.timer, branch_heal_timeout_cb, data, NULL);
+  g_source_attach (br->heal.timer, data->context);
+}
+
+/*
+ * Connect the source for preroll_url with no branch on it yet, so the RTSP round trips
+ * and the wait for an IDR are over by the time the display starts. The tee keeps the
+ * last GOP for the first branch, and the source lingers for SOURCE_PREROLL_MS at most.
+ * A lingering source of another URL is stopped first; its job done brings us back.
+ */
+static void source_preroll (CustomData *data) {
+  gchar *location = NULL;
+  gboolean stale;
+
+  if (!data->preroll_url)
+    return;
+
+  g_mutex_lock (&data->mutex_branch);
+  if (data->pipeline_restarting || data->source_stopping) {
+    g_mutex_unlock (&data->mutex_branch);
+    return;
+  }
+
+  if (data->rtspsrc) {
+    g_object_get (G_OBJECT(data->rtspsrc), "location", &location, NULL);
+    stale = g_strcmp0 (location, data->preroll_url) && !data->pipeline_ref;
+    g_free (location);
+    if (!stale)
+      g_clear_pointer (&data->preroll_url, g_free);
+    g_mutex_unlock (&data->mutex_branch);
+    if (stale)
+      source_stop (data);
+    return;
+  }
+
+  alogi ("preroll: %s", data->preroll_url);
+  if (source_session_begin (data, data->preroll_url, TRUE)) {
+    gst_element_set_state (data->pipeline, GST_STATE_PLAYING);
+    source_linger_start (data, MAX (data->source_linger_ms, SOURCE_PREROLL_MS));
+  }
+  g_clear_pointer (&data->preroll_url, g_free);
+  g_mutex_unlock (&data->mutex_branch);
+}
+
+/*
+ * Bring every branch towards its request without waiting on any of them. A branch in
+ * BRANCH_DISABLE_ING is left alone until its job reports back through WORKER_CMD_RECONCILE.
+ */
+static void worker_reconcile (CustomData *data) {
+  GHashTableIter iter;
+  branch *br;
+
+  g_hash_table_iter_init (&iter, data->branches);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&br)) {
+    if (!br->request && (br->enabled == BRANCH_ENABLE || br->enabled == BRANCH_ENABLE_ING))
+      branch_stop (data, br);
+  }
+
+  if (data->pipeline_restarting)
+    pipeline_reset_progress (data);
 
-  if (count > 4)
-      count = 4;
-  old = new;
+  g_hash_table_iter_init (&iter, data->branches);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&br)) {
+    if (br->request && br->enabled == BRANCH_DISABLE && !branch_heal_pending (br))
+      branch_start (data, br);
+
+    branch_cmd_check (data, br);
+
+    if (br->remove && br->enabled == BRANCH_DISABLE) {
+      alogi ("remove branch %s", br->id);
+      g_mutex_lock (&data->mutex_branch);
+      g_hash_table_iter_remove (&iter);
+      g_mutex_unlock (&data->mutex_branch);
+    }
+  }
+
+  source_preroll (data);
+}
+
+/* Engine pool thread: run the commands of one stream until its queue is empty */
+static void worker_function (gpointer task, gpointer user_data) {
+  CustomData *data = (CustomData *) task;
+  worker_msg *msg;
+
+  while (TRUE) {
+    msg = (worker_msg *)g_async_queue_try_pop (data->worker_cmd_queue);
+    if (!msg) {
+      g_mutex_lock (&data->worker_lock);
+      /* a command pushed before this lock found the stream still scheduled */
+      if (g_async_queue_length (data->worker_cmd_queue) > 0) {
+        g_mutex_unlock (&data->worker_lock);
+        continue;
+      }
+      data->worker_scheduled = FALSE;
+      g_cond_broadcast (&data->worker_cond);
+      g_mutex_unlock (&data->worker_lock);
+      return;
+    }
+
+    if (!data->worker_run) {
+      worker_msg_free (msg);
+      continue;
+    }
+
+    switch (msg->cmd->index) {
+      case WORKER_CMD_ADD_BRANCH:
+        worker_branch_add (data, msg->id, msg->spec);
+        msg->spec = NULL;
+        break;
+      case WORKER_CMD_START_BRANCH:
+      case WORKER_CMD_STOP_BRANCH:
+      case WORKER_CMD_REMOVE_BRANCH:
+        worker_branch_request (data, msg);
+        break;
+      case WORKER_CMD_STOP_SOURCE:
+        source_stop (data);
+        break;
+      case WORKER_CMD_SAVE_PRE_EVENT:
+        pre_event_save (data, msg->spec);
+        break;
+      case WORKER_CMD_SWITCH_TRANSPORT:
+        source_switch_transport (data);
+        break;
+      case WORKER_CMD_HEAL_BRANCH:
+        branch_heal_begin (data, msg->id);
+        break;
+      case WORKER_CMD_PREROLL:
+        g_free (data->preroll_url);
+        data->preroll_url = msg->id;
+        msg->id = NULL;
+        break;
+      case WORKER_CMD_RESET_PIPELINE:
+        pipeline_reset_begin (data);
+        break;
+      case WORKER_CMD_RESET_DONE:
+        /* a reset that came in meanwhile cancelled this timer and armed its own */
+        if (!data->reset_timer || msg->generation != data->reset_generation)
+          break;
+        reset_timer_cancel (data);
+        if (!data->pipeline_restarting)
+          source_reset_done (data);
+        g_mutex_lock (&data->mutex_branch);
+        data->pipeline_restarting = FALSE;
+        g_mutex_unlock (&data->mutex_branch);
+        reset_request_clear (data, data->reset_handled);
+        data->reset_handled = RESET_REQUEST_NULL;
+        break;
+      default:
+        break;
+    }
+
+    worker_msg_free (msg);
+    worker_reconcile (data);
+  }
+}
 
-  return G_TIME_SPAN_MILLISECOND * 500 * (1 < count);
+typedef struct _engine_call {
+  GSourceFunc func;
+  gpointer user_data;
+  GMutex lock;
+  GCond cond;
+  gboolean done;
+} engine_call;
 
-}
+static gboolean engine_call_cb (gpointer user_data) {
+  engine_call *call = (engine_call *)user_data;
 
-static void *worker_function (void *userdata) {
-  CustomData *data = (CustomData *) userdata;
-  guchar reset_request;
-  guchar do_reset_request;
-  gint64 end_time;
-  const _worker_cmd *cmd = NULL;
+  call->func (call->user_data);
 
-  do {
-    while (!cmd)
-      cmd = (const _worker_cmd *)g_async_queue_pop (data->worker_cmd_queue);
+  g_mutex_lock (&call->lock);
+  call->done = TRUE;
+  g_cond_signal (&call->cond);
+  g_mutex_unlock (&call->lock);
 
-    if (!data->worker_run)
-      break;
+  return G_SOURCE_REMOVE;
+}
 
-    switch (cmd->index) {
-      case WORKER_CMD_START_DISPLAY:
-        data->display_requst = TRUE;
-        cmd = NULL;
-        break;
-      case WORKER_CMD_STOP_DISPLAY:
-        data->display_requst = FALSE;
-        cmd = NULL;
-        break;
-      case WORKER_CMD_START_PUSH_RTSP:
-        data->push_rtsp_request = TRUE;
-        cmd = NULL;
-        break;
-      case WORKER_CMD_STOP_PUSH_RTSP:
-        data->push_rtsp_request = FALSE;
-        cmd = NULL;
-        break;
-      case WORKER_CMD_START_PUSH_RTMP:
-        data->push_rtmp_request = TRUE;
-        cmd = NULL;
-        break;
-      case WORKER_CMD_STOP_PUSH_RTMP:
-        data->push_rtmp_request = FALSE;
-        cmd = NULL;
-        break;
-      case WORKER_CMD_RESET_PIPELINE:
-        reset_request = 0;
-        data->pipeline_restarting = TRUE;
-        do {
-          do_reset_request = data->reset_request & (~reset_request);
-          reset_request = data->reset_request;
-          if (!reset_request)
-              break;
+/* Run func on the engine main loop and wait for it, no bus or timer of any stream runs meanwhile */
+static void engine_call_sync (GSourceFunc func, gpointer user_data) {
+  engine_call call;
 
-          if (do_reset_request & RESET_REQUEST_DISPLAY)
-            display_stop (data);
+  call.func = func;
+  call.user_data = user_data;
+  call.done = FALSE;
+  g_mutex_init (&call.lock);
+  g_cond_init (&call.cond);
 
-          if (do_reset_request & RESET_REQUEST_PRTMP)
-            push_rtmp_stop (data);
+  g_main_context_invoke (shared_engine.context, engine_call_cb, &call);
 
-          if (do_reset_request & RESET_REQUEST_PRTSP)
-            push_rtsp_stop (data);
+  g_mutex_lock (&call.lock);
+  while (!call.done)
+    g_cond_wait (&call.cond, &call.lock);
+  g_mutex_unlock (&call.lock);
 
-          if (!data->worker_run)
-            break;
+  g_mutex_clear (&call.lock);
+  g_cond_clear (&call.cond);
+}
 
-          end_time = reset_latency_calculation();
-          cmd = g_async_queue_timeout_pop (data->worker_cmd_queue, end_time);
-        } while(cmd && cmd->index == WORKER_CMD_RESET_PIPELINE);
-        data->pipeline_restarting = FALSE;
-        data->reset_request = RESET_REQUEST_NULL;
-        break;
-      default:
-        break;
-    }
+/* Main method of the engine, executed on its own thread for all streams */
+static void *engine_function (void *userdata) {
+  g_main_context_push_thread_default (shared_engine.context);
 
-    if (!data->worker_run)
-      break;
+  alogi ("engine: Entering main loop...");
+  g_main_loop_run (shared_engine.main_loop);
+  alogi ("engine: Exited main loop");
 
-    if (!data->display_requst && (data->display_enabled == BRANCH_ENABLE))
-      display_stop (data);
+  g_main_context_pop_thread_default (shared_engine.context);
+  return NULL;
+}
 
-    if (!data->push_rtmp_request && (data->push_rtmp_enabled == BRANCH_ENABLE))
-      push_rtmp_stop (data);
+static gboolean engine_quit_cb (gpointer user_data) {
+  g_main_loop_quit (shared_engine.main_loop);
+  return G_SOURCE_REMOVE;
+}
 
-    if (!data->push_rtsp_request && (data->push_rtsp_enabled == BRANCH_ENABLE))
-      push_rtsp_stop (data);
+/* Whole process usage, the CPU share is over the time since the previous log */
+static void engine_log_usage (const gchar *what) {
+  gchar *status = NULL;
+  const gchar *line;
+  guint64 threads = 0, rss_kb = 0;
+  struct timespec ts;
+  gint64 cpu_us, wall_us, span_us = 0;
+  gdouble cpu = 0;
+
+  if (g_file_get_contents ("/proc/self/status", &status, NULL, NULL)) {
+    if ((line = strstr (status, "\nThreads:")) != NULL)
+      threads = g_ascii_strtoull (line + strlen ("\nThreads:"), NULL, 10);
+    if ((line = strstr (status, "\nVmRSS:")) != NULL)
+      rss_kb = g_ascii_strtoull (line + strlen ("\nVmRSS:"), NULL, 10);
+    g_free (status);
+  }
 
-    if (data->display_requst && (data->display_enabled == BRANCH_DISABLE))
-      display_start (data);
+  clock_gettime (CLOCK_PROCESS_CPUTIME_ID, &ts);
+  cpu_us = (gint64)ts.tv_sec * G_USEC_PER_SEC + ts.tv_nsec / 1000;
+  wall_us = g_get_monotonic_time ();
+  if (shared_engine.usage_wall_us)
+    span_us = wall_us - shared_engine.usage_wall_us;
+  if (span_us > 0)
+    cpu = 100.0 * (cpu_us - shared_engine.usage_cpu_us) / span_us;
+  shared_engine.usage_cpu_us = cpu_us;
+  shared_engine.usage_wall_us = wall_us;
+
+  alogi ("engine: %s, %u streams on 1 main loop and %u/%d worker threads, process: %"
+          G_GUINT64_FORMAT " threads, %" G_GUINT64_FORMAT " kB resident, %.1f%% CPU over %.1fs",
+          what, shared_engine.streams, g_thread_pool_get_num_threads (shared_engine.workers),
+          ENGINE_MAX_WORKERS, threads, rss_kb, cpu, (gdouble)span_us / G_USEC_PER_SEC);
+}
 
-    if (data->push_rtmp_request && (data->push_rtmp_enabled == BRANCH_DISABLE))
-      push_rtmp_start (data);
+/* The first stream starts the engine threads. Returns the id of the new stream */
+static guint engine_acquire (void) {
+  guint id;
+
+  g_mutex_lock (&shared_engine.lock);
+  if (!shared_engine.streams) {
+    shared_engine.context = g_main_context_new ();
+    shared_engine.main_loop = g_main_loop_new (shared_engine.context, FALSE);
+    shared_engine.workers = g_thread_pool_new (worker_function, NULL, ENGINE_MAX_WORKERS,
+            FALSE, NULL);
+    shared_engine.finalizers = g_thread_pool_new (recorder_finalize, NULL, 1, FALSE, NULL);
+    pthread_create (&shared_engine.thread, NULL, &engine_function, NULL);
+    shared_engine.usage_wall_us = 0;
+  }
 
-    if (data->push_rtsp_request && (data->push_rtsp_enabled == BRANCH_DISABLE))
-      push_rtsp_start (data);
+  shared_engine.streams++;
+  id = shared_engine.next_id++;
+  engine_log_usage ("stream added");
+  g_mutex_unlock (&shared_engine.lock);
 
-  } while (data->worker_run);
+  return id;
+}
 
-  return NULL;
+/* The last stream stops them */
+static void engine_release (void) {
+  g_mutex_lock (&shared_engine.lock);
+  shared_engine.streams--;
+  engine_log_usage ("stream removed");
+
+  if (!shared_engine.streams) {
+    engine_call_sync (engine_quit_cb, NULL);
+    pthread_join (shared_engine.thread, NULL);
+    g_thread_pool_free (shared_engine.workers, FALSE, TRUE);
+    g_thread_pool_free (shared_engine.finalizers, FALSE, TRUE);
+    g_main_loop_unref (shared_engine.main_loop);
+    g_main_context_unref (shared_engine.context);
+    shared_engine.workers = NULL;
+    shared_engine.finalizers = NULL;
+    shared_engine.main_loop = NULL;
+    shared_engine.context = NULL;
+  }
+  g_mutex_unlock (&shared_engine.lock);
 }
 
-/* Main method for the native code. This is executed on its own thread. */
-static void *app_function (void *userdata) {
-  JNIEnv *env = NULL;
-  CustomData *data = NULL;
-  GMainContext *context = NULL;
+/* Sources of the stream on the engine context go away on the loop thread, between dispatches */
+static gboolean stream_detach_cb (gpointer user_data) {
+  CustomData *data = (CustomData *)user_data;
+  GHashTableIter iter;
+  branch *br;
+
+  g_source_destroy (data->bus_source);
+  g_source_unref (data->bus_source);
+  data->bus_source = NULL;
+
+  g_source_destroy (data->jitter.timer);
+  g_source_unref (data->jitter.timer);
+  data->jitter.timer = NULL;
+
+  g_source_destroy (data->watchdog.timer);
+  g_source_unref (data->watchdog.timer);
+  data->watchdog.timer = NULL;
+
+  /* what the session settled on, before it goes */
+  g_source_destroy (data->session_timer);
+  g_source_unref (data->session_timer);
+  data->session_timer = NULL;
+  session_cache_flush (data);
+
+  source_linger_cancel (data);
+  reset_timer_cancel (data);
+
+  g_hash_table_iter_init (&iter, data->branches);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&br)) {
+    if (br->drain_timer) {
+      g_source_destroy (br->drain_timer);
+      g_source_unref (br->drain_timer);
+      br->drain_timer = NULL;
+    }
+    if (br->heal.timer) {
+      g_source_destroy (br->heal.timer);
+      g_source_unref (br->heal.timer);
+      br->heal.timer = NULL;
+    }
+  }
 
-  env = get_jni_env ();
-  data = (CustomData *)userdata;
+  return G_SOURCE_REMOVE;
+}
 
-  /* Create our own GLib Main Context and make it the default one */
-  context = g_main_context_new ();
-  g_main_context_push_thread_default (context);
+static gboolean stream_start (CustomData *data) {
+  data->id = engine_acquire ();
+  data->context = shared_engine.context;
 
   data->worker_cmd_queue = g_async_queue_new ();
   data->native_window = NULL;
   data->rtspsrc_url = NULL;
-  data->display_requst = FALSE;
-  data->display_enabled = BRANCH_DISABLE;
-  data->push_rtmp_request = FALSE;
-  data->push_rtmp_enabled = BRANCH_DISABLE;
-  data->push_rtmp_url = NULL;
-  data->push_rtsp_request = FALSE;
-  data->push_rtsp_enabled = BRANCH_DISABLE;
-  data->push_rtsp_url = NULL;
+  data->branches = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, branch_free);
+  data->display = branch_new (data, BRANCH_ID_DISPLAY, &display_desc,
+          gst_structure_new_empty (display_desc.type));
+  g_hash_table_insert (data->branches, data->display->id, data->display);
   data->reset_request = RESET_REQUEST_NULL;
+  data->reset_handled = RESET_REQUEST_NULL;
   data->worker_run = TRUE;
 
-  data->context = context;
-  setup_main_loop (data);
+  if (!setup_main_loop (data)) {
+    g_hash_table_destroy (data->branches);
+    g_async_queue_unref (data->worker_cmd_queue);
+    engine_release ();
+    return FALSE;
+  }
+
+  alogi ("stream %u started (CustomData:%p)", data->id, data);
+  return TRUE;
+}
 
-  pthread_create (&(data->gst_worker_thread), NULL, &worker_function, data);
+static void stream_stop (CustomData *data) {
+  worker_msg *msg;
+  GstBus *bus;
+  GstMessage *bus_msg;
+  gint64 end_time;
 
-  alogi ("app func: Entering main loop... (CustomData:%p)", data);
-  g_main_loop_run (data->main_loop);
-  alogi ("app func: Exited main loop");
+  alogi ("stream %u stopping", data->id);
 
+  /* a running command may still arm timers, let it finish before detaching; the rest is dropped */
+  g_mutex_lock (&data->worker_lock);
   data->worker_run = FALSE;
-  notify_worker_update_pipeline (data, WORKER_CMD);
-  pthread_join (data->gst_worker_thread, NULL);
+  while (data->worker_scheduled)
+    g_cond_wait (&data->worker_cond, &data->worker_lock);
+  g_mutex_unlock (&data->worker_lock);
+
+  engine_call_sync (stream_detach_cb, data);
+
+  /* a timer that fired before the detach may have scheduled it again, to drop its command */
+  g_mutex_lock (&data->worker_lock);
+  while (data->worker_scheduled)
+    g_cond_wait (&data->worker_cond, &data->worker_lock);
+  g_mutex_unlock (&data->worker_lock);
+
+  engine_call_sync (pre_event_detach_cb, data);
+  pre_event_drain (data);
+
+  /* Branch jobs still in flight report to a bus nobody watches any more */
+  g_mutex_lock (&data->mutex_branch);
+  end_time = g_get_monotonic_time () + 2 * G_TIME_SPAN_SECOND;
+  while (data->async_jobs > 0) {
+    if (!g_cond_wait_until (&data->branch_cond, &data->mutex_branch, end_time)) {
+      alogw ("stream stop: %d branch jobs did not finish", data->async_jobs);
+      break;
+    }
+  }
+  g_mutex_unlock (&data->mutex_branch);
+
+  bus = gst_element_get_bus (data->pipeline);
+  while ((bus_msg = gst_bus_pop_filtered (bus, GST_MESSAGE_APPLICATION)) != NULL) {
+    const GstStructure *s = gst_message_get_structure (bus_msg);
+    gpointer job = NULL;
+
+    if (gst_structure_has_name (s, BRANCH_JOB_DONE) &&
+        gst_structure_get (s, "job", G_TYPE_POINTER, &job, NULL))
+      branch_job_free ((branch_job *)job);
+    gst_message_unref (bus_msg);
+  }
+  gst_object_unref (bus);
+
+  while ((msg = (worker_msg *)g_async_queue_try_pop (data->worker_cmd_queue)) != NULL)
+    worker_msg_free (msg);
   g_async_queue_unref (data->worker_cmd_queue);
 
   /* Free resources */
-  //cleanup_recording_elements (data);
-  cleanup_push_rtsp_elements (data);
-  cleanup_push_rtmp_elements (data);
-  cleanup_display_elements (data);
+  gst_element_set_state (data->pipeline, GST_STATE_NULL);
+  g_hash_table_destroy (data->branches);
+  data->branches = NULL;
+  data->display = NULL;
+  cleanup_flv_core (data);
 
   if (data->rtspsrc_url)
     g_free (data->rtspsrc_url);
-
-  if (data->push_rtmp_url)
-    g_free (data->push_rtmp_url);
-
-  if (data->push_rtsp_url)
-    g_free (data->push_rtsp_url);
+  g_free (data->preroll_url);
 
   cleanup_main_loop (data);
+  alogi ("stream %u stopped", data->id);
 
-  if (context) {
-    g_main_context_pop_thread_default (context);
-    g_main_context_unref (context);
-  }
-
-  return NULL;
+  engine_release ();
 }
 
 /*
@@ -1718,6 +5553,10 @@ static jboolean gst_native_init (JNIEnv* env, jobject thiz) {
   set_gst_debuglevel_from_prop (GST_LEVEL_DEBUG);
   set_gst_debuglevel_from_prop (GST_LEVEL_TRACE);
 
+  memset (prop, 0, PROP_VALUE_MAX);
+  len = __system_property_get("persist.gst.debug.cpumeter", prop);
+  data->cpu_meter_enabled = len > 0 && !g_strcmp0 ("1", prop);
+
   //gst_debug_set_threshold_for_name ("rtspsrc", GST_LEVEL_DEBUG);
   //gst_debug_set_threshold_for_name ("rtmpsink", GST_LEVEL_TRACE);
   //gst_debug_set_threshold_for_name ("flvmux", GST_LEVEL_LOG);
@@ -1726,8 +5565,13 @@ static jboolean gst_native_init (JNIEnv* env, jobject thiz) {
   //gst_debug_set_threshold_for_name ("rtspclientsink", GST_LEVEL_DEBUG);
 
   data->app = (*env)->NewGlobalRef (env, thiz);
+  if (!stream_start (data)) {
+    aloge ("gst_native_init start stream failed");
+    (*env)->DeleteGlobalRef (env, data->app);
+    g_free (data);
+    return JNI_FALSE;
+  }
   SET_CUSTOM_DATA (env, thiz, custom_data_field_id, data);
-  pthread_create (&(data->gst_app_thread), NULL, &app_function, data);
 
   return JNI_TRUE;
 }
@@ -1743,11 +5587,8 @@ static void gst_native_finalize (JNIEnv* env, jobject thiz) {
 
   gst_native_surface_finalize (env, thiz);
 
-  alogi ("Quitting main loop...");
-  g_main_loop_quit (data->main_loop);
-
-  alogi ("Waiting for thread to finish...");
-  pthread_join (data->gst_app_thread, NULL);
+  alogi ("Stopping stream %u...", data->id);
+  stream_stop (data);
 
   alogi ("Deleting GlobalRef for app object at %p", data->app);
   (*env)->DeleteGlobalRef (env, data->app);
@@ -1776,7 +5617,7 @@ static jboolean gst_native_play (JNIEnv* env, jobject thiz) {
   if (!data->native_window)
     return JNI_FALSE;
 
-  notify_worker_update_pipeline (data, WORKER_CMD_START_DISPLAY);
+  notify_worker_branch (data, WORKER_CMD_START_BRANCH, BRANCH_ID_DISPLAY, NULL);
 
   return JNI_TRUE;
 }
@@ -1789,7 +5630,7 @@ static void gst_native_stop (JNIEnv* env, jobject thiz) {
   if (!data)
       return;
 
-  notify_worker_update_pipeline (data, WORKER_CMD_STOP_DISPLAY);
+  notify_worker_branch (data, WORKER_CMD_STOP_BRANCH, BRANCH_ID_DISPLAY, NULL);
 }
 
 static void gst_native_surface_init (JNIEnv *env, jobject thiz, jobject surface) {
@@ -1816,27 +5657,49 @@ static void gst_native_surface_finalize (JNIEnv *env, jobject thiz) {
 static jboolean gst_native_recording (JNIEnv* env, jobject thiz,
         jboolean enable, jstring dir) {
   CustomData *data = GET_CUSTOM_DATA (env, thiz, custom_data_field_id);
-  const gchar *recording_dir = (*env)->GetStringUTFChars (env, dir, NULL);
+  const gchar *recording_dir;
+
+  if (!data || !data->pipeline) {
+    aloge ("Recording : data or pipeline is null");
+    return JNI_FALSE;
+  }
+
+  if (!enable) {
+    notify_worker_branch (data, WORKER_CMD_STOP_BRANCH, BRANCH_ID_RECORDING, NULL);
+    return JNI_TRUE;
+  }
+
+  if (!data->rtspsrc_url || !dir) {
+    aloge ("Recording: failed, rtsp (src) url or dir is NULL");
+    return JNI_FALSE;
+  }
+
+  recording_dir = (*env)->GetStringUTFChars (env, dir, NULL);
+  alogi ("start recording video stream to %s", recording_dir);
+  notify_worker_branch (data, WORKER_CMD_ADD_BRANCH, BRANCH_ID_RECORDING,
+          gst_structure_new (recording_desc.type, "dir", G_TYPE_STRING, recording_dir, NULL));
+  notify_worker_branch (data, WORKER_CMD_START_BRANCH, BRANCH_ID_RECORDING, NULL);
+  (*env)->ReleaseStringUTFChars (env, dir, recording_dir);
+
+  return JNI_TRUE;
+}
+
+/* Save the pre-event ring and the next post_seconds of the stream in dir */
+static jboolean gst_native_save_pre_event (JNIEnv* env, jobject thiz, jstring dir, jint post_seconds) {
+  CustomData *data = GET_CUSTOM_DATA (env, thiz, custom_data_field_id);
+  const gchar *pre_event_dir;
 
-//  if (!data || !data->pipeline) {
-//      aloge ("Recording : data or pipeline is null");
-//      return JNI_FALSE;
-//  }
-//
-//  if (enable == JNI_TRUE && (recording_dir != NULL) &&
-//          (data->rtspsrc_url != NULL)) {
-//    alogi ("start recording video stream to %s", recording_dir);
-//    recording_start (data, recording_dir);
-//    return JNI_TRUE;
-//  } else if (enable == JNI_FALSE) {
-//    recording_stop (data);
-//    return JNI_TRUE;
-//  }
-//
+  if (!data || !data->pipeline || !dir) {
+    aloge ("Save pre-event: data, pipeline or dir is null");
+    return JNI_FALSE;
+  }
 
-  aloge ("Recording do not support now!");
+  pre_event_dir = (*env)->GetStringUTFChars (env, dir, NULL);
+  notify_worker_branch (data, WORKER_CMD_SAVE_PRE_EVENT, NULL, gst_structure_new ("pre-event",
+          "dir", G_TYPE_STRING, pre_event_dir, "post-seconds", G_TYPE_INT, (gint) post_seconds, NULL));
+  (*env)->ReleaseStringUTFChars (env, dir, pre_event_dir);
 
-  return JNI_FALSE;
+  return JNI_TRUE;
 }
 
 static void gst_native_set_rtsp_url (JNIEnv* env, jobject thiz, jstring media_url) {
@@ -1847,84 +5710,499 @@ static void gst_native_set_rtsp_url (JNIEnv* env, jobject thiz, jstring media_ur
   data = GET_CUSTOM_DATA (env, thiz, custom_data_field_id);
   _media_url = (*env)->GetStringUTFChars (env, media_url, NULL);
 
-  if (!g_strcmp0 (data->rtspsrc_url, _media_url))
-      return;
+  if (g_strcmp0 (data->rtspsrc_url, _media_url)) {
+    g_free (data->rtspsrc_url);
+    data->rtspsrc_url = g_strdup (_media_url);
+  }
+  (*env)->ReleaseStringUTFChars (env, media_url, _media_url);
+}
+
+/* Connect to media_url now, the display or any other branch started later finds it running */
+static void gst_native_preroll (JNIEnv* env, jobject thiz, jstring media_url) {
+  CustomData *data = GET_CUSTOM_DATA (env, thiz, custom_data_field_id);
+  const gchar *_media_url;
+
+  if (!data || !media_url)
+    return;
+
+  _media_url = (*env)->GetStringUTFChars (env, media_url, NULL);
+  if (*_media_url)
+    notify_worker_branch (data, WORKER_CMD_PREROLL, _media_url, NULL);
+  (*env)->ReleaseStringUTFChars (env, media_url, _media_url);
+}
+
+static void gst_native_set_source_linger (JNIEnv* env, jobject thiz, jint linger_ms) {
+  CustomData *data = GET_CUSTOM_DATA (env, thiz, custom_data_field_id);
+
+  if (!data)
+    return;
+
+  alogi ("source linger: %dms", linger_ms);
+  data->source_linger_ms = linger_ms > 0 ? linger_ms : 0;
+}
+
+static void gst_native_set_jitter_policy (JNIEnv* env, jobject thiz, jint policy, jint min_ms, jint max_ms) {
+  CustomData *data = GET_CUSTOM_DATA (env, thiz, custom_data_field_id);
+  jitter_ctl *ctl;
+
+  if (!data || min_ms < 0 || max_ms < min_ms)
+    return;
+
+  ctl = &data->jitter;
+  g_mutex_lock (&ctl->lock);
+  ctl->policy = policy == JITTER_POLICY_SMOOTH ? JITTER_POLICY_SMOOTH : JITTER_POLICY_MIN_LATENCY;
+  ctl->min_ms = min_ms;
+  ctl->max_ms = max_ms;
+  ctl->latency_ms = CLAMP (ctl->latency_ms, ctl->min_ms, ctl->max_ms);
+  ctl->clean = 0;
+  if (ctl->jitterbuffer)
+    g_object_set (G_OBJECT(ctl->jitterbuffer), "latency", ctl->latency_ms, NULL);
+  g_mutex_unlock (&ctl->lock);
+
+  alogi ("jitter policy: %d [%d, %d]ms", policy, min_ms, max_ms);
+}
+
+/* The controller state, as a serialized "jitter" structure */
+static jstring gst_native_get_jitter_stats (JNIEnv* env, jobject thiz) {
+  CustomData *data = GET_CUSTOM_DATA (env, thiz, custom_data_field_id);
+  GstStructure *stats;
+  jitter_ctl *ctl;
+  jstring jstats;
+  gchar *str;
+
+  if (!data)
+    return NULL;
+
+  ctl = &data->jitter;
+  g_mutex_lock (&ctl->lock);
+  stats = gst_structure_new ("jitter",
+          "policy", G_TYPE_UINT, ctl->policy,
+          "latency", G_TYPE_UINT, ctl->latency_ms,
+          "min-latency", G_TYPE_UINT, ctl->min_ms,
+          "max-latency", G_TYPE_UINT, ctl->max_ms,
+          "jitter", G_TYPE_UINT64, ctl->jitter_ns / GST_USECOND,
+          "drop-rate", G_TYPE_DOUBLE, ctl->drop_rate,
+          "num-pushed", G_TYPE_UINT64, ctl->pushed,
+          "num-lost", G_TYPE_UINT64, ctl->lost,
+          "num-late", G_TYPE_UINT64, ctl->late,
+          "active", G_TYPE_BOOLEAN, ctl->jitterbuffer != NULL, NULL);
+  g_mutex_unlock (&ctl->lock);
+
+  str = gst_structure_to_string (stats);
+  jstats = (*env)->NewStringUTF (env, str);
+  g_free (str);
+  gst_structure_free (stats);
+
+  return jstats;
+}
+
+/* Size, frame rate, profile and level from the SPS of the running session */
+static jstring gst_native_get_media_info (JNIEnv* env, jobject thiz) {
+  CustomData *data = GET_CUSTOM_DATA (env, thiz, custom_data_field_id);
+  media_info *mi;
+  GstStructure *info;
+  jstring jinfo;
+  gchar *str;
+
+  if (!data)
+    return NULL;
+
+  mi = &data->media;
+  g_mutex_lock (&mi->lock);
+  if (!mi->known) {
+    g_mutex_unlock (&mi->lock);
+    return NULL;
+  }
+  info = gst_structure_new ("media",
+          "width", G_TYPE_INT, mi->width,
+          "height", G_TYPE_INT, mi->height,
+          "framerate", GST_TYPE_FRACTION, mi->fps_n, mi->fps_d,
+          "profile", G_TYPE_STRING, mi->profile,
+          "level", G_TYPE_STRING, mi->level, NULL);
+  g_mutex_unlock (&mi->lock);
+
+  str = gst_structure_to_string (info);
+  jinfo = (*env)->NewStringUTF (env, str);
+  g_free (str);
+  gst_structure_free (info);
+
+  return jinfo;
+}
+
+/* Where the session cache lives across runs of the application */
+static void gst_native_set_cache_dir (JNIEnv* env, jobject thiz, jstring dir) {
+  const gchar *cache_dir;
+
+  if (!dir)
+    return;
+
+  cache_dir = (*env)->GetStringUTFChars (env, dir, NULL);
+  session_cache_load (cache_dir);
+  (*env)->ReleaseStringUTFChars (env, dir, cache_dir);
+}
+
+/* Hand cached caps to the branches of a new session, off to compare the time to first frame */
+static void gst_native_set_session_cache (JNIEnv* env, jobject thiz, jboolean enabled) {
+  CustomData *data = GET_CUSTOM_DATA (env, thiz, custom_data_field_id);
+
+  if (!data)
+    return;
+
+  data->session_cache_enabled = enabled;
+  alogi ("session cache: %s", enabled ? "on" : "off");
+}
+
+/* The JSON phase breakdown of the last session that reached its first frame */
+static jstring gst_native_get_ttff_report (JNIEnv* env, jobject thiz) {
+  CustomData *data = GET_CUSTOM_DATA (env, thiz, custom_data_field_id);
+  jstring jreport = NULL;
+
+  if (!data)
+    return NULL;
+
+  g_mutex_lock (&data->ttff.lock);
+  if (data->ttff.report)
+    jreport = (*env)->NewStringUTF (env, data->ttff.report);
+  g_mutex_unlock (&data->ttff.lock);
+
+  return jreport;
+}
+
+/* TRANSPORT_AUTO, or pin the source to UDP or TCP interleaved */
+static void gst_native_set_transport_policy (JNIEnv* env, jobject thiz, jint policy) {
+  CustomData *data = GET_CUSTOM_DATA (env, thiz, custom_data_field_id);
+  transport_policy *tp;
+  gboolean tcp;
+
+  if (!data || policy < TRANSPORT_AUTO || policy > TRANSPORT_TCP)
+    return;
+
+  tp = &data->transport;
+  g_mutex_lock (&tp->lock);
+  tp->policy = policy;
+  tp->probing = FALSE;
+  tp->probe_s = TRANSPORT_PROBE_S;
+  tcp = policy == TRANSPORT_TCP;
+  if (tcp != tp->tcp)
+    transport_switch_unlocked (data, tcp, "policy");
+  g_mutex_unlock (&tp->lock);
+
+  alogi ("transport policy: %d", policy);
+}
+
+/* The transport in use and the switches so far, as a serialized "transport" structure */
+static jstring gst_native_get_transport_stats (JNIEnv* env, jobject thiz) {
+  CustomData *data = GET_CUSTOM_DATA (env, thiz, custom_data_field_id);
+  transport_policy *tp;
+  GstStructure *stats;
+  jstring jstats;
+  gchar *str;
+
+  if (!data)
+    return NULL;
+
+  tp = &data->transport;
+  g_mutex_lock (&tp->lock);
+  stats = gst_structure_new ("transport",
+          "policy", G_TYPE_INT, tp->policy,
+          "protocol", G_TYPE_STRING, tp->tcp ? "tcp" : "udp",
+          "probing", G_TYPE_BOOLEAN, tp->probing,
+          "probe-interval", G_TYPE_UINT, tp->probe_s,
+          "num-switches", G_TYPE_UINT64, tp->switches, NULL);
+  g_mutex_unlock (&tp->lock);
+
+  str = gst_structure_to_string (stats);
+  jstats = (*env)->NewStringUTF (env, str);
+  g_free (str);
+  gst_structure_free (stats);
+
+  return jstats;
+}
+
+/* A source silent for stall_ms is restarted, 0 leaves it to rtspsrc */
+static void gst_native_set_stall_timeout (JNIEnv* env, jobject thiz, jint stall_ms) {
+  CustomData *data = GET_CUSTOM_DATA (env, thiz, custom_data_field_id);
+
+  if (!data)
+    return;
+
+  g_mutex_lock (&data->watchdog.lock);
+  data->watchdog.stall_ms = MAX (stall_ms, 0);
+  g_mutex_unlock (&data->watchdog.lock);
+
+  alogi ("stall timeout: %dms", stall_ms);
+}
+
+/* Arrival interval, time since the last buffer and IDR and the stalls seen, as a "watchdog" structure */
+static jstring gst_native_get_stall_stats (JNIEnv* env, jobject thiz) {
+  CustomData *data = GET_CUSTOM_DATA (env, thiz, custom_data_field_id);
+  stall_watchdog *wd;
+  GstStructure *stats;
+  jstring jstats;
+  gint64 now;
+  gchar *str;
+
+  if (!data)
+    return NULL;
+
+  wd = &data->watchdog;
+  now = g_get_monotonic_time ();
+  g_mutex_lock (&wd->lock);
+  stats = gst_structure_new ("watchdog",
+          "stall-timeout", G_TYPE_UINT, wd->stall_ms,
+          "interval", G_TYPE_UINT, (guint) (wd->interval_us / G_TIME_SPAN_MILLISECOND),
+          "gop", G_TYPE_UINT, (guint) (wd->gop_us / G_TIME_SPAN_MILLISECOND),
+          "since-buffer", G_TYPE_UINT, wd->last_us ? (guint) ((now - wd->last_us) / G_TIME_SPAN_MILLISECOND) : 0,
+          "since-idr", G_TYPE_UINT, wd->last_idr_us ? (guint) ((now - wd->last_idr_us) / G_TIME_SPAN_MILLISECOND) : 0,
+          "num-stalls", G_TYPE_UINT64, wd->stalls,
+          "detect-time", G_TYPE_UINT, (guint) (wd->detect_us / G_TIME_SPAN_MILLISECOND),
+          "max-detect-time", G_TYPE_UINT, (guint) (wd->detect_max_us / G_TIME_SPAN_MILLISECOND),
+          "armed", G_TYPE_BOOLEAN, wd->last_us != 0, NULL);
+  g_mutex_unlock (&wd->lock);
+
+  str = gst_structure_to_string (stats);
+  jstats = (*env)->NewStringUTF (env, str);
+  g_free (str);
+  gst_structure_free (stats);
+
+  return jstats;
+}
+
+/* The backoff state and the time the last outages took to recover, as a "reconnect" structure */
+static jstring gst_native_get_reconnect_stats (JNIEnv* env, jobject thiz) {
+  CustomData *data = GET_CUSTOM_DATA (env, thiz, custom_data_field_id);
+  reconnect_backoff *rc;
+  GstStructure *stats;
+  jstring jstats;
+  gchar *str;
+
+  if (!data)
+    return NULL;
+
+  rc = &data->reconnect;
+  g_mutex_lock (&rc->lock);
+  stats = gst_structure_new ("reconnect",
+          "num-reconnects", G_TYPE_UINT64, rc->count,
+          "attempt", G_TYPE_UINT, rc->attempt,
+          "delay", G_TYPE_UINT, rc->delay_ms,
+          "time-to-recover", G_TYPE_UINT, (guint) (rc->recover_us / G_TIME_SPAN_MILLISECOND),
+          "max-time-to-recover", G_TYPE_UINT, (guint) (rc->recover_max_us / G_TIME_SPAN_MILLISECOND),
+          "down", G_TYPE_BOOLEAN, rc->failed_us != 0, NULL);
+  g_mutex_unlock (&rc->lock);
+
+  str = gst_structure_to_string (stats);
+  jstats = (*env)->NewStringUTF (env, str);
+  g_free (str);
+  gst_structure_free (stats);
+
+  return jstats;
+}
+
+/* Frames older than deadline_ms are dropped ahead of the decoder, 0 keeps them all */
+static void gst_native_set_display_deadline (JNIEnv* env, jobject thiz, jint deadline_ms) {
+  CustomData *data = GET_CUSTOM_DATA (env, thiz, custom_data_field_id);
+
+  if (!data)
+    return;
+
+  g_mutex_lock (&data->deadline.lock);
+  data->deadline.deadline_ms = MAX (deadline_ms, 0);
+  g_mutex_unlock (&data->deadline.lock);
+
+  alogi ("display deadline: %dms", deadline_ms);
+}
+
+/* The drop counters and the last display latency, as a serialized "display" structure */
+static jstring gst_native_get_display_stats (JNIEnv* env, jobject thiz) {
+  CustomData *data = GET_CUSTOM_DATA (env, thiz, custom_data_field_id);
+  display_deadline *dl;
+  GstStructure *stats;
+  jstring jstats;
+  gchar *str;
+
+  if (!data)
+    return NULL;
 
-  if (data->rtspsrc_url) {
-      g_free (data->rtspsrc_url);
-      data->rtspsrc_url = NULL;
+  dl = &data->deadline;
+  g_mutex_lock (&dl->lock);
+  stats = gst_structure_new ("display",
+          "deadline", G_TYPE_UINT, dl->deadline_ms,
+          "latency", G_TYPE_UINT, (guint) (dl->latency_us / 1000),
+          "num-frames", G_TYPE_UINT64, dl->frames,
+          "num-late", G_TYPE_UINT64, dl->late,
+          "num-skipped", G_TYPE_UINT64, dl->skipped,
+          "num-resyncs", G_TYPE_UINT64, dl->resyncs,
+          "resync", G_TYPE_BOOLEAN, dl->resync, NULL);
+  g_mutex_unlock (&dl->lock);
+
+  str = gst_structure_to_string (stats);
+  jstats = (*env)->NewStringUTF (env, str);
+  g_free (str);
+  gst_structure_free (stats);
+
+  return jstats;
+}
+
+/* Time one buffer in rate through each element, 0 stops */
+static void gst_native_set_trace_rate (JNIEnv* env, jobject thiz, jint rate) {
+  CustomData *data = GET_CUSTOM_DATA (env, thiz, custom_data_field_id);
+
+  if (!data)
+    return;
+
+  alogi ("trace rate: 1/%d", rate);
+  trace_set_rate (&data->trace, rate);
+}
+
+static jstring gst_native_get_trace_stats (JNIEnv* env, jobject thiz) {
+  CustomData *data = GET_CUSTOM_DATA (env, thiz, custom_data_field_id);
+  jstring jstats;
+  gchar *stats;
+
+  if (!data)
+    return NULL;
+
+  stats = trace_format (&data->trace);
+  jstats = (*env)->NewStringUTF (env, stats);
+  g_free (stats);
+
+  return jstats;
+}
+
+static jboolean gst_native_dump_trace (JNIEnv* env, jobject thiz, jstring path) {
+  CustomData *data = GET_CUSTOM_DATA (env, thiz, custom_data_field_id);
+  const gchar *trace_path;
+  GError *error = NULL;
+  gchar *stats;
+
+  if (!data || !path)
+    return JNI_FALSE;
+
+  trace_path = (*env)->GetStringUTFChars (env, path, NULL);
+  stats = trace_format (&data->trace);
+  if (!g_file_set_contents (trace_path, stats, -1, &error)) {
+    aloge ("dump trace %s: %s", trace_path, error->message);
+    g_error_free (error);
   }
-  data->rtspsrc_url = g_strdup (_media_url);
+  g_free (stats);
+  (*env)->ReleaseStringUTFChars (env, path, trace_path);
+
+  return error ? JNI_FALSE : JNI_TRUE;
 }
 
 static void gst_native_set_rtmp_url (JNIEnv* env, jobject thiz, jstring media_url) {
   CustomData *data;
   const gchar *_media_url;
-  gboolean str_cmp;
 
   data = GET_CUSTOM_DATA (env, thiz, custom_data_field_id);
   _media_url = (*env)->GetStringUTFChars (env, media_url, NULL);
-  str_cmp = g_strcmp0 (data->push_rtmp_url, _media_url) == 0;
-
-  if (str_cmp)
-      return;
-
-  if (data->push_rtmp_url) {
-      g_free (data->push_rtmp_url);
-      data->push_rtmp_url = NULL;
-  }
 
-  data->push_rtmp_url = g_strdup (_media_url);
+  notify_worker_branch (data, WORKER_CMD_ADD_BRANCH, BRANCH_ID_PUSH_RTMP,
+          gst_structure_new (push_rtmp_desc.type, "location", G_TYPE_STRING, _media_url, NULL));
+  (*env)->ReleaseStringUTFChars (env, media_url, _media_url);
 }
 
 static jboolean gst_native_push_stream (JNIEnv* env, jobject thiz,
         jboolean enable, jstring url) {
-  guint cmd;
+  const branch_desc *desc;
+  const gchar *id;
   CustomData *data = GET_CUSTOM_DATA (env, thiz, custom_data_field_id);
-  const gchar *stream_url = (*env)->GetStringUTFChars (env, url, NULL);
+  const gchar *stream_url;
 
   if (!data || !data->pipeline) {
       aloge ("Push Stream : data or pipeline is null");
       return JNI_FALSE;
   }
 
-
   if (!data->rtspsrc_url) {
     alogi ("Push RTSP Stream: failed, rtsp (src) url is NULL");
     return JNI_FALSE;
   }
 
+  stream_url = url ? (*env)->GetStringUTFChars (env, url, NULL) : NULL;
   if (!stream_url) {
     alogi ("Push Stream: failed, Push url is NULL");
     return JNI_FALSE;
   }
 
   if (g_str_has_prefix (stream_url, "rtmp")) {
-    if (g_strcmp0 (data->push_rtmp_url, stream_url)) {
-      if (data->push_rtmp_url)
-        g_free (data->push_rtmp_url);
-      data->push_rtmp_url = g_strdup (stream_url);
-    }
+    id = BRANCH_ID_PUSH_RTMP;
+    desc = &push_rtmp_desc;
+  } else if (g_str_has_prefix (stream_url, "rtsp")) {
+    id = BRANCH_ID_PUSH_RTSP;
+    desc = &push_rtsp_desc;
+  } else {
+    aloge ("Push Stream: unsupported url %s", stream_url);
+    (*env)->ReleaseStringUTFChars (env, url, stream_url);
+    return JNI_FALSE;
+  }
 
-    if (enable)
-      cmd = WORKER_CMD_START_PUSH_RTMP;
-    else
-      cmd = WORKER_CMD_STOP_PUSH_RTMP;
+  if (enable) {
+    notify_worker_branch (data, WORKER_CMD_ADD_BRANCH, id,
+            gst_structure_new (desc->type, "location", G_TYPE_STRING, stream_url, NULL));
+    notify_worker_branch (data, WORKER_CMD_START_BRANCH, id, NULL);
+  } else {
+    notify_worker_branch (data, WORKER_CMD_STOP_BRANCH, id, NULL);
+  }
 
-  } else if (g_str_has_prefix (stream_url, "rtsp")) {
-    if (g_strcmp0 (data->push_rtsp_url, stream_url)) {
-      if (data->push_rtsp_url)
-        g_free (data->push_rtsp_url);
-      data->push_rtsp_url = g_strdup (stream_url);
-    }
+  (*env)->ReleaseStringUTFChars (env, url, stream_url);
+  return JNI_TRUE;
+}
 
-    if (enable)
-      cmd = WORKER_CMD_START_PUSH_RTSP;
-    else
-      cmd = WORKER_CMD_STOP_PUSH_RTSP;
+/*
+ * Add an output under id and start it. spec is a GstStructure string naming the branch
+ * type, e.g. "rtmp, location=rtmp://host/live/key" or "file, dir=/sdcard/Movies"; its
+ * other fields are set on the branch sink.
+ */
+static jboolean gst_native_add_branch (JNIEnv* env, jobject thiz, jstring id, jstring spec) {
+  CustomData *data = GET_CUSTOM_DATA (env, thiz, custom_data_field_id);
+  GstStructure *structure;
+  const gchar *_id, *_spec;
+  jboolean ret = JNI_FALSE;
+
+  if (!data || !data->pipeline || !data->rtspsrc_url) {
+    aloge ("Add Branch: data, pipeline or rtsp (src) url is null");
+    return JNI_FALSE;
   }
 
-  notify_worker_update_pipeline (data, cmd);
+  _id = (*env)->GetStringUTFChars (env, id, NULL);
+  _spec = (*env)->GetStringUTFChars (env, spec, NULL);
+
+  do {
+    structure = gst_structure_from_string (_spec, NULL);
+    if (!structure) {
+      aloge ("Add Branch %s: bad spec %s", _id, _spec);
+      break;
+    }
+
+    /* there is one window, the display branch is driven by play/stop */
+    if (!branch_desc_lookup (gst_structure_get_name (structure)) ||
+        !g_strcmp0 (gst_structure_get_name (structure), display_desc.type)) {
+      aloge ("Add Branch %s: unsupported type %s", _id, gst_structure_get_name (structure));
+      gst_structure_free (structure);
+      break;
+    }
+
+    notify_worker_branch (data, WORKER_CMD_ADD_BRANCH, _id, structure);
+    notify_worker_branch (data, WORKER_CMD_START_BRANCH, _id, NULL);
+    ret = JNI_TRUE;
+  } while (0);
+
+  (*env)->ReleaseStringUTFChars (env, id, _id);
+  (*env)->ReleaseStringUTFChars (env, spec, _spec);
+  return ret;
+}
+
+static jboolean gst_native_remove_branch (JNIEnv* env, jobject thiz, jstring id) {
+  CustomData *data = GET_CUSTOM_DATA (env, thiz, custom_data_field_id);
+  const gchar *_id;
+
+  if (!data)
+    return JNI_FALSE;
+
+  _id = (*env)->GetStringUTFChars (env, id, NULL);
+  notify_worker_branch (data, WORKER_CMD_REMOVE_BRANCH, _id, NULL);
+  (*env)->ReleaseStringUTFChars (env, id, _id);
 
   return JNI_TRUE;
 }
@@ -1957,6 +6235,27 @@ static JNINativeMethod native_methods[] = {
   { "nativePushStream", "(ZLjava/lang/String;)Z", (void *) gst_native_push_stream},
   { "nativeSetRTSPURL", "(Ljava/lang/String;)V", (void *) gst_native_set_rtsp_url},
   { "nativeSetRTMPURL", "(Ljava/lang/String;)V", (void *) gst_native_set_rtmp_url},
+  { "nativePreroll", "(Ljava/lang/String;)V", (void *) gst_native_preroll},
+  { "nativeSetSourceLinger", "(I)V", (void *) gst_native_set_source_linger},
+  { "nativeSetJitterPolicy", "(III)V", (void *) gst_native_set_jitter_policy},
+  { "nativeGetJitterStats", "()Ljava/lang/String;", (void *) gst_native_get_jitter_stats},
+  { "nativeGetMediaInfo", "()Ljava/lang/String;", (void *) gst_native_get_media_info},
+  { "nativeSetSessionCache", "(Z)V", (void *) gst_native_set_session_cache},
+  { "nativeSetCacheDir", "(Ljava/lang/String;)V", (void *) gst_native_set_cache_dir},
+  { "nativeGetTtffReport", "()Ljava/lang/String;", (void *) gst_native_get_ttff_report},
+  { "nativeSetTransportPolicy", "(I)V", (void *) gst_native_set_transport_policy},
+  { "nativeGetTransportStats", "()Ljava/lang/String;", (void *) gst_native_get_transport_stats},
+  { "nativeSetStallTimeout", "(I)V", (void *) gst_native_set_stall_timeout},
+  { "nativeGetStallStats", "()Ljava/lang/String;", (void *) gst_native_get_stall_stats},
+  { "nativeGetReconnectStats", "()Ljava/lang/String;", (void *) gst_native_get_reconnect_stats},
+  { "nativeSetDisplayDeadline", "(I)V", (void *) gst_native_set_display_deadline},
+  { "nativeGetDisplayStats", "()Ljava/lang/String;", (void *) gst_native_get_display_stats},
+  { "nativeSetTraceRate", "(I)V", (void *) gst_native_set_trace_rate},
+  { "nativeGetTraceStats", "()Ljava/lang/String;", (void *) gst_native_get_trace_stats},
+  { "nativeDumpTrace", "(Ljava/lang/String;)Z", (void *) gst_native_dump_trace},
+  { "nativeAddBranch", "(Ljava/lang/String;Ljava/lang/String;)Z", (void *) gst_native_add_branch},
+  { "nativeRemoveBranch", "(Ljava/lang/String;)Z", (void *) gst_native_remove_branch},
+  { "nativeSavePreEvent", "(Ljava/lang/String;I)Z", (void *) gst_native_save_pre_event},
   { "nativeClassInit", "()Z", (void *) gst_native_class_init}
 };
 
@@ -37,7 +37,9 @@ public class VideoStream {
     private boolean isPlaying = false;
     private boolean isRtspPushing = false;
     private boolean isRtmpPushing = false;
+    private boolean isRecording = false;
     private boolean isSurfaceInited = false;
+    private boolean mPreroll = false;
     private Handler mHandler = null;
 
     public VideoStream(Context context, String streamUrl, VideoStreamListener listener) {
@@ -101,9 +103,173 @@ public class VideoStream {
             }
             mStreamUrl = url;
             nativeSetRTSPURL(mStreamUrl);
+            if (mPreroll && !isPlaying) {
+                nativePreroll(mStreamUrl);
+            }
+        }
+    }
+
+    /**
+     * Connect to the stream as soon as its URL is set, before the surface
+     * exists, so play() only has to attach the display to a running session.
+     * The session is dropped if nothing uses it within 15 seconds, or after the
+     * source linger time if that is longer. Off by default.
+     */
+    public void setPreroll(boolean enabled) {
+        mPreroll = enabled;
+        if (mPreroll && mStreamUrl != null && !isPlaying) {
+            nativePreroll(mStreamUrl);
         }
     }
 
+    /**
+     * Keep the rtsp session connected for lingerMs milliseconds after the last
+     * consumer (display or push) stops, so that restarting it is near-instant.
+     * 0 tears the session down immediately.
+     */
+    public void setSourceLingerTime(int lingerMs) {
+        nativeSetSourceLinger(lingerMs);
+    }
+
+    public static final int JITTER_POLICY_MIN_LATENCY = 0;
+    public static final int JITTER_POLICY_SMOOTH = 1;
+
+    /**
+     * Let the receive latency follow the link within [minMs, maxMs].
+     * JITTER_POLICY_MIN_LATENCY stays as low as the late packets allow,
+     * JITTER_POLICY_SMOOTH backs off on any late packet and comes down slowly.
+     */
+    public void setJitterPolicy(int policy, int minMs, int maxMs) {
+        nativeSetJitterPolicy(policy, minMs, maxMs);
+    }
+
+    /**
+     * The current latency, bounds, jitter and drop rate, e.g.
+     * "jitter, policy=(uint)0, latency=(uint)35, ..., drop-rate=(double)0.001, ...".
+     */
+    public String getJitterStats() {
+        return nativeGetJitterStats();
+    }
+
+    /**
+     * Size, frame rate, profile and level of the stream from its SPS, e.g.
+     * "media, width=(int)1920, height=(int)1080, framerate=(fraction)30/1,
+     * profile=(string)high, level=(string)4.1". Known as soon as the SDP is in when
+     * the camera announces its parameter sets there, null before.
+     */
+    public String getMediaInfo() {
+        return nativeGetMediaInfo();
+    }
+
+    /**
+     * A new session of a URL played before hands the caps of the last one to the
+     * decoder as soon as the stream is set up, unless the camera announced other
+     * parameter sets. The parameters, with the transport and jitter latency the
+     * session settled on, are kept in the application cache directory for the next
+     * start. On by default. In getTtffReport(), "session_cache" tells whether it
+     * was on, "seeded" whether the transport and latency came from the cache file
+     * and "cached" whether the decoder got the caps early. To compare, play the
+     * same URL N times with it on and N times off, killing the app between runs
+     * for a cold start, and collect the "ttff:" lines of
+     * adb logcat -s SongRTSPClientJNI.
+     */
+    public void setSessionCache(boolean enabled) {
+        nativeSetSessionCache(enabled);
+    }
+
+    /**
+     * Where the time to the first frame of the last new session went, in ms from
+     * play, as JSON: {"session":1,"gstreamer":"1.16.2","session_cache":"on",
+     * "seeded":false,"cached":false,"connect_ms":12.4,"sdp_ms":30.1,
+     * "play_ms":61.0,"first_rtp_ms":63.2,"first_idr_ms":410.7,"first_decoded_ms":452.3,
+     * "first_render_ms":455.0}. null until a session got that far.
+     */
+    public String getTtffReport() {
+        return nativeGetTtffReport();
+    }
+
+    public static final int TRANSPORT_AUTO = 0;
+    public static final int TRANSPORT_UDP = 1;
+    public static final int TRANSPORT_TCP = 2;
+
+    /**
+     * TRANSPORT_AUTO receives over UDP and moves to TCP interleaved while UDP loses
+     * more than 5% of the packets, trying UDP again later. TRANSPORT_UDP and
+     * TRANSPORT_TCP pin the transport. Switching keeps the decoder running.
+     */
+    public void setTransportPolicy(int policy) {
+        nativeSetTransportPolicy(policy);
+    }
+
+    /**
+     * The transport in use and the switches so far, e.g. "transport, policy=(int)0,
+     * protocol=(string)tcp, probing=(boolean)false, probe-interval=(uint)60, num-switches=(guint64)1;".
+     */
+    public String getTransportStats() {
+        return nativeGetTransportStats();
+    }
+
+    /**
+     * Restart the stream when no video arrived for stallMs, or three times the
+     * usual frame interval if that is longer. 0 waits for the RTSP source to fail
+     * on its own. The default is 500ms.
+     */
+    public void setStallTimeout(int stallMs) {
+        nativeSetStallTimeout(stallMs);
+    }
+
+    /**
+     * Arrival interval, time since the last frame and IDR, and the stalls detected
+     * with the silence that declared them, in ms, e.g. "watchdog, stall-timeout=(uint)500,
+     * interval=(uint)33, gop=(uint)1000, ..., num-stalls=(guint64)1, detect-time=(uint)540, ...".
+     */
+    public String getStallStats() {
+        return nativeGetStallStats();
+    }
+
+    /**
+     * The reconnect count, the current backoff and the time the last outage took
+     * to recover, in ms, e.g. "reconnect, num-reconnects=(guint64)3, attempt=(uint)0, ...,
+     * time-to-recover=(uint)1320, max-time-to-recover=(uint)1320, down=(boolean)false;".
+     */
+    public String getReconnectStats() {
+        return nativeGetReconnectStats();
+    }
+
+    /**
+     * Frames that reached the device more than deadlineMs ago are dropped ahead of
+     * the decoder, together with the frames depending on them up to the next IDR.
+     * 0 shows every frame. The default is 500ms.
+     */
+    public void setDisplayDeadline(int deadlineMs) {
+        nativeSetDisplayDeadline(deadlineMs);
+    }
+
+    /**
+     * The deadline, the last arrival-to-render latency in ms and the drop counters, e.g.
+     * "display, deadline=(uint)500, latency=(uint)38, num-frames=(guint64)9000, num-late=(guint64)12, ...".
+     */
+    public String getDisplayStats() {
+        return nativeGetDisplayStats();
+    }
+
+    /**
+     * Time one buffer in everyNth through each element of the stream, 0 stops.
+     * The per element histograms start over on every call.
+     */
+    public void setTraceSampleRate(int everyNth) {
+        nativeSetTraceRate(everyNth);
+    }
+
+    /** One line per element: transit count, avg, max, percentiles and log2 buckets, in us. */
+    public String getTraceStats() {
+        return nativeGetTraceStats();
+    }
+
+    public boolean dumpTrace(String path) {
+        return nativeDumpTrace(path);
+    }
+
     public void setSurface(Surface surface) {
         if (surface == null) {
             if (isSurfaceInited) {
@@ -210,6 +376,63 @@ public class VideoStream {
         return  isRtmpPushing | isRtspPushing;
     }
 
+    /**
+     * Record the stream into dir, as FLV segments of up to five minutes that
+     * each start on a key frame.
+     */
+    public boolean startRecording(String dir) {
+        if (mStreamUrl == null) {
+            Log.e(TAG, "rtsp source url is not set, recording failed");
+            return false;
+        }
+        if (!isRecording) {
+            nativeSetRTSPURL(mStreamUrl);
+            isRecording = nativeRecording(true, dir);
+        }
+        return isRecording;
+    }
+
+    public void stopRecording() {
+        if (isRecording) {
+            nativeRecording(false, null);
+            isRecording = false;
+        }
+    }
+
+    public boolean isRecording() {
+        return isRecording;
+    }
+
+    /**
+     * Add an output of the rtsp source under its own id and start it, alongside
+     * the display and any other output. spec names the output type and its
+     * settings, e.g. "rtmp, location=rtmp://host/live/key",
+     * "rtsp, location=rtsp://host/live" or
+     * "file, dir=/sdcard/Movies, segment-seconds=60, segment-mbytes=100".
+     * Other fields are set as properties of the output's sink.
+     */
+    public boolean addBranch(String id, String spec) {
+        if (mStreamUrl == null) {
+            Log.e(TAG, "rtsp source url is not set, add branch failed");
+            return false;
+        }
+        nativeSetRTSPURL(mStreamUrl);
+        return nativeAddBranch(id, spec);
+    }
+
+    public boolean removeBranch(String id) {
+        return nativeRemoveBranch(id);
+    }
+
+    /**
+     * Save the last 30 seconds of the stream, kept in memory while it runs,
+     * and the next postSeconds to a file in dir. Works after a lost link as
+     * well. The file is complete once the post seconds are over.
+     */
+    public boolean savePreEvent(String dir, int postSeconds) {
+        return nativeSavePreEvent(dir, postSeconds);
+    }
+
     protected void initLibraries(Context context) {
         System.loadLibrary("gstreamer_android");
         System.loadLibrary("songrtspclient");
@@ -224,6 +447,7 @@ public class VideoStream {
         if (!nativeInit()) {
             Log.e(TAG, "initLibraries failed on nativeInit");
         } else {
+            nativeSetCacheDir(context.getCacheDir().getAbsolutePath());
             Log.i(TAG, "initLibraries done. (custom data:" + native_custom_data + ")");
         }
     }
@@ -278,4 +502,25 @@ public class VideoStream {
     private native boolean nativePushStream(boolean startPushStream, String Url);
     private native void nativeSetRTSPURL(String mediaUrl);
     private native void nativeSetRTMPURL(String mediaUrl);
+    private native void nativePreroll(String mediaUrl);
+    private native void nativeSetSourceLinger(int lingerMs);
+    private native void nativeSetJitterPolicy(int policy, int minMs, int maxMs);
+    private native String nativeGetJitterStats();
+    private native String nativeGetMediaInfo();
+    private native void nativeSetSessionCache(boolean enabled);
+    private native void nativeSetCacheDir(String dir);
+    private native String nativeGetTtffReport();
+    private native void nativeSetTransportPolicy(int policy);
+    private native String nativeGetTransportStats();
+    private native void nativeSetStallTimeout(int stallMs);
+    private native String nativeGetStallStats();
+    private native String nativeGetReconnectStats();
+    private native void nativeSetDisplayDeadline(int deadlineMs);
+    private native String nativeGetDisplayStats();
+    private native void nativeSetTraceRate(int rate);
+    private native String nativeGetTraceStats();
+    private native boolean nativeDumpTrace(String path);
+    private native boolean nativeAddBranch(String id, String spec);
+    private native boolean nativeRemoveBranch(String id);
+    private native boolean nativeSavePreEvent(String dir, int postSeconds);
 }